@@ -0,0 +1,268 @@
+#pragma once
+
+/*
+
+bench_harness.hpp
+Copyright 2020 Riley Lannon
+
+Timing, result collection and JSON reporting shared by the benchmarks
+
+*/
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <memory>
+
+#include "perf_counters.hpp"
+
+namespace bench
+{
+    // results are accumulated into this so the measured work cannot be optimized away
+    extern volatile uint64_t sink;
+
+    template <size_t Bytes>
+    struct payload
+    {
+        /*
+
+        payload
+        An element type of 'Bytes' bytes, so the containers can be compared across element sizes
+
+        */
+
+        static_assert(Bytes % 4 == 0 && Bytes > 0, "payload sizes are multiples of 4");
+
+        uint32_t words[Bytes / 4];
+
+        payload()
+            : words{} { }
+
+        explicit payload(uint64_t value)
+            : words{}
+        {
+            words[0] = static_cast<uint32_t>(value);
+        }
+
+        uint64_t value() const
+        {
+            return words[0];
+        }
+    };
+
+    struct options
+    {
+        std::vector<size_t> lengths;
+        size_t repetitions;
+        size_t latency_elements;    // how many elements the latency benchmark appends
+        double soak_seconds;        // how long each container is churned by the soak benchmark
+        size_t checkpoint_bytes;    // the size of the list the checkpoint benchmark writes
+        bool perf_counters;         // read hardware counters around each timed region
+        std::string filter;     // only run measurements whose "suite/operation" name contains this
+        std::string json_path;  // where to write the JSON report; empty for none
+    };
+
+    struct result
+    {
+        /*
+
+        result
+        One measurement: the median time per operation over the repetitions, plus any extra metrics
+
+        */
+
+        std::string suite;
+        std::string container;
+        std::string operation;
+        size_t element_size;
+        size_t length;
+        size_t operations;
+        double ns_per_op;
+        std::vector<std::pair<std::string, double> > metrics;
+    };
+
+    class harness
+    {
+        /*
+
+        harness
+        Runs measurements, prints a table as it goes and collects results for the JSON report
+
+        */
+
+        options _options;
+        std::vector<result> _results;
+
+        // the counters, if requested and permitted, and the counts from the last call to 'time'
+        std::unique_ptr<perf_counters> _counters;
+        std::vector<std::pair<std::string, double> > _last_counts;
+
+        static void _write_string(FILE* out, const std::string& s)
+        {
+            std::fputc('"', out);
+            for (auto c : s)
+            {
+                if (c == '"' || c == '\\')
+                {
+                    std::fputc('\\', out);
+                }
+
+                std::fputc(c, out);
+            }
+            std::fputc('"', out);
+        }
+    public:
+        using clock = std::chrono::steady_clock;
+
+        const options& get_options() const noexcept
+        {
+            return _options;
+        }
+
+        bool enabled(const std::string& suite, const std::string& operation) const
+        {
+            return _options.filter.empty() || (suite + "/" + operation).find(_options.filter) != std::string::npos;
+        }
+
+        template <typename Setup, typename Body>
+        double time(Setup setup, Body body)
+        {
+            /*
+
+            time
+            Returns the median wall time, in nanoseconds, of 'body' over the configured repetitions
+
+            'setup' runs before each repetition and is not timed. If hardware counters are enabled,
+            they are read around 'body' too, and the counts from the median repetition are attached
+            to the next recorded result.
+
+            */
+
+            std::vector<std::pair<double, std::vector<std::pair<std::string, double> > > > samples;
+            for (size_t r = 0; r < _options.repetitions; r++)
+            {
+                setup();
+                if (_counters)
+                {
+                    _counters->start();
+                }
+
+                auto start = clock::now();
+                body();
+                auto stop = clock::now();
+
+                std::vector<std::pair<std::string, double> > counts;
+                if (_counters)
+                {
+                    counts = _counters->stop();
+                }
+
+                samples.push_back({ std::chrono::duration<double, std::nano>(stop - start).count(), std::move(counts) });
+            }
+
+            std::sort(samples.begin(), samples.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+            auto& median = samples[samples.size() / 2];
+            _last_counts = std::move(median.second);
+            return median.first;
+        }
+
+        void record(result r)
+        {
+            // counts from the timed region are reported per operation
+            double cycles = 0;
+            double instructions = 0;
+            for (auto& count : _last_counts)
+            {
+                cycles = count.first == "cycles" ? count.second : cycles;
+                instructions = count.first == "instructions" ? count.second : instructions;
+                r.metrics.push_back({ count.first + "_per_op", r.operations ? count.second / static_cast<double>(r.operations) : 0 });
+            }
+
+            if (cycles > 0 && instructions > 0)
+            {
+                r.metrics.push_back({ "ipc", instructions / cycles });
+            }
+
+            _last_counts.clear();
+
+            std::printf("%-12s %-30s %-22s %6zu B %10zu %12.2f ns/op",
+                r.suite.c_str(), r.container.c_str(), r.operation.c_str(), r.element_size, r.length, r.ns_per_op);
+            for (auto& metric : r.metrics)
+            {
+                std::printf("  %s=%.4g", metric.first.c_str(), metric.second);
+            }
+            std::printf("\n");
+            std::fflush(stdout);
+
+            _results.push_back(std::move(r));
+        }
+
+        bool write_json() const
+        {
+            /*
+
+            write_json
+            Writes every recorded result to the configured path as a JSON document
+
+            */
+
+            if (_options.json_path.empty())
+            {
+                return true;
+            }
+
+            FILE* out = std::fopen(_options.json_path.c_str(), "w");
+            if (!out)
+            {
+                std::perror("segmented_list_bench");
+                return false;
+            }
+
+            std::fprintf(out, "{\n  \"repetitions\": %zu,\n  \"results\": [\n", _options.repetitions);
+            for (size_t i = 0; i < _results.size(); i++)
+            {
+                auto& r = _results[i];
+                std::fprintf(out, "    { \"suite\": ");
+                _write_string(out, r.suite);
+                std::fprintf(out, ", \"container\": ");
+                _write_string(out, r.container);
+                std::fprintf(out, ", \"operation\": ");
+                _write_string(out, r.operation);
+                std::fprintf(out, ", \"element_size\": %zu, \"length\": %zu, \"operations\": %zu, \"ns_per_op\": %.3f",
+                    r.element_size, r.length, r.operations, r.ns_per_op);
+
+                for (auto& metric : r.metrics)
+                {
+                    std::fprintf(out, ", ");
+                    _write_string(out, metric.first);
+                    std::fprintf(out, ": %.6g", metric.second);
+                }
+
+                std::fprintf(out, " }%s\n", i + 1 < _results.size() ? "," : "");
+            }
+            std::fprintf(out, "  ]\n}\n");
+
+            return std::fclose(out) == 0;
+        }
+
+        explicit harness(options opts)
+            : _options(std::move(opts))
+        {
+            if (_options.perf_counters)
+            {
+                _counters.reset(new perf_counters());
+                if (!_counters->available())
+                {
+                    // typically perf_event_paranoid forbids it, or this is a VM without a PMU
+                    std::fprintf(stderr, "segmented_list_bench: hardware counters are not available; reporting wall time only\n");
+                    _counters.reset();
+                }
+            }
+        }
+    };
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+/*
+
+latency_histogram.hpp
+Copyright 2020 Riley Lannon
+
+A log-linear latency histogram in the style of HdrHistogram
+
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+
+namespace bench
+{
+    class latency_histogram
+    {
+        /*
+
+        latency_histogram
+        Counts values (nanoseconds) in buckets whose width grows with their magnitude
+
+        Values below 2^sub_bucket_bits are counted exactly; above that, each power of two is split
+        into 2^(sub_bucket_bits - 1) buckets, so any recorded value is reported to within 1/64 of
+        itself. Recording is a shift and an increment, cheap enough to do around every operation.
+
+        */
+
+        static const unsigned sub_bucket_bits = 7;
+        static const uint64_t sub_bucket_count = uint64_t(1) << sub_bucket_bits;
+        static const uint64_t half_count = sub_bucket_count / 2;
+
+        std::vector<uint64_t> _counts;
+        uint64_t _total;
+        uint64_t _max;
+        double _sum;
+
+        static unsigned _msb(uint64_t value)
+        {
+            return 63 - static_cast<unsigned>(__builtin_clzll(value));
+        }
+
+        static size_t _index(uint64_t value)
+        {
+            if (value < sub_bucket_count)
+            {
+                return static_cast<size_t>(value);
+            }
+
+            // the top sub_bucket_bits bits of the value select the bucket within its power of two
+            auto shift = _msb(value) - (sub_bucket_bits - 1);
+            return static_cast<size_t>(sub_bucket_count + (shift - 1) * half_count + ((value >> shift) - half_count));
+        }
+
+        static uint64_t _highest_equivalent(size_t index)
+        {
+            if (index < sub_bucket_count)
+            {
+                return index;
+            }
+
+            auto j = index - sub_bucket_count;
+            auto shift = static_cast<unsigned>(j / half_count + 1);
+            auto mantissa = j % half_count + half_count;
+            return ((mantissa + 1) << shift) - 1;
+        }
+    public:
+        void record(uint64_t value)
+        {
+            _counts[_index(value)]++;
+            _total++;
+            _max = value > _max ? value : _max;
+            _sum += static_cast<double>(value);
+        }
+
+        uint64_t count() const noexcept
+        {
+            return _total;
+        }
+
+        uint64_t max() const noexcept
+        {
+            return _max;
+        }
+
+        double mean() const noexcept
+        {
+            return _total ? _sum / static_cast<double>(_total) : 0;
+        }
+
+        uint64_t percentile(double p) const
+        {
+            /*
+
+            percentile
+            Returns the smallest recorded bucket value at or below which 'p' percent of the values fall
+
+            */
+
+            if (_total == 0)
+            {
+                return 0;
+            }
+
+            auto target = static_cast<uint64_t>(p / 100.0 * static_cast<double>(_total) + 0.5);
+            target = std::max<uint64_t>(1, std::min(target, _total));
+
+            uint64_t seen = 0;
+            for (size_t i = 0; i < _counts.size(); i++)
+            {
+                seen += _counts[i];
+                if (seen >= target)
+                {
+                    return std::min(_highest_equivalent(i), _max);
+                }
+            }
+
+            return _max;
+        }
+
+        void print_percentiles(FILE* out, unsigned ticks_per_half = 5) const
+        {
+            /*
+
+            print_percentiles
+            Writes a percentile distribution table in the layout HdrHistogram uses
+
+            The percentiles reported get denser towards the tail: each half of the remaining
+            distribution (0-50%, 50-75%, 75-87.5%, ...) gets 'ticks_per_half' rows.
+
+            */
+
+            std::fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+
+            auto row = [&](double p) {
+                auto value = percentile(p);
+                uint64_t at_or_below = 0;
+                for (size_t i = 0; i < _counts.size() && _highest_equivalent(i) <= value; i++)
+                {
+                    at_or_below += _counts[i];
+                }
+
+                if (p < 100.0)
+                {
+                    std::fprintf(out, "%12llu %14.12f %10llu %14.2f\n",
+                        static_cast<unsigned long long>(value), p / 100.0, static_cast<unsigned long long>(at_or_below), 1.0 / (1.0 - p / 100.0));
+                }
+                else
+                {
+                    std::fprintf(out, "%12llu %14.12f %10llu\n",
+                        static_cast<unsigned long long>(value), 1.0, static_cast<unsigned long long>(at_or_below));
+                }
+            };
+
+            // stop once the remaining tail holds fewer than one value
+            double remaining = 100.0;
+            for (unsigned half = 0; remaining * static_cast<double>(_total) / 100.0 >= 1.0 && half < 64; half++)
+            {
+                for (unsigned t = 0; t < ticks_per_half; t++)
+                {
+                    row(100.0 - remaining + remaining / 2 * t / ticks_per_half);
+                }
+
+                remaining /= 2;
+            }
+            row(100.0);
+
+            std::fprintf(out, "#[Mean = %.2f, Max = %llu, Total count = %llu]\n",
+                mean(), static_cast<unsigned long long>(_max), static_cast<unsigned long long>(_total));
+        }
+
+        latency_histogram()
+            : _counts(sub_bucket_count + (64 - sub_bucket_bits) * half_count)
+            , _total(0)
+            , _max(0)
+            , _sum(0) { }
+    };
+}
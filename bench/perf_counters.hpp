@@ -0,0 +1,157 @@
+#pragma once
+
+/*
+
+perf_counters.hpp
+Copyright 2020 Riley Lannon
+
+Hardware performance counters for the benchmarks, through Linux perf_event_open
+
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <utility>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/perf_event.h>)
+#define SEGMENTED_LIST_BENCH_PERF 1
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#endif
+
+namespace bench
+{
+    class perf_counters
+    {
+        /*
+
+        perf_counters
+        A set of hardware counters that can be started and stopped around a measured region
+
+        Each counter is opened on its own, for this thread and in user space only, so a counter the
+        machine lacks (or the kernel does not permit, see perf_event_paranoid) is simply left out.
+        If none can be opened, 'available' is false and start/stop do nothing. Counts are scaled up
+        when the kernel had to multiplex the counters.
+
+        */
+
+        struct counter
+        {
+            std::string name;
+            int fd;
+        };
+
+        std::vector<counter> _counters;
+
+#ifdef SEGMENTED_LIST_BENCH_PERF
+        static int _open(uint32_t type, uint64_t config)
+        {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            return static_cast<int>(::syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+
+        void _add(const char* name, uint32_t type, uint64_t config)
+        {
+            auto fd = _open(type, config);
+            if (fd >= 0)
+            {
+                _counters.push_back(counter{ name, fd });
+            }
+        }
+#endif
+    public:
+        bool available() const noexcept
+        {
+            return !_counters.empty();
+        }
+
+        void start()
+        {
+#ifdef SEGMENTED_LIST_BENCH_PERF
+            for (auto& c : _counters)
+            {
+                ::ioctl(c.fd, PERF_EVENT_IOC_RESET, 0);
+                ::ioctl(c.fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+#endif
+        }
+
+        std::vector<std::pair<std::string, double> > stop()
+        {
+            /*
+
+            stop
+            Stops the counters and returns each one's count since 'start'
+
+            */
+
+            std::vector<std::pair<std::string, double> > counts;
+#ifdef SEGMENTED_LIST_BENCH_PERF
+            for (auto& c : _counters)
+            {
+                ::ioctl(c.fd, PERF_EVENT_IOC_DISABLE, 0);
+            }
+
+            for (auto& c : _counters)
+            {
+                // value, time enabled, time running
+                uint64_t values[3] = { 0, 0, 0 };
+                if (::read(c.fd, values, sizeof(values)) != static_cast<ssize_t>(sizeof(values)) || values[2] == 0)
+                {
+                    continue;
+                }
+
+                auto scale = static_cast<double>(values[1]) / static_cast<double>(values[2]);
+                counts.push_back({ c.name, static_cast<double>(values[0]) * scale });
+            }
+#endif
+            return counts;
+        }
+
+        perf_counters()
+        {
+#ifdef SEGMENTED_LIST_BENCH_PERF
+            auto cache = [](uint64_t cache, uint64_t op, uint64_t result) {
+                return cache | (op << 8) | (result << 16);
+            };
+
+            _add("cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+            _add("instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+            _add("cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+            _add("branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+            _add("l1d_misses", PERF_TYPE_HW_CACHE,
+                cache(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+            _add("dtlb_misses", PERF_TYPE_HW_CACHE,
+                cache(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS));
+#endif
+        }
+
+        perf_counters(const perf_counters&) = delete;
+        perf_counters& operator=(const perf_counters&) = delete;
+
+        ~perf_counters()
+        {
+#ifdef SEGMENTED_LIST_BENCH_PERF
+            for (auto& c : _counters)
+            {
+                ::close(c.fd);
+            }
+#endif
+        }
+    };
+}
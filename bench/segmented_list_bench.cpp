@@ -0,0 +1,1158 @@
+/*
+
+segmented_list_bench.cpp
+Copyright 2020 Riley Lannon
+
+Compares segmented_list against std::vector, std::deque and std::list
+
+Usage:
+    segmented_list_bench [--quick] [--lengths N,N,...] [--repetitions R] [--latency-elements N]
+                         [--soak-seconds S] [--checkpoint-bytes B] [--perf-counters] [--filter TEXT]
+                         [--json PATH]
+
+Each measurement is printed as it completes; with --json, every result is also written to PATH
+so runs can be compared over time. With --perf-counters, hardware counters (cycles, instructions,
+cache, dTLB and branch misses) are read around each timed region and reported per operation.
+
+*/
+
+#include "bench_harness.hpp"
+#include "latency_histogram.hpp"
+
+#include "segmented_list.hpp"
+#include "block_codec.hpp"
+#include "block_io.hpp"
+
+#include <vector>
+#include <deque>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <random>
+#include <iterator>
+#include <cstdlib>
+#include <fcntl.h>
+
+#ifdef SEGMENTED_LIST_POSIX_IO
+#include <sys/wait.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+#endif
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#define SEGMENTED_LIST_BENCH_MALLINFO2 1
+#include <malloc.h>
+#endif
+
+volatile uint64_t bench::sink = 0;
+
+namespace
+{
+    using bench::harness;
+    using bench::result;
+
+    template <typename C>
+    struct random_access : std::false_type { };
+
+    template <typename T>
+    struct random_access<std::vector<T> > : std::true_type { };
+
+    template <typename T>
+    struct random_access<std::deque<T> > : std::true_type { };
+
+    template <typename T, typename A, typename I>
+    struct random_access<segmented_list::segmented_list<T, A, I> > : std::true_type { };
+
+    template <typename C>
+    void fill(C& c, size_t length)
+    {
+        for (size_t i = 0; i < length; i++)
+        {
+            c.push_back(typename C::value_type(i));
+        }
+    }
+
+    template <typename C>
+    void run_container(harness& h, const char* name, size_t length)
+    {
+        /*
+
+        run_container
+        Measures every container operation for one container type, element type and length
+
+        */
+
+        using E = typename C::value_type;
+        std::unique_ptr<C> c;
+
+        // front and middle insert/erase are O(n) for most of these containers, so fewer are performed on long lists
+        const size_t shifting_ops = std::max<size_t>(1, std::min<size_t>(1000, 10000000 / length));
+
+        // segmented_list lookups walk the block chain, so random access is capped to keep long lists tractable
+        const size_t lookups = std::min<size_t>(length, 10000);
+
+        auto report = [&](const char* operation, size_t operations, double ns) {
+            h.record(result{ "containers", name, operation, sizeof(E), length, operations, ns / operations, {} });
+        };
+
+        auto fresh = [&]() { c.reset(new C()); };
+        auto filled = [&]() { c.reset(new C()); fill(*c, length); };
+
+        if (h.enabled("containers", "push_back"))
+        {
+            report("push_back", length, h.time(fresh, [&]() {
+                for (size_t i = 0; i < length; i++)
+                {
+                    c->push_back(E(i));
+                }
+            }));
+        }
+
+        if (h.enabled("containers", "pop_back"))
+        {
+            report("pop_back", length, h.time(filled, [&]() {
+                for (size_t i = 0; i < length; i++)
+                {
+                    c->pop_back();
+                }
+            }));
+        }
+
+        if constexpr (random_access<C>::value)
+        {
+            if (h.enabled("containers", "random_access"))
+            {
+                std::mt19937_64 rng(length);
+                std::vector<size_t> indices(lookups);
+                for (auto& index : indices)
+                {
+                    index = rng() % length;
+                }
+
+                filled();
+                report("random_access", lookups, h.time([]() { }, [&]() {
+                    uint64_t sum = 0;
+                    for (auto index : indices)
+                    {
+                        sum += (*c)[index].value();
+                    }
+                    bench::sink = bench::sink + sum;
+                }));
+            }
+        }
+
+        if constexpr (random_access<C>::value)
+        {
+            if (h.enabled("containers", "index_scan"))
+            {
+                // in-order lookups by index; for segmented_list this is the block walk in _at
+                filled();
+                report("index_scan", lookups, h.time([]() { }, [&]() {
+                    uint64_t sum = 0;
+                    for (size_t i = 0; i < lookups; i++)
+                    {
+                        sum += (*c)[i * (length / lookups)].value();
+                    }
+                    bench::sink = bench::sink + sum;
+                }));
+            }
+        }
+
+        if (h.enabled("containers", "iterate"))
+        {
+            filled();
+            report("iterate", length, h.time([]() { }, [&]() {
+                uint64_t sum = 0;
+                for (const auto& e : *c)
+                {
+                    sum += e.value();
+                }
+                bench::sink = bench::sink + sum;
+            }));
+        }
+
+        if (h.enabled("containers", "insert_front"))
+        {
+            report("insert_front", shifting_ops, h.time(filled, [&]() {
+                for (size_t i = 0; i < shifting_ops; i++)
+                {
+                    c->insert(c->begin(), E(i));
+                }
+            }));
+        }
+
+        if (h.enabled("containers", "erase_front"))
+        {
+            report("erase_front", shifting_ops, h.time(filled, [&]() {
+                for (size_t i = 0; i < shifting_ops && !c->empty(); i++)
+                {
+                    c->erase(c->begin());
+                }
+            }));
+        }
+
+        if (h.enabled("containers", "insert_middle"))
+        {
+            report("insert_middle", shifting_ops, h.time(filled, [&]() {
+                for (size_t i = 0; i < shifting_ops; i++)
+                {
+                    c->insert(std::next(c->begin(), c->size() / 2), E(i));
+                }
+            }));
+        }
+
+        if (h.enabled("containers", "erase_middle"))
+        {
+            report("erase_middle", shifting_ops, h.time(filled, [&]() {
+                for (size_t i = 0; i < shifting_ops && !c->empty(); i++)
+                {
+                    c->erase(std::next(c->begin(), c->size() / 2));
+                }
+            }));
+        }
+
+        if (h.enabled("containers", "clear"))
+        {
+            report("clear", length, h.time(filled, [&]() {
+                c->clear();
+            }));
+        }
+    }
+
+    template <typename E>
+    void run_containers(harness& h, size_t length)
+    {
+        run_container<segmented_list::segmented_list<E> >(h, "segmented_list", length);
+        run_container<std::vector<E> >(h, "vector", length);
+        run_container<std::deque<E> >(h, "deque", length);
+        run_container<std::list<E> >(h, "list", length);
+    }
+
+    size_t list_block_size()
+    {
+        return segmented_list::list_block<int64_t>::block_size();
+    }
+
+    const char* bounds_config()
+    {
+        // the accessors suite is built twice (see bench/CMakeLists.txt); rows are labelled with the build's configuration
+#if defined(SEGMENTED_LIST_ASSERT_BOUNDS) && !defined(SEGMENTED_LIST_EXCEPTIONS)
+        return "segmented_list/unchecked";
+#elif defined(SEGMENTED_LIST_ASSERT_BOUNDS)
+        return "segmented_list/assert_bounds";
+#elif !defined(SEGMENTED_LIST_EXCEPTIONS)
+        return "segmented_list/no_exceptions";
+#else
+        return "segmented_list";
+#endif
+    }
+
+    void run_accessors(harness& h, size_t length)
+    {
+        /*
+
+        run_accessors
+        Compares the checked accessors of segmented_list with try_at, unchecked_at and try_pop_back
+
+        Lookups are confined to the first and last blocks, which _at reaches without a walk, so
+        what is left is the bounds checks and the code around them.
+
+        */
+
+        using E = bench::payload<4>;
+        using list = segmented_list::segmented_list<E>;
+        const char* name = bounds_config();
+
+        std::unique_ptr<list> c;
+        auto filled = [&]() { c.reset(new list()); fill(*c, length); };
+
+        auto report = [&](const char* operation, size_t operations, double ns) {
+            h.record(result{ "accessors", name, operation, sizeof(E), length, operations, ns / operations, {} });
+        };
+
+        const size_t block = list_block_size();
+        const size_t lookups = 1000000;
+        std::mt19937_64 rng(length);
+        std::vector<size_t> indices(lookups);
+        for (auto& index : indices)
+        {
+            auto offset = rng() % std::min(block, length);
+            index = rng() % 2 ? offset : length - 1 - offset;
+        }
+
+        auto lookup = [&](const char* operation, auto get) {
+            if (!h.enabled("accessors", operation))
+            {
+                return;
+            }
+
+            filled();
+            report(operation, lookups, h.time([]() { }, [&]() {
+                uint64_t sum = 0;
+                for (auto index : indices)
+                {
+                    sum += get(*c, index);
+                }
+                bench::sink = bench::sink + sum;
+            }));
+        };
+
+        lookup("operator[]", [](list& l, size_t i) { return l[i].value(); });
+        lookup("at", [](list& l, size_t i) { return l.at(i).value(); });
+        lookup("try_at", [](list& l, size_t i) { auto p = l.try_at(i); return p ? p->value() : 0; });
+        lookup("unchecked_at", [](list& l, size_t i) { return l.unchecked_at(i).value(); });
+
+        if (h.enabled("accessors", "iterate"))
+        {
+            filled();
+            report("iterate", length, h.time([]() { }, [&]() {
+                uint64_t sum = 0;
+                for (auto it = c->begin(); it != c->end(); ++it)
+                {
+                    sum += it->value();
+                }
+                bench::sink = bench::sink + sum;
+            }));
+        }
+
+        if (h.enabled("accessors", "pop_back"))
+        {
+            report("pop_back", length, h.time(filled, [&]() {
+                for (size_t i = 0; i < length; i++)
+                {
+                    c->pop_back();
+                }
+            }));
+        }
+
+        if (h.enabled("accessors", "try_pop_back"))
+        {
+            report("try_pop_back", length, h.time(filled, [&]() {
+                while (c->try_pop_back()) { }
+            }));
+        }
+    }
+
+    void run_indexing(harness& h, size_t length)
+    {
+        /*
+
+        run_indexing
+        Compares the ways segmented_list can find the block holding a position (see indexing_policy)
+
+        Each mode is timed on random lookups, one at a time and as a batch through 'gather' and
+        'scatter', and on appends and front inserts and erases, which only a counted index keeps
+        local to one block. 'index_bytes' is what the index held once the list was filled, per
+        element.
+
+        */
+
+        using E = bench::payload<4>;
+        using list = segmented_list::segmented_list<E>;
+        using segmented_list::index_mode;
+
+        const std::pair<const char*, index_mode> modes[] = {
+            { "segmented_list/chain", index_mode::chain },
+            { "segmented_list/directory", index_mode::directory },
+            { "segmented_list/skip_list", index_mode::skip_list },
+            { "segmented_list/counted_btree", index_mode::counted_btree },
+            { "segmented_list/fenwick", index_mode::fenwick },
+        };
+
+        const size_t lookups = 100000;
+        const size_t shifting_ops = std::max<size_t>(1, std::min<size_t>(1000, 10000000 / length));
+        std::mt19937_64 rng(length);
+        std::vector<size_t> indices(lookups);
+        for (auto& index : indices)
+        {
+            index = rng() % length;
+        }
+
+        for (auto& mode : modes)
+        {
+            std::unique_ptr<list> c;
+            segmented_list::indexing_policy indexing;
+            indexing.mode = mode.second;
+
+            auto fresh = [&]() { c.reset(new list()); c->set_indexing(indexing); };
+            auto filled = [&]() { fresh(); fill(*c, length); };
+
+            auto report = [&](const char* operation, size_t operations, double ns) {
+                result r{ "indexing", mode.first, operation, sizeof(E), length, operations, ns / operations, {} };
+                r.metrics.push_back({ "index_bytes", static_cast<double>(c->memory_usage().index) / static_cast<double>(length) });
+                h.record(r);
+            };
+
+            if (h.enabled("indexing", "push_back"))
+            {
+                report("push_back", length, h.time(fresh, [&]() {
+                    for (size_t i = 0; i < length; i++)
+                    {
+                        c->push_back(E(i));
+                    }
+                }));
+            }
+
+            if (h.enabled("indexing", "random_access"))
+            {
+                filled();
+                report("random_access", lookups, h.time([]() { }, [&]() {
+                    uint64_t sum = 0;
+                    for (auto index : indices)
+                    {
+                        sum += (*c)[index].value();
+                    }
+                    bench::sink = bench::sink + sum;
+                }));
+            }
+
+            if (h.enabled("indexing", "gather"))
+            {
+                filled();
+                std::vector<E> out(lookups);
+                report("gather", lookups, h.time([]() { }, [&]() {
+                    c->gather(indices.data(), lookups, out.data());
+                    bench::sink = bench::sink + out[lookups - 1].value();
+                }));
+            }
+
+            if (h.enabled("indexing", "scatter"))
+            {
+                filled();
+                std::vector<E> in(lookups, E(1));
+                report("scatter", lookups, h.time([]() { }, [&]() {
+                    c->scatter(indices.data(), lookups, in.data());
+                }));
+            }
+
+            if (h.enabled("indexing", "insert_front"))
+            {
+                report("insert_front", shifting_ops, h.time(filled, [&]() {
+                    for (size_t i = 0; i < shifting_ops; i++)
+                    {
+                        c->insert(c->begin(), E(i));
+                    }
+                }));
+            }
+
+            if (h.enabled("indexing", "erase_front"))
+            {
+                report("erase_front", shifting_ops, h.time(filled, [&]() {
+                    for (size_t i = 0; i < shifting_ops && !c->empty(); i++)
+                    {
+                        c->erase(c->begin());
+                    }
+                }));
+            }
+        }
+    }
+
+    template <typename Codec>
+    void run_codec(harness& h, const char* name, const char* pattern, const std::vector<int64_t>& data, size_t block)
+    {
+        /*
+
+        run_codec
+        Encodes 'data' a block at a time with 'Codec', reporting the compression ratio and decode speed
+
+        */
+
+        std::vector<unsigned char> encoded(Codec::max_encoded_size(block) * (data.size() / block + 1));
+        std::vector<size_t> lengths;
+        size_t total = 0;
+        for (size_t first = 0; first < data.size(); first += block)
+        {
+            auto n = std::min(block, data.size() - first);
+            auto bytes = Codec::encode(data.data() + first, n, encoded.data() + total);
+            lengths.push_back(bytes);
+            total += bytes;
+        }
+
+        std::vector<int64_t> decoded(data.size());
+        auto ns = h.time([]() { }, [&]() {
+            size_t offset = 0;
+            for (size_t b = 0; b < lengths.size(); b++)
+            {
+                auto first = b * block;
+                Codec::decode(encoded.data() + offset, lengths[b], decoded.data() + first, std::min(block, data.size() - first));
+                offset += lengths[b];
+            }
+            bench::sink = bench::sink + static_cast<uint64_t>(decoded.back());
+        });
+
+        auto raw = static_cast<double>(data.size() * sizeof(int64_t));
+        result r{ "codecs", name, pattern, sizeof(int64_t), data.size(), data.size(), ns / data.size(), {} };
+        r.metrics.push_back({ "block_elements", static_cast<double>(block) });
+        r.metrics.push_back({ "ratio", raw / static_cast<double>(total) });
+        r.metrics.push_back({ "decode_mb_s", raw / ns * 1e3 });
+        h.record(r);
+    }
+
+    void run_codecs(harness& h, size_t length)
+    {
+        std::mt19937_64 rng(42);
+        std::vector<std::pair<const char*, std::vector<int64_t> > > patterns(3);
+
+        // timestamps a few milliseconds apart, values clustered in a narrow range, and long runs
+        int64_t clock = 1600000000000;
+        patterns[0].first = "timestamps";
+        patterns[1].first = "narrow_range";
+        patterns[2].first = "runs";
+        for (size_t i = 0; i < length; i++)
+        {
+            clock += static_cast<int64_t>(rng() % 16);
+            patterns[0].second.push_back(clock);
+            patterns[1].second.push_back(1000000 + static_cast<int64_t>(rng() % 4096));
+            patterns[2].second.push_back(static_cast<int64_t>(i / 200));
+        }
+
+        for (size_t block : { list_block_size(), size_t(512) })
+        {
+            for (auto& p : patterns)
+            {
+                if (!h.enabled("codecs", p.first))
+                {
+                    continue;
+                }
+
+                run_codec<segmented_list::delta_codec<int64_t> >(h, "delta", p.first, p.second, block);
+                run_codec<segmented_list::for_codec<int64_t> >(h, "frame_of_reference", p.first, p.second, block);
+                run_codec<segmented_list::rle_codec<int64_t> >(h, "run_length", p.first, p.second, block);
+            }
+        }
+    }
+
+#ifdef SEGMENTED_LIST_POSIX_IO
+    uint64_t available_memory()
+    {
+        // MemAvailable counts reclaimable page cache, unlike _SC_AVPHYS_PAGES, so prefer it where there is one
+        if (auto meminfo = std::fopen("/proc/meminfo", "r"))
+        {
+            char line[256];
+            unsigned long long kb = 0;
+            while (std::fgets(line, sizeof(line), meminfo))
+            {
+                if (std::sscanf(line, "MemAvailable: %llu kB", &kb) == 1)
+                {
+                    break;
+                }
+            }
+
+            std::fclose(meminfo);
+            if (kb)
+            {
+                return kb * 1024;
+            }
+        }
+
+        auto pages = ::sysconf(_SC_AVPHYS_PAGES);
+        return pages > 0 ? static_cast<uint64_t>(pages) * static_cast<uint64_t>(::sysconf(_SC_PAGESIZE)) : 0;
+    }
+
+    void run_checkpoints(harness& h)
+    {
+        /*
+
+        run_checkpoints
+        Times full and incremental checkpoints with each block_io backend
+
+        The list holds '--checkpoint-bytes' of elements (8 GiB by default), independent of
+        '--lengths'. The suite is skipped, with a message, when there is not enough memory for the
+        list or not enough space in /tmp for its image.
+
+        */
+
+        using E = bench::payload<64>;
+
+        if (!h.enabled("checkpoint", "checkpoint_full") && !h.enabled("checkpoint", "checkpoint_incremental"))
+        {
+            return;
+        }
+
+        const uint64_t target = h.get_options().checkpoint_bytes;
+        const size_t length = static_cast<size_t>(target / sizeof(E));
+        if (length == 0)
+        {
+            return;
+        }
+
+        // the blocks' headers and the rest of the process need some room beyond the elements
+        const uint64_t needed = target + target / 8;
+        auto memory = available_memory();
+        if (memory < needed)
+        {
+            std::fprintf(stderr, "checkpoint: skipped; a %llu MiB list needs %llu MiB of memory, %llu MiB available (see --checkpoint-bytes)\n",
+                static_cast<unsigned long long>(target >> 20), static_cast<unsigned long long>(needed >> 20), static_cast<unsigned long long>(memory >> 20));
+            return;
+        }
+
+        struct statvfs disk;
+        if (::statvfs("/tmp", &disk) == 0 && static_cast<uint64_t>(disk.f_bavail) * disk.f_frsize < needed)
+        {
+            std::fprintf(stderr, "checkpoint: skipped; /tmp has %llu MiB free, the image needs %llu MiB (see --checkpoint-bytes)\n",
+                static_cast<unsigned long long>((static_cast<uint64_t>(disk.f_bavail) * disk.f_frsize) >> 20), static_cast<unsigned long long>(needed >> 20));
+            return;
+        }
+
+        char path[] = "/tmp/segmented_list_bench.XXXXXX";
+        int fd = ::mkstemp(path);
+        if (fd < 0)
+        {
+            std::perror("segmented_list_bench mkstemp");
+            return;
+        }
+        ::unlink(path);
+
+        segmented_list::segmented_list<E> list;
+        fill(list, length);
+        const double bytes = static_cast<double>(length * sizeof(E));
+
+        for (auto preferred : { segmented_list::io::block_io::backend_sync, segmented_list::io::block_io::backend_uring })
+        {
+            segmented_list::io::block_io io(preferred);
+            if (io.get_backend() != preferred)
+            {
+                // the ring could not be created here; the sync backend is measured on its own
+                continue;
+            }
+
+            const char* name = preferred == segmented_list::io::block_io::backend_uring ? "uring" : "sync";
+
+            if (h.enabled("checkpoint", "checkpoint_full"))
+            {
+                // truncating the file makes every checkpoint a full one
+                auto ns = h.time([&]() { (void)::ftruncate(fd, 0); }, [&]() {
+                    list.checkpoint_incremental(fd, &io);
+                });
+
+                result r{ "checkpoint", name, "checkpoint_full", sizeof(E), length, length, ns / length, {} };
+                r.metrics.push_back({ "mb_s", bytes / ns * 1e3 });
+                h.record(r);
+            }
+
+            if (h.enabled("checkpoint", "checkpoint_incremental"))
+            {
+                // one block in a hundred is touched between checkpoints
+                list.checkpoint_incremental(fd, &io);
+                auto stride = list_block_size() * 100;
+                auto ns = h.time([&]() {
+                    for (size_t i = 0; i < length; i += stride)
+                    {
+                        list[i] = E(i + 1);
+                    }
+                }, [&]() {
+                    list.checkpoint_incremental(fd, &io);
+                });
+
+                auto touched = (length + stride - 1) / stride;
+                result r{ "checkpoint", name, "checkpoint_incremental", sizeof(E), length, touched, ns / touched, {} };
+                h.record(r);
+            }
+        }
+
+        ::close(fd);
+    }
+#endif
+
+    template <typename C>
+    void run_latency_one(harness& h, const char* container, const char* allocator, C& c, size_t elements)
+    {
+        /*
+
+        run_latency_one
+        Appends 'elements' elements to 'c', timing every push_back individually
+
+        The clock is read once per operation, each reading closing one interval and opening the
+        next, so the figures include one clock read (see the "clock" row for its cost).
+
+        */
+
+        using E = typename C::value_type;
+        bench::latency_histogram histogram;
+
+        auto previous = harness::clock::now();
+        for (size_t i = 0; i < elements; i++)
+        {
+            c.push_back(E(i));
+            auto now = harness::clock::now();
+            histogram.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - previous).count()));
+            previous = now;
+        }
+
+        std::printf("\n# latency/push_back: %s with %s, %zu elements\n", container, allocator, elements);
+        histogram.print_percentiles(stdout);
+        std::printf("\n");
+
+        result r{ "latency", std::string(container) + "/" + allocator, "push_back", sizeof(E), elements, elements, histogram.mean(), {} };
+        r.metrics.push_back({ "p50_ns", static_cast<double>(histogram.percentile(50)) });
+        r.metrics.push_back({ "p99_ns", static_cast<double>(histogram.percentile(99)) });
+        r.metrics.push_back({ "p99_9_ns", static_cast<double>(histogram.percentile(99.9)) });
+        r.metrics.push_back({ "p99_99_ns", static_cast<double>(histogram.percentile(99.99)) });
+        r.metrics.push_back({ "max_ns", static_cast<double>(histogram.max()) });
+        h.record(r);
+    }
+
+    template <typename E, template <typename> class Allocator>
+    void run_latency_allocator(harness& h, const char* allocator, size_t elements, Allocator<char> alloc)
+    {
+        {
+            segmented_list::segmented_list<E, Allocator<segmented_list::list_block<E> > > c(alloc);
+            run_latency_one(h, "segmented_list", allocator, c, elements);
+        }
+        {
+            std::vector<E, Allocator<E> > c(alloc);
+            run_latency_one(h, "vector", allocator, c, elements);
+        }
+        {
+            std::deque<E, Allocator<E> > c(alloc);
+            run_latency_one(h, "deque", allocator, c, elements);
+        }
+    }
+
+    void run_latency(harness& h)
+    {
+        /*
+
+        run_latency
+        Compares the per-operation latency distribution of push_back, where vector shows its reallocation spikes
+
+        Each container is measured with std::allocator and with the two standard memory resources,
+        a pool (blocks are recycled by size) and a monotonic arena (memory is never given back).
+        segmented_list has no allocators of its own; these stand in for the custom allocators a
+        user might supply.
+
+        */
+
+        using E = bench::payload<4>;
+        auto elements = h.get_options().latency_elements;
+        if (elements == 0 || !h.enabled("latency", "push_back"))
+        {
+            return;
+        }
+
+        // the cost of the clock read included in every sample
+        {
+            bench::latency_histogram histogram;
+            auto previous = harness::clock::now();
+            for (size_t i = 0; i < 1000000; i++)
+            {
+                auto now = harness::clock::now();
+                histogram.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - previous).count()));
+                previous = now;
+            }
+
+            result r{ "latency", "clock", "now", 0, 1000000, 1000000, histogram.mean(), {} };
+            r.metrics.push_back({ "p50_ns", static_cast<double>(histogram.percentile(50)) });
+            h.record(r);
+        }
+
+        run_latency_allocator<E, std::allocator>(h, "std::allocator", elements, std::allocator<char>());
+
+        {
+            std::pmr::unsynchronized_pool_resource pool;
+            run_latency_allocator<E, std::pmr::polymorphic_allocator>(h, "pmr_pool", elements, std::pmr::polymorphic_allocator<char>(&pool));
+        }
+        {
+            std::pmr::monotonic_buffer_resource arena;
+            run_latency_allocator<E, std::pmr::polymorphic_allocator>(h, "pmr_monotonic", elements, std::pmr::polymorphic_allocator<char>(&arena));
+        }
+    }
+
+#ifdef SEGMENTED_LIST_POSIX_IO
+    // bytes currently allocated through counting_allocator, across all containers in this process
+    size_t live_bytes = 0;
+
+    template <typename T>
+    struct counting_allocator
+    {
+        /*
+
+        counting_allocator
+        Forwards to std::allocator while tracking how many bytes the containers actually hold
+
+        */
+
+        using value_type = T;
+
+        counting_allocator() noexcept { }
+
+        template <typename U>
+        counting_allocator(const counting_allocator<U>&) noexcept { }
+
+        T* allocate(size_t n)
+        {
+            live_bytes += n * sizeof(T);
+            return std::allocator<T>().allocate(n);
+        }
+
+        void deallocate(T* p, size_t n)
+        {
+            live_bytes -= n * sizeof(T);
+            std::allocator<T>().deallocate(p, n);
+        }
+
+        template <typename U>
+        bool operator==(const counting_allocator<U>&) const noexcept
+        {
+            return true;
+        }
+
+        template <typename U>
+        bool operator!=(const counting_allocator<U>&) const noexcept
+        {
+            return false;
+        }
+    };
+
+    struct soak_sample
+    {
+        double seconds;
+        uint64_t steps;         // churn steps performed so far
+        uint64_t element_bytes; // bytes of elements the containers hold
+        uint64_t live_bytes;    // bytes the containers requested
+        uint64_t rss_bytes;     // resident set size of the process
+        uint64_t heap_bytes;    // bytes malloc has taken from the system (arena plus mmapped chunks)
+        uint64_t heap_in_use;   // bytes malloc has handed out
+        uint64_t heap_free;     // bytes malloc holds in free chunks
+    };
+
+    soak_sample take_sample(double seconds, uint64_t steps, uint64_t element_bytes)
+    {
+        soak_sample sample{ seconds, steps, element_bytes, live_bytes, 0, 0, 0, 0 };
+
+        FILE* statm = std::fopen("/proc/self/statm", "r");
+        if (statm)
+        {
+            unsigned long long pages = 0;
+            unsigned long long resident = 0;
+            if (std::fscanf(statm, "%llu %llu", &pages, &resident) == 2)
+            {
+                sample.rss_bytes = resident * static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+            }
+            std::fclose(statm);
+        }
+
+#ifdef SEGMENTED_LIST_BENCH_MALLINFO2
+        auto info = ::mallinfo2();
+        sample.heap_bytes = info.arena + info.hblkhd;
+        sample.heap_in_use = info.uordblks + info.hblkhd;
+        sample.heap_free = info.fordblks;
+#endif
+
+        return sample;
+    }
+
+    template <typename C, bool shrink>
+    void soak(int out, double seconds, size_t lists)
+    {
+        /*
+
+        soak
+        Churns 'lists' containers with random growth and shrinkage, writing samples to 'out' as it goes
+
+        Each step picks a list and either appends or removes a random number of elements (drawn
+        so that sizes spread over several orders of magnitude), or occasionally clears it. With
+        'shrink', containers are asked to give back spare capacity after they shrink.
+
+        */
+
+        using E = typename C::value_type;
+        std::vector<C> containers(lists);
+        std::mt19937_64 rng(7);
+
+        auto start = harness::clock::now();
+        auto elapsed = [&]() { return std::chrono::duration<double>(harness::clock::now() - start).count(); };
+        const double interval = seconds / 20;
+        double next_sample = 0;
+        uint64_t steps = 0;
+
+        while (true)
+        {
+            auto now = elapsed();
+            if (now >= next_sample)
+            {
+                uint64_t elements = 0;
+                for (auto& c : containers)
+                {
+                    elements += c.size();
+                }
+
+                auto sample = take_sample(now, steps, elements * sizeof(E));
+                if (::write(out, &sample, sizeof(sample)) != static_cast<ssize_t>(sizeof(sample)))
+                {
+                    return;
+                }
+
+                next_sample += interval;
+                if (now >= seconds)
+                {
+                    return;
+                }
+            }
+
+            for (int step = 0; step < 1000; step++)
+            {
+                auto& c = containers[rng() % lists];
+                auto amount = static_cast<size_t>(1) << (rng() % 12);
+                amount += rng() % amount;
+
+                auto action = rng() % 64;
+                if (action == 0)
+                {
+                    c.clear();
+                }
+                else if (action < 34)
+                {
+                    // the lists hover around a few thousand elements each
+                    if (c.size() < 4096)
+                    {
+                        for (size_t i = 0; i < amount; i++)
+                        {
+                            c.push_back(E(i));
+                        }
+                    }
+                }
+                else
+                {
+                    for (size_t i = 0; i < amount && !c.empty(); i++)
+                    {
+                        c.pop_back();
+                    }
+                }
+
+                if (shrink && action >= 34)
+                {
+                    c.shrink_to_fit();
+                }
+            }
+
+            steps += 1000;
+        }
+    }
+
+    template <typename C, bool shrink = false>
+    void run_soak_one(harness& h, const char* name, double seconds, size_t lists)
+    {
+        /*
+
+        run_soak_one
+        Runs one soak in a child process, so every container starts from a fresh heap
+
+        */
+
+        int pipe_fds[2];
+        if (::pipe(pipe_fds) != 0)
+        {
+            std::perror("segmented_list_bench pipe");
+            return;
+        }
+
+        std::fflush(stdout);
+        auto child = ::fork();
+        if (child < 0)
+        {
+            std::perror("segmented_list_bench fork");
+            ::close(pipe_fds[0]);
+            ::close(pipe_fds[1]);
+            return;
+        }
+        else if (child == 0)
+        {
+            ::close(pipe_fds[0]);
+            soak<C, shrink>(pipe_fds[1], seconds, lists);
+            ::_exit(0);
+        }
+
+        ::close(pipe_fds[1]);
+        std::vector<soak_sample> samples;
+        soak_sample sample;
+        while (::read(pipe_fds[0], &sample, sizeof(sample)) == static_cast<ssize_t>(sizeof(sample)))
+        {
+            samples.push_back(sample);
+        }
+        ::close(pipe_fds[0]);
+        ::waitpid(child, nullptr, 0);
+
+        if (samples.empty())
+        {
+            return;
+        }
+
+        std::printf("\n# soak: %s, %zu lists\n%10s %14s %14s %14s %14s %14s %14s\n",
+            name, lists, "seconds", "elements", "live", "rss", "heap", "heap_in_use", "heap_free");
+
+        soak_sample peak{};
+        double overhead = 0;
+        for (auto& s : samples)
+        {
+            std::printf("%10.2f %14llu %14llu %14llu %14llu %14llu %14llu\n", s.seconds,
+                static_cast<unsigned long long>(s.element_bytes),
+                static_cast<unsigned long long>(s.live_bytes), static_cast<unsigned long long>(s.rss_bytes),
+                static_cast<unsigned long long>(s.heap_bytes), static_cast<unsigned long long>(s.heap_in_use),
+                static_cast<unsigned long long>(s.heap_free));
+
+            peak.live_bytes = std::max(peak.live_bytes, s.live_bytes);
+            peak.rss_bytes = std::max(peak.rss_bytes, s.rss_bytes);
+            peak.heap_bytes = std::max(peak.heap_bytes, s.heap_bytes);
+            overhead += s.element_bytes ? static_cast<double>(s.rss_bytes) / static_cast<double>(s.element_bytes) : 0;
+        }
+        std::printf("\n");
+
+        auto& last = samples.back();
+        auto ns_per_step = last.steps ? last.seconds * 1e9 / static_cast<double>(last.steps) : 0;
+        result r{ "soak", name, "churn", sizeof(typename C::value_type), lists, last.steps, ns_per_step, {} };
+        r.metrics.push_back({ "seconds", last.seconds });
+        r.metrics.push_back({ "final_element_bytes", static_cast<double>(last.element_bytes) });
+        r.metrics.push_back({ "final_live_bytes", static_cast<double>(last.live_bytes) });
+        r.metrics.push_back({ "final_rss_bytes", static_cast<double>(last.rss_bytes) });
+        r.metrics.push_back({ "final_heap_free_bytes", static_cast<double>(last.heap_free) });
+        r.metrics.push_back({ "peak_live_bytes", static_cast<double>(peak.live_bytes) });
+        r.metrics.push_back({ "peak_rss_bytes", static_cast<double>(peak.rss_bytes) });
+        r.metrics.push_back({ "peak_heap_bytes", static_cast<double>(peak.heap_bytes) });
+        r.metrics.push_back({ "mean_rss_per_element_byte", overhead / static_cast<double>(samples.size()) });
+        h.record(r);
+    }
+
+    void run_soak(harness& h)
+    {
+        /*
+
+        run_soak
+        Measures how much memory each container really costs the process under long-running churn
+
+        RSS and the malloc statistics, compared with the bytes the containers asked for, show how
+        much is lost to spare capacity and heap fragmentation.
+
+        */
+
+        using E = bench::payload<16>;
+        auto seconds = h.get_options().soak_seconds;
+        const size_t lists = 4000;
+        if (seconds <= 0)
+        {
+            return;
+        }
+
+        using list_type = segmented_list::segmented_list<E, counting_allocator<segmented_list::list_block<E> > >;
+        if (h.enabled("soak", "segmented_list"))
+        {
+            run_soak_one<list_type>(h, "segmented_list", seconds, lists);
+        }
+
+        if (h.enabled("soak", "segmented_list/shrink_to_fit"))
+        {
+            // without the reserve block, every shrink across a block boundary frees memory at once
+            run_soak_one<list_type, true>(h, "segmented_list/shrink_to_fit", seconds, lists);
+        }
+
+        if (h.enabled("soak", "vector"))
+        {
+            run_soak_one<std::vector<E, counting_allocator<E> > >(h, "vector", seconds, lists);
+        }
+
+        if (h.enabled("soak", "vector/shrink_to_fit"))
+        {
+            run_soak_one<std::vector<E, counting_allocator<E> >, true>(h, "vector/shrink_to_fit", seconds, lists);
+        }
+
+        if (h.enabled("soak", "deque"))
+        {
+            run_soak_one<std::deque<E, counting_allocator<E> > >(h, "deque", seconds, lists);
+        }
+    }
+#endif
+
+    bench::options parse_options(int argc, char** argv)
+    {
+        bench::options opts{ { 1000, 100000, 1000000 }, 3, 100000000, 120, static_cast<size_t>(8) << 30, false, "", "" };
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            bool has_value = i + 1 < argc;
+
+            if (arg == "--quick")
+            {
+                opts.lengths = { 1000, 10000 };
+                opts.repetitions = 1;
+                opts.latency_elements = 1000000;
+                opts.soak_seconds = 2;
+                opts.checkpoint_bytes = 64 << 20;
+            }
+            else if (arg == "--lengths" && has_value)
+            {
+                opts.lengths.clear();
+                for (char* p = argv[++i]; *p; )
+                {
+                    opts.lengths.push_back(std::strtoull(p, &p, 10));
+                    if (*p == ',')
+                    {
+                        p++;
+                    }
+                }
+            }
+            else if (arg == "--repetitions" && has_value)
+            {
+                opts.repetitions = std::max<size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+            }
+            else if (arg == "--latency-elements" && has_value)
+            {
+                opts.latency_elements = std::strtoull(argv[++i], nullptr, 10);
+            }
+            else if (arg == "--soak-seconds" && has_value)
+            {
+                opts.soak_seconds = std::strtod(argv[++i], nullptr);
+            }
+            else if (arg == "--checkpoint-bytes" && has_value)
+            {
+                opts.checkpoint_bytes = std::strtoull(argv[++i], nullptr, 10);
+            }
+            else if (arg == "--perf-counters")
+            {
+                opts.perf_counters = true;
+            }
+            else if (arg == "--filter" && has_value)
+            {
+                opts.filter = argv[++i];
+            }
+            else if (arg == "--json" && has_value)
+            {
+                opts.json_path = argv[++i];
+            }
+            else
+            {
+                std::fprintf(stderr, "usage: %s [--quick] [--lengths N,N,...] [--repetitions R] [--latency-elements N] [--soak-seconds S] [--checkpoint-bytes B] [--perf-counters] [--filter TEXT] [--json PATH]\n", argv[0]);
+                std::exit(2);
+            }
+        }
+
+        return opts;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    harness h(parse_options(argc, argv));
+
+    for (auto length : h.get_options().lengths)
+    {
+        if (length == 0)
+        {
+            continue;
+        }
+
+        run_containers<bench::payload<4> >(h, length);
+        run_containers<bench::payload<16> >(h, length);
+        run_containers<bench::payload<64> >(h, length);
+        run_accessors(h, length);
+        run_indexing(h, length);
+        run_codecs(h, length);
+    }
+
+    run_latency(h);
+#ifdef SEGMENTED_LIST_POSIX_IO
+    run_checkpoints(h);
+    run_soak(h);
+#endif
+
+    return h.write_json() ? 0 : 1;
+}
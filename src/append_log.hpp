@@ -0,0 +1,538 @@
+#pragma once
+
+/*
+
+append_log.hpp
+Copyright 2020 Riley Lannon
+
+A durable, multi-writer append log that batches fsyncs across many appends (group commit)
+
+*/
+
+#include "segmented_list.hpp"
+
+#ifdef SEGMENTED_LIST_POSIX_IO
+
+#include <vector>
+#include <chrono>
+#include <exception>
+#include <fcntl.h>
+
+namespace segmented_list
+{
+    namespace io
+    {
+        struct log_block_header
+        {
+            /*
+
+            log_block_header
+            Precedes each block written by append_log
+
+            A log file is a sequence of fixed-size slots, each holding one header and room for a full
+            block of records. Blocks flushed early (because they aged) are written with fewer
+            records; the rest of their slot is unused. 'sequence' numbers the blocks from 0, and
+            'checksum' is an FNV-1a hash of the header (with 'checksum' zeroed) and the live records,
+            so a torn write at the end of the log is detected on recovery.
+
+            */
+
+            static const uint32_t current_version = 1;
+
+            char magic[8];
+            uint32_t version;
+            uint32_t byte_order;
+            uint64_t element_size;
+            uint64_t sequence;
+            uint64_t count;
+            uint64_t checksum;
+
+            log_block_header()
+                : magic{ 'S', 'E', 'G', 'L', 'L', 'O', 'G', 0 }
+                , version(current_version)
+                , byte_order(byte_order_mark)
+                , element_size(0)
+                , sequence(0)
+                , count(0)
+                , checksum(0) { }
+        };
+    }
+
+
+    template <typename T, size_t N = 256>
+    class append_log
+    {
+        /*
+
+        append_log
+        A write-ahead log that many threads may append to concurrently
+
+        Records accumulate in list_blocks. A flusher thread writes out every block that is full,
+        along with the partially filled one once its oldest record has waited 'max_delay', using a
+        single pwritev followed by a single fdatasync for the whole group. Every appender waiting
+        on that group is then released at once, so the cost of a sync is shared by all the records
+        it covers.
+
+        On construction, an existing log is recovered by scanning its block headers; the log ends
+        at the first block whose header or checksum is invalid, and anything after it is truncated.
+        A read that fails throws std::system_error rather than truncating the log.
+
+        Template parameters:
+            * T -   The record type; must be trivially copyable
+            * N -   The number of records in each block
+
+        */
+
+        static_assert(std::is_trivially_copyable<T>::value, "append_log requires a trivially copyable T");
+
+        using block_type = list_block<T, N>;
+
+        int _fd;
+        off_t _write_offset;
+        std::chrono::steady_clock::duration _max_delay;
+
+        std::mutex _mutex;
+        std::condition_variable _flush_needed;
+        std::condition_variable _durable_changed;
+
+        // blocks waiting to be written, oldest first; the last one is still open for appends
+        std::vector<std::unique_ptr<block_type> > _open;
+        std::vector<std::unique_ptr<block_type> > _spare;
+        std::chrono::steady_clock::time_point _oldest_unflushed;
+
+        uint64_t _next_lsn;         // the number of records appended so far
+        uint64_t _durable_lsn;      // the number of records known to be on stable storage
+        uint64_t _next_sequence;
+        size_t _groups;             // the number of pwritev/fdatasync rounds performed
+
+        bool _stopping;
+        std::exception_ptr _error;
+        std::thread _flusher;
+
+        static size_t _slot_size()
+        {
+            return sizeof(io::log_block_header) + N * sizeof(T);
+        }
+
+        static uint64_t _checksum(io::log_block_header header, const T* records)
+        {
+            header.checksum = 0;
+            auto hash = io::fnv1a(&header, sizeof(header));
+            return io::fnv1a(records, header.count * sizeof(T), hash);
+        }
+
+        std::unique_ptr<block_type> _take_spare()
+        {
+            if (_spare.empty())
+            {
+                return std::unique_ptr<block_type>(new block_type());
+            }
+
+            auto block = std::move(_spare.back());
+            _spare.pop_back();
+            block->clear();
+            return block;
+        }
+
+        size_t _read_at(void* buffer, size_t bytes, off_t offset) const
+        {
+            /*
+
+            _read_at
+            Reads up to 'bytes' at 'offset', retrying short reads; returns fewer only at end of file
+
+            Throws std::system_error if a read fails, so an I/O error is never taken for the end of
+            the log.
+
+            */
+
+            size_t done = 0;
+            while (done < bytes)
+            {
+                auto got = ::pread(_fd, static_cast<char*>(buffer) + done, bytes - done, offset + static_cast<off_t>(done));
+                if (got < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+
+                    throw std::system_error(errno, std::generic_category(), "append_log pread");
+                }
+                else if (got == 0)
+                {
+                    break;
+                }
+
+                done += static_cast<size_t>(got);
+            }
+
+            return done;
+        }
+
+        void _recover()
+        {
+            /*
+
+            _recover
+            Scans the existing log to find its end, truncating a torn or corrupt tail
+
+            The log ends at end of file or at the first invalid block. A failed read throws instead,
+            leaving the file untouched.
+
+            */
+
+            std::vector<T> records(N);
+            off_t offset = 0;
+            while (true)
+            {
+                io::log_block_header header;
+                auto got = _read_at(&header, sizeof(header), offset);
+
+                io::log_block_header reference;
+                bool valid = got == sizeof(header)
+                    && std::memcmp(header.magic, reference.magic, sizeof(reference.magic)) == 0
+                    && header.version == io::log_block_header::current_version
+                    && header.byte_order == io::byte_order_mark
+                    && header.element_size == sizeof(T)
+                    && header.sequence == _next_sequence
+                    && header.count > 0
+                    && header.count <= N;
+
+                if (valid)
+                {
+                    // a payload cut short by the end of the file is a torn write
+                    auto bytes = header.count * sizeof(T);
+                    valid = _read_at(records.data(), bytes, offset + static_cast<off_t>(sizeof(header))) == bytes
+                        && _checksum(header, records.data()) == header.checksum;
+                }
+
+                if (!valid)
+                {
+                    break;
+                }
+
+                _next_lsn += header.count;
+                _next_sequence++;
+                offset += static_cast<off_t>(_slot_size());
+            }
+
+            _durable_lsn = _next_lsn;
+            _write_offset = offset;
+            if (::ftruncate(_fd, offset) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "append_log ftruncate");
+            }
+        }
+
+        void _write_group(std::vector<std::unique_ptr<block_type> >& group, off_t offset, uint64_t sequence)
+        {
+            /*
+
+            _write_group
+            Writes 'group' at 'offset' with pwritev, then makes it durable with one fdatasync
+
+            The blocks are numbered from 'sequence'. Runs without the mutex held, so it only uses
+            what it is given; the caller advances the log's offset and sequence afterwards.
+
+            */
+
+            std::vector<io::log_block_header> headers(group.size());
+            std::vector<iovec> iov;
+            iov.reserve(group.size() * 2);
+
+            for (size_t i = 0; i < group.size(); i++)
+            {
+                auto& header = headers[i];
+                header.element_size = sizeof(T);
+                header.sequence = sequence + i;
+                header.count = group[i]->size();
+                header.checksum = _checksum(header, group[i]->data());
+
+                iov.push_back(iovec{ &header, sizeof(header) });
+
+                // the last block needs no padding; anything before it is padded out to a full slot by
+                // writing the whole array, whose unused tail is ignored on recovery
+                auto bytes = (i + 1 == group.size() ? header.count : N) * sizeof(T);
+                iov.push_back(iovec{ group[i]->data(), bytes });
+            }
+
+            size_t done = 0;
+            while (done < iov.size())
+            {
+                auto count = iov.size() - done < static_cast<size_t>(io::max_iovecs) ? iov.size() - done : static_cast<size_t>(io::max_iovecs);
+                size_t bytes = 0;
+                for (size_t i = done; i < done + count; i++)
+                {
+                    bytes += iov[i].iov_len;
+                }
+
+                io::pwritev_fully(_fd, iov.data() + done, static_cast<int>(count), offset);
+                offset += static_cast<off_t>(bytes);
+                done += count;
+            }
+
+            if (::fdatasync(_fd) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "append_log fdatasync");
+            }
+        }
+
+        void _run()
+        {
+            /*
+
+            _run
+            The flusher loop: waits until a block is full or aged, then commits everything pending as one group
+
+            */
+
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (true)
+            {
+                auto ready = [this]() {
+                    return _stopping
+                        || _open.size() > 1
+                        || (!_open.empty() && _open.back()->full());
+                };
+
+                if (_open.empty() || _open.back()->empty())
+                {
+                    _flush_needed.wait(lock, [this]() { return _stopping || (!_open.empty() && !_open.back()->empty()); });
+                }
+                else
+                {
+                    _flush_needed.wait_until(lock, _oldest_unflushed + _max_delay, ready);
+                }
+
+                if (_open.empty() || _open.back()->empty())
+                {
+                    if (_stopping)
+                    {
+                        return;
+                    }
+
+                    continue;
+                }
+
+                // take every block, including the open one; later appends start a fresh block
+                std::vector<std::unique_ptr<block_type> > group;
+                group.swap(_open);
+                auto target = _next_lsn;
+                auto offset = _write_offset;
+                auto sequence = _next_sequence;
+
+                lock.unlock();
+                std::exception_ptr error;
+                try
+                {
+                    _write_group(group, offset, sequence);
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                }
+                lock.lock();
+
+                if (error)
+                {
+                    // a failed sync leaves the state of the file unknown; fail every waiter from here on
+                    _error = error;
+                    _durable_changed.notify_all();
+                    return;
+                }
+
+                _write_offset += static_cast<off_t>(group.size() * _slot_size());
+                _next_sequence += group.size();
+                _durable_lsn = target;
+                _groups++;
+                for (auto& block : group)
+                {
+                    _spare.push_back(std::move(block));
+                }
+
+                _durable_changed.notify_all();
+            }
+        }
+    public:
+        using value_type = T;
+        using size_type = size_t;
+
+        uint64_t submit(const T& record)
+        {
+            /*
+
+            submit
+            Appends 'record' without waiting for it to become durable
+
+            Returns the record's log sequence number; pass it to 'wait_durable' to wait for the
+            record to reach stable storage.
+
+            */
+
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_error)
+            {
+                std::rethrow_exception(_error);
+            }
+
+            bool starts_group = _open.empty();
+            if (starts_group)
+            {
+                // this record's age decides when a partial block is flushed
+                _oldest_unflushed = std::chrono::steady_clock::now();
+            }
+
+            if (_open.empty() || _open.back()->full())
+            {
+                _open.push_back(_take_spare());
+            }
+
+            _open.back()->push_back(record);
+            auto lsn = ++_next_lsn;
+
+            // wake the flusher for a new group, or because a block just filled up
+            if (starts_group || _open.back()->full())
+            {
+                _flush_needed.notify_one();
+            }
+
+            return lsn;
+        }
+
+        void wait_durable(uint64_t lsn)
+        {
+            /*
+
+            wait_durable
+            Blocks until every record up to and including 'lsn' is on stable storage
+
+            Throws the flusher's error if the log could not be written.
+
+            */
+
+            std::unique_lock<std::mutex> lock(_mutex);
+            _durable_changed.wait(lock, [this, lsn]() { return _durable_lsn >= lsn || _error; });
+
+            if (_durable_lsn < lsn)
+            {
+                std::rethrow_exception(_error);
+            }
+        }
+
+        uint64_t append(const T& record)
+        {
+            /*
+
+            append
+            Appends 'record' and returns once it is durable
+
+            */
+
+            auto lsn = submit(record);
+            wait_durable(lsn);
+            return lsn;
+        }
+
+        uint64_t size()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _next_lsn;
+        }
+
+        uint64_t durable_size()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _durable_lsn;
+        }
+
+        size_t groups_committed()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _groups;
+        }
+
+        template <typename Function>
+        void replay(Function f)
+        {
+            /*
+
+            replay
+            Calls 'f' with every durable record, in order, reading them back from the file
+
+            */
+
+            std::vector<T> records(N);
+            off_t end;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                end = _write_offset;
+            }
+
+            for (off_t offset = 0; offset < end; offset += static_cast<off_t>(_slot_size()))
+            {
+                io::log_block_header header;
+                iovec head{ &header, sizeof(header) };
+                io::preadv_fully(_fd, &head, 1, offset);
+
+                iovec payload{ records.data(), header.count * sizeof(T) };
+                io::preadv_fully(_fd, &payload, 1, offset + static_cast<off_t>(sizeof(header)));
+
+                for (size_t i = 0; i < header.count; i++)
+                {
+                    f(static_cast<const T&>(records[i]));
+                }
+            }
+        }
+
+        // constructors
+
+        explicit append_log(const char* path, std::chrono::microseconds max_delay = std::chrono::microseconds(200))
+            : _fd(-1)
+            , _write_offset(0)
+            , _max_delay(max_delay)
+            , _next_lsn(0)
+            , _durable_lsn(0)
+            , _next_sequence(0)
+            , _groups(0)
+            , _stopping(false)
+        {
+            // opens (or creates) the log at 'path' and recovers its contents
+            _fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (_fd < 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "append_log open");
+            }
+
+            try
+            {
+                _recover();
+            }
+            catch (...)
+            {
+                ::close(_fd);
+                throw;
+            }
+
+            _flusher = std::thread([this]() { _run(); });
+        }
+
+        append_log(const append_log&) = delete;
+        append_log& operator=(const append_log&) = delete;
+
+        ~append_log()
+        {
+            // anything still pending is committed before the log is closed
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stopping = true;
+            }
+            _flush_needed.notify_one();
+            _flusher.join();
+
+            ::close(_fd);
+        }
+    };
+}
+
+#endif
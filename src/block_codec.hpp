@@ -0,0 +1,608 @@
+#pragma once
+
+/*
+
+block_codec.hpp
+Copyright 2020 Riley Lannon
+
+Per-block compression codecs, and compressed serialization of a segmented_list
+
+*/
+
+#include "segmented_list.hpp"
+
+#include <cstring>
+#include <limits>
+#include <vector>
+
+namespace segmented_list
+{
+    /*
+
+    Codecs
+
+    A codec compresses the live elements of one block at a time. Every codec provides the same
+    static interface, so containers can take one as a template parameter:
+        * id -                  A codec_id recorded in serialized data
+        * max_encoded_size(n) - An upper bound on the bytes 'encode' produces for n elements
+        * encode(in, n, out) -  Writes n elements from 'in' to 'out'; returns the bytes written
+        * decode(in, length, out, n) -
+                                Reads n elements back from 'length' bytes at 'in'; throws
+                                std::runtime_error if the data is malformed
+
+    The integer codecs need no external libraries:
+        * delta_codec - differences between neighbours, zigzag-mapped and bit-packed; suits
+                        sorted or slowly changing data such as timestamps and counters
+        * for_codec -   frame of reference: the block minimum, then bit-packed offsets from it;
+                        suits values clustered in a narrow range
+        * rle_codec -   run-length encoding; suits long runs of repeated values
+
+    */
+
+    enum class codec_id : uint32_t { raw = 0, delta = 1, frame_of_reference = 2, run_length = 3 };
+
+    namespace codec_detail
+    {
+        class bit_writer
+        {
+            unsigned char* _out;
+            uint64_t _acc;
+            unsigned _filled;
+        public:
+            explicit bit_writer(unsigned char* out)
+                : _out(out)
+                , _acc(0)
+                , _filled(0) { }
+
+            void put(uint64_t value, unsigned width)
+            {
+                // appends the low 'width' bits of 'value', at most 32 at a time so the accumulator never overflows
+                while (width > 0)
+                {
+                    unsigned chunk = width > 32 ? 32 : width;
+                    _acc |= (value & ((uint64_t(1) << chunk) - 1)) << _filled;
+                    _filled += chunk;
+                    value = chunk < 64 ? value >> chunk : 0;
+                    width -= chunk;
+
+                    while (_filled >= 8)
+                    {
+                        *_out++ = static_cast<unsigned char>(_acc);
+                        _acc >>= 8;
+                        _filled -= 8;
+                    }
+                }
+            }
+
+            unsigned char* finish()
+            {
+                if (_filled > 0)
+                {
+                    *_out++ = static_cast<unsigned char>(_acc);
+                    _acc = 0;
+                    _filled = 0;
+                }
+
+                return _out;
+            }
+        };
+
+        class bit_reader
+        {
+            const unsigned char* _in;
+            const unsigned char* _end;
+            uint64_t _acc;
+            unsigned _filled;
+        public:
+            bit_reader(const unsigned char* in, const unsigned char* end)
+                : _in(in)
+                , _end(end)
+                , _acc(0)
+                , _filled(0) { }
+
+            uint64_t get(unsigned width)
+            {
+                uint64_t result = 0;
+                unsigned shift = 0;
+                while (width > 0)
+                {
+                    unsigned chunk = width > 32 ? 32 : width;
+                    while (_filled < chunk)
+                    {
+                        if (_in == _end)
+                        {
+                            SEGMENTED_LIST_THROW(std::runtime_error("block codec: truncated bit stream"));
+                        }
+
+                        _acc |= uint64_t(*_in++) << _filled;
+                        _filled += 8;
+                    }
+
+                    result |= (_acc & ((uint64_t(1) << chunk) - 1)) << shift;
+                    _acc >>= chunk;
+                    _filled -= chunk;
+                    shift += chunk;
+                    width -= chunk;
+                }
+
+                return result;
+            }
+        };
+
+        inline unsigned bit_width(uint64_t value)
+        {
+            unsigned width = 0;
+            while (value)
+            {
+                width++;
+                value >>= 1;
+            }
+
+            return width;
+        }
+
+        template <typename T>
+        void check_length(size_t needed, size_t length)
+        {
+            if (needed > length)
+            {
+                SEGMENTED_LIST_THROW(std::runtime_error("block codec: truncated block"));
+            }
+        }
+    }
+
+
+    template <typename T>
+    struct raw_codec
+    {
+        /*
+
+        raw_codec
+        Stores elements as they are; works for any trivially copyable T
+
+        */
+
+        static_assert(std::is_trivially_copyable<T>::value, "raw_codec requires a trivially copyable T");
+
+        static const codec_id id = codec_id::raw;
+
+        static size_t max_encoded_size(size_t n)
+        {
+            return n * sizeof(T);
+        }
+
+        static size_t encode(const T* in, size_t n, unsigned char* out)
+        {
+            std::memcpy(out, in, n * sizeof(T));
+            return n * sizeof(T);
+        }
+
+        static void decode(const unsigned char* in, size_t length, T* out, size_t n)
+        {
+            codec_detail::check_length<T>(n * sizeof(T), length);
+            std::memcpy(out, in, n * sizeof(T));
+        }
+    };
+
+
+    template <typename T>
+    struct delta_codec
+    {
+        /*
+
+        delta_codec
+        Delta + zigzag + bit-packing
+
+        Layout: the bit width (1 byte), the first element, then the zigzag-encoded difference of
+        each following element from its predecessor, packed at that bit width.
+
+        */
+
+        static_assert(std::is_integral<T>::value, "delta_codec requires an integral T");
+
+        using unsigned_type = typename std::make_unsigned<T>::type;
+        using signed_type = typename std::make_signed<T>::type;
+
+        static const codec_id id = codec_id::delta;
+        static const unsigned bits = sizeof(T) * 8;
+
+        static unsigned_type zigzag(unsigned_type delta)
+        {
+            // maps small negative and positive differences alike to small unsigned values
+            auto s = static_cast<signed_type>(delta);
+            return static_cast<unsigned_type>(static_cast<unsigned_type>(delta) << 1) ^ static_cast<unsigned_type>(s >> (bits - 1));
+        }
+
+        static unsigned_type unzigzag(unsigned_type z)
+        {
+            return static_cast<unsigned_type>((z >> 1) ^ static_cast<unsigned_type>(0 - (z & 1)));
+        }
+
+        static size_t max_encoded_size(size_t n)
+        {
+            return 1 + sizeof(T) + (n * bits + 7) / 8;
+        }
+
+        static size_t encode(const T* in, size_t n, unsigned char* out)
+        {
+            if (n == 0)
+            {
+                return 0;
+            }
+
+            unsigned_type widest = 0;
+            for (size_t i = 1; i < n; i++)
+            {
+                widest |= zigzag(static_cast<unsigned_type>(static_cast<unsigned_type>(in[i]) - static_cast<unsigned_type>(in[i - 1])));
+            }
+
+            auto width = codec_detail::bit_width(widest);
+            out[0] = static_cast<unsigned char>(width);
+            std::memcpy(out + 1, &in[0], sizeof(T));
+
+            codec_detail::bit_writer writer(out + 1 + sizeof(T));
+            for (size_t i = 1; i < n; i++)
+            {
+                writer.put(zigzag(static_cast<unsigned_type>(static_cast<unsigned_type>(in[i]) - static_cast<unsigned_type>(in[i - 1]))), width);
+            }
+
+            return static_cast<size_t>(writer.finish() - out);
+        }
+
+        static void decode(const unsigned char* in, size_t length, T* out, size_t n)
+        {
+            if (n == 0)
+            {
+                return;
+            }
+
+            codec_detail::check_length<T>(1 + sizeof(T), length);
+            unsigned width = in[0];
+            if (width > bits)
+            {
+                SEGMENTED_LIST_THROW(std::runtime_error("delta_codec: corrupt block"));
+            }
+
+            std::memcpy(&out[0], in + 1, sizeof(T));
+
+            codec_detail::bit_reader reader(in + 1 + sizeof(T), in + length);
+            auto previous = static_cast<unsigned_type>(out[0]);
+            for (size_t i = 1; i < n; i++)
+            {
+                previous = static_cast<unsigned_type>(previous + unzigzag(static_cast<unsigned_type>(reader.get(width))));
+                out[i] = static_cast<T>(previous);
+            }
+        }
+    };
+
+
+    template <typename T>
+    struct for_codec
+    {
+        /*
+
+        for_codec
+        Frame of reference + bit-packing
+
+        Layout: the bit width (1 byte), the minimum element, then each element's offset from the
+        minimum, packed at that bit width.
+
+        */
+
+        static_assert(std::is_integral<T>::value, "for_codec requires an integral T");
+
+        using unsigned_type = typename std::make_unsigned<T>::type;
+
+        static const codec_id id = codec_id::frame_of_reference;
+        static const unsigned bits = sizeof(T) * 8;
+
+        static size_t max_encoded_size(size_t n)
+        {
+            return 1 + sizeof(T) + (n * bits + 7) / 8;
+        }
+
+        static size_t encode(const T* in, size_t n, unsigned char* out)
+        {
+            if (n == 0)
+            {
+                return 0;
+            }
+
+            T minimum = in[0];
+            T maximum = in[0];
+            for (size_t i = 1; i < n; i++)
+            {
+                minimum = in[i] < minimum ? in[i] : minimum;
+                maximum = in[i] > maximum ? in[i] : maximum;
+            }
+
+            auto width = codec_detail::bit_width(static_cast<unsigned_type>(static_cast<unsigned_type>(maximum) - static_cast<unsigned_type>(minimum)));
+            out[0] = static_cast<unsigned char>(width);
+            std::memcpy(out + 1, &minimum, sizeof(T));
+
+            codec_detail::bit_writer writer(out + 1 + sizeof(T));
+            for (size_t i = 0; i < n; i++)
+            {
+                writer.put(static_cast<unsigned_type>(static_cast<unsigned_type>(in[i]) - static_cast<unsigned_type>(minimum)), width);
+            }
+
+            return static_cast<size_t>(writer.finish() - out);
+        }
+
+        static void decode(const unsigned char* in, size_t length, T* out, size_t n)
+        {
+            if (n == 0)
+            {
+                return;
+            }
+
+            codec_detail::check_length<T>(1 + sizeof(T), length);
+            unsigned width = in[0];
+            if (width > bits)
+            {
+                SEGMENTED_LIST_THROW(std::runtime_error("for_codec: corrupt block"));
+            }
+
+            T minimum;
+            std::memcpy(&minimum, in + 1, sizeof(T));
+
+            codec_detail::bit_reader reader(in + 1 + sizeof(T), in + length);
+            for (size_t i = 0; i < n; i++)
+            {
+                out[i] = static_cast<T>(static_cast<unsigned_type>(static_cast<unsigned_type>(minimum) + static_cast<unsigned_type>(reader.get(width))));
+            }
+        }
+    };
+
+
+    template <typename T>
+    struct rle_codec
+    {
+        /*
+
+        rle_codec
+        Run-length encoding
+
+        Layout: a sequence of runs, each the repeated element followed by its length as a 32-bit count.
+
+        */
+
+        static_assert(std::is_trivially_copyable<T>::value, "rle_codec requires a trivially copyable T");
+
+        static const codec_id id = codec_id::run_length;
+
+        static size_t max_encoded_size(size_t n)
+        {
+            return n * (sizeof(T) + sizeof(uint32_t));
+        }
+
+        static size_t encode(const T* in, size_t n, unsigned char* out)
+        {
+            auto start = out;
+            size_t i = 0;
+            while (i < n)
+            {
+                // runs compare by bytes, which is exact for any trivially copyable T
+                uint32_t run = 1;
+                while (i + run < n && run < std::numeric_limits<uint32_t>::max() && std::memcmp(&in[i + run], &in[i], sizeof(T)) == 0)
+                {
+                    run++;
+                }
+
+                std::memcpy(out, &in[i], sizeof(T));
+                std::memcpy(out + sizeof(T), &run, sizeof(run));
+                out += sizeof(T) + sizeof(run);
+                i += run;
+            }
+
+            return static_cast<size_t>(out - start);
+        }
+
+        static void decode(const unsigned char* in, size_t length, T* out, size_t n)
+        {
+            auto end = in + length;
+            size_t i = 0;
+            while (i < n)
+            {
+                codec_detail::check_length<T>(sizeof(T) + sizeof(uint32_t), static_cast<size_t>(end - in));
+
+                T value;
+                uint32_t run;
+                std::memcpy(&value, in, sizeof(T));
+                std::memcpy(&run, in + sizeof(T), sizeof(run));
+                in += sizeof(T) + sizeof(run);
+
+                if (run == 0 || run > n - i)
+                {
+                    SEGMENTED_LIST_THROW(std::runtime_error("rle_codec: corrupt block"));
+                }
+
+                for (uint32_t r = 0; r < run; r++)
+                {
+                    out[i++] = value;
+                }
+            }
+        }
+    };
+
+
+#ifdef SEGMENTED_LIST_POSIX_IO
+    namespace io
+    {
+        struct compressed_stream_header
+        {
+            /*
+
+            compressed_stream_header
+            Precedes a list written by io::write_compressed
+
+            Each block follows as its element count and encoded size (both 32-bit), then the
+            encoded bytes. Like the plain stream, the format does not depend on the block size.
+
+            */
+
+            static const uint32_t current_version = 1;
+
+            char magic[8];
+            uint32_t version;
+            uint32_t byte_order;
+            uint64_t element_size;
+            uint64_t element_count;
+            uint64_t block_count;
+            uint32_t codec;
+            uint32_t reserved;
+
+            compressed_stream_header()
+                : magic{ 'S', 'E', 'G', 'L', 'C', 'M', 'P', 0 }
+                , version(current_version)
+                , byte_order(byte_order_mark)
+                , element_size(0)
+                , element_count(0)
+                , block_count(0)
+                , codec(0)
+                , reserved(0) { }
+        };
+
+        template <typename Codec, typename T, typename Allocator, typename Instrumentation>
+        void write_compressed(const segmented_list<T, Allocator, Instrumentation>& list, int fd)
+        {
+            /*
+
+            write_compressed
+            Writes 'list' to 'fd', compressing each block with 'Codec'
+
+            Blocks are encoded into a scratch area a batch at a time and written with writev.
+            Throws std::system_error if a write fails.
+
+            */
+
+            compressed_stream_header header;
+            header.element_size = sizeof(T);
+            header.element_count = list.size();
+            header.codec = static_cast<uint32_t>(Codec::id);
+            // empty blocks are left out, so every block in the stream holds at least one element
+            for (auto seg : list.segments())
+            {
+                header.block_count += seg.size ? 1 : 0;
+            }
+
+            // each block takes two iovecs: its prefix and its encoded bytes
+            const size_t batch = static_cast<size_t>(max_iovecs) / 2;
+            const size_t slot = Codec::max_encoded_size(list_block<T>::block_size());
+            std::vector<unsigned char> scratch(batch * slot);
+            std::vector<uint32_t> prefixes(batch * 2);
+            std::vector<iovec> iov;
+            iov.reserve(batch * 2);
+
+            iov.push_back(iovec{ &header, sizeof(header) });
+            writev_fully(fd, iov.data(), 1);
+            iov.clear();
+
+            size_t used = 0;
+            for (auto seg : list.segments())
+            {
+                if (!seg.size)
+                {
+                    continue;
+                }
+
+                if (used == batch)
+                {
+                    writev_fully(fd, iov.data(), static_cast<int>(iov.size()));
+                    iov.clear();
+                    used = 0;
+                }
+
+                auto out = scratch.data() + used * slot;
+                prefixes[used * 2] = static_cast<uint32_t>(seg.size);
+                prefixes[used * 2 + 1] = static_cast<uint32_t>(Codec::encode(seg.data, seg.size, out));
+
+                iov.push_back(iovec{ &prefixes[used * 2], sizeof(uint32_t) * 2 });
+                iov.push_back(iovec{ out, prefixes[used * 2 + 1] });
+                used++;
+            }
+
+            if (!iov.empty())
+            {
+                writev_fully(fd, iov.data(), static_cast<int>(iov.size()));
+            }
+        }
+
+        template <typename Codec, typename T, typename Allocator, typename Instrumentation>
+        void read_compressed(segmented_list<T, Allocator, Instrumentation>& list, int fd)
+        {
+            /*
+
+            read_compressed
+            Replaces the contents of 'list' with a list written by write_compressed using 'Codec'
+
+            Throws std::system_error if a read fails, or std::runtime_error if the stream was
+            written with a different codec or element type, or is corrupt. The list is left empty on
+            failure.
+
+            */
+
+            list.clear();
+
+            compressed_stream_header header;
+            iovec header_iov{ &header, sizeof(header) };
+            readv_fully(fd, &header_iov, 1);
+
+            compressed_stream_header reference;
+            if (std::memcmp(header.magic, reference.magic, sizeof(reference.magic)) != 0
+                || header.version != compressed_stream_header::current_version
+                || header.byte_order != byte_order_mark
+                || header.element_size != sizeof(T)
+                || header.codec != static_cast<uint32_t>(Codec::id))
+            {
+                SEGMENTED_LIST_THROW(std::runtime_error("read_compressed: incompatible stream"));
+            }
+
+            // every block is decoded into 'decoded' before any of it reaches the list, so a block's
+            // sizes are checked against the block size before anything is allocated for it
+            std::vector<unsigned char> encoded(Codec::max_encoded_size(list_block<T>::block_size()));
+            std::vector<T> decoded(list_block<T>::block_size());
+
+#ifdef SEGMENTED_LIST_EXCEPTIONS
+            try
+#endif
+            {
+                for (uint64_t b = 0; b < header.block_count; b++)
+                {
+                    uint32_t prefix[2];
+                    iovec prefix_iov{ prefix, sizeof(prefix) };
+                    readv_fully(fd, &prefix_iov, 1);
+
+                    if (prefix[0] == 0 || prefix[0] > list_block<T>::block_size()
+                        || prefix[1] > Codec::max_encoded_size(prefix[0])
+                        || list.size() + prefix[0] > header.element_count)
+                    {
+                        SEGMENTED_LIST_THROW(std::runtime_error("read_compressed: corrupt block"));
+                    }
+
+                    iovec data_iov{ encoded.data(), prefix[1] };
+                    readv_fully(fd, &data_iov, 1);
+
+                    Codec::decode(encoded.data(), prefix[1], decoded.data(), prefix[0]);
+                    for (uint32_t i = 0; i < prefix[0]; i++)
+                    {
+                        list.push_back(decoded[i]);
+                    }
+                }
+
+                if (list.size() != header.element_count)
+                {
+                    SEGMENTED_LIST_THROW(std::runtime_error("read_compressed: corrupt stream"));
+                }
+            }
+#ifdef SEGMENTED_LIST_EXCEPTIONS
+            catch (...)
+            {
+                list.clear();
+                throw;
+            }
+#endif
+        }
+    }
+#endif
+}
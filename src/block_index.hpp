@@ -0,0 +1,1145 @@
+#pragma once
+
+/*
+
+block_index.hpp
+Copyright 2020 Riley Lannon
+
+Counted indexes over a segmented_list's block chain
+
+A counted index finds the block holding a position from the number of elements each block holds,
+so unlike the block directory it does not need every block but the last to be full. This lets a
+segmented_list keep insert and erase local to one block (see indexing_policy). Every index
+provides the same interface, which segmented_list calls as the chain changes:
+    * build(head) -         Indexes the chain starting at 'head', replacing anything indexed before
+    * clear() -             Forgets every block
+    * find(pos, offset, walked) -
+                            Returns the block holding position 'pos', which must be less than the
+                            number of elements, and sets 'offset' to its index in that block and
+                            'walked' to the number of links followed
+    * resized(block, delta) -
+                            'block' gained (or, if 'delta' is negative, lost) elements
+    * inserted(block) -     'block' was linked into the chain, holding the elements it has now
+    * erased(block) -       'block', still linked, is about to be unlinked with the elements it has now
+    * memory_usage() -      The bytes the index holds, not counting the blocks
+
+The indexes keep a per-block entry in the block: the skip list its express node, if the block has
+one, and the B+-tree the node holding the block, in '_index_node'; the Fenwick tree the block's
+number, in '_index_number'.
+
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+namespace segmented_list
+{
+    template <typename Block>
+    class skip_index
+    {
+        /*
+
+        skip_index
+        Express links over the block chain, making it a skip list ordered by position
+
+        The chain itself is the bottom level. About one block in four also has an express node,
+        which is linked to the next node of at least the same height on each of its levels; a node
+        has height h with probability (1/4)^(h - 1) * 3/4. Each link records its span: the elements
+        from the start of its node's block up to the start of the next node's block on that level.
+        A lookup follows the links from the highest level down while the remaining position covers
+        their spans, then walks the few blocks left on the chain, for O(log blocks) links expected.
+
+        Splicing a block in or out, or resizing one, updates only the nodes whose links pass over
+        it, which are found by walking back from the block to its nearest node and climbing.
+
+        The span of the last link on each level is never read, since no lookup follows it, so it
+        is not kept up to date; in particular appending to or removing from the last block costs
+        no more than checking for that case.
+
+        */
+
+        static const size_t max_levels = 16;
+
+        struct node;
+
+        struct level
+        {
+            node* next;
+            node* previous;
+            size_t span;
+        };
+
+        struct node
+        {
+            Block* block;   // nullptr for the header, which stands before the first block
+            size_t height;
+
+            level* levels() noexcept
+            {
+                // the levels are allocated along with the node, directly after it, so a hop touches one allocation
+                return reinterpret_cast<level*>(this + 1);
+            }
+        };
+
+        static node* _new_node(Block* block, size_t height)
+        {
+            // a node is unlinked until its levels are filled in
+            auto n = new (::operator new(sizeof(node) + height * sizeof(level))) node{ block, height };
+            for (size_t l = 0; l < height; l++)
+            {
+                new (&n->levels()[l]) level{ nullptr, nullptr, 0 };
+            }
+
+            return n;
+        }
+
+        static void _delete_node(node* n) noexcept
+        {
+            // nodes and levels are trivially destructible
+            ::operator delete(n);
+        }
+
+        node* _header;
+        Block* _head;
+        size_t _levels;     // levels in use; every level at or above this has no links
+        size_t _nodes;
+        size_t _node_levels;
+        uint64_t _random;
+
+        size_t _random_height()
+        {
+            // xorshift64; each further level has a 1 in 4 chance
+            size_t height = 0;
+            do
+            {
+                _random ^= _random << 13;
+                _random ^= _random >> 7;
+                _random ^= _random << 17;
+                height++;
+            } while (height < max_levels && (_random & 3) == 0);
+
+            // most blocks get no node at all
+            return height - 1;
+        }
+
+        static node* _node_of(Block* block) noexcept
+        {
+            return static_cast<node*>(block->_index_node);
+        }
+
+        node* _nearest(Block* block, size_t& distance)
+        {
+            /*
+
+            _nearest
+            Returns the last node before 'block', setting 'distance' to the elements from its start to the start of 'block'
+
+            */
+
+            distance = 0;
+            for (auto current = block->_previous; current; current = current->_previous)
+            {
+                distance += current->_size;
+                if (current->_index_node)
+                {
+                    return _node_of(current);
+                }
+            }
+
+            return _header;
+        }
+
+        void _covering(Block* block, size_t levels, node** update, size_t* distance)
+        {
+            /*
+
+            _covering
+            Finds, on each of the first 'levels' levels, the last node before 'block' and the elements from its start to that of 'block'
+
+            */
+
+            size_t d;
+            auto x = _nearest(block, d);
+            for (size_t l = 0; l < levels; l++)
+            {
+                // climb to a node tall enough for this level; the header always is
+                while (x->height <= l)
+                {
+                    auto top = x->height - 1;
+                    auto previous = x->levels()[top].previous;
+                    d += previous->levels()[top].span;
+                    x = previous;
+                }
+
+                update[l] = x;
+                distance[l] = d;
+            }
+        }
+
+        void _destroy_nodes() noexcept
+        {
+            // every node is on the first level, so freeing along it frees them all
+            auto current = _header->levels()[0].next;
+            while (current)
+            {
+                auto next = current->levels()[0].next;
+                current->block->_index_node = nullptr;
+                _delete_node(current);
+                current = next;
+            }
+
+            for (size_t l = 0; l < max_levels; l++)
+            {
+                _header->levels()[l] = level{};
+            }
+
+            _levels = 0;
+            _nodes = 0;
+            _node_levels = 0;
+        }
+    public:
+        void build(Block* head)
+        {
+            /*
+
+            build
+            Indexes the chain starting at 'head', giving each block a random height
+
+            */
+
+            _destroy_nodes();
+            _head = head;
+
+            node* last[max_levels];
+            size_t last_start[max_levels];
+            for (size_t l = 0; l < max_levels; l++)
+            {
+                last[l] = _header;
+                last_start[l] = 0;
+            }
+
+            size_t start = 0;
+            for (auto block = head; block; block = block->_next)
+            {
+                auto height = _random_height();
+                if (height)
+                {
+                    auto n = _new_node(block, height);
+                    block->_index_node = n;
+                    for (size_t l = 0; l < height; l++)
+                    {
+                        last[l]->levels()[l].next = n;
+                        last[l]->levels()[l].span = start - last_start[l];
+                        n->levels()[l].previous = last[l];
+                        last[l] = n;
+                        last_start[l] = start;
+                    }
+
+                    _levels = height > _levels ? height : _levels;
+                    _nodes++;
+                    _node_levels += height;
+                }
+
+                start += block->_size;
+            }
+        }
+
+        void clear() noexcept
+        {
+            _destroy_nodes();
+            _head = nullptr;
+        }
+
+        Block* find(size_t pos, size_t& offset, size_t& walked) const
+        {
+            /*
+
+            find
+            Returns the block holding position 'pos', setting 'offset' to the position within it
+
+            */
+
+            walked = 0;
+            auto x = _header;
+            for (size_t l = _levels; l-- > 0; )
+            {
+                while (x->levels()[l].next && pos >= x->levels()[l].span)
+                {
+                    pos -= x->levels()[l].span;
+                    x = x->levels()[l].next;
+                    walked++;
+                }
+            }
+
+            // the rest of the way is on the chain, from the node's block (or the first block)
+            auto block = x->block ? x->block : _head;
+            while (pos >= block->_size)
+            {
+                pos -= block->_size;
+                block = block->_next;
+                walked++;
+            }
+
+            offset = pos;
+            return block;
+        }
+
+        void resized(Block* block, std::ptrdiff_t delta)
+        {
+            /*
+
+            resized
+            Adds 'delta' to the span of every link passing over 'block'
+
+            */
+
+            // only last links pass over the last block, and their spans are not kept
+            if (!block->_next)
+            {
+                return;
+            }
+
+            auto x = block->_index_node ? _node_of(block) : nullptr;
+            if (!x)
+            {
+                size_t unused;
+                x = _nearest(block, unused);
+            }
+
+            for (size_t l = 0; l < _levels; l++)
+            {
+                while (x->height <= l)
+                {
+                    x = x->levels()[x->height - 1].previous;
+                }
+
+                x->levels()[l].span += delta;
+            }
+        }
+
+        void inserted(Block* block)
+        {
+            /*
+
+            inserted
+            Indexes 'block', which has just been linked into the chain
+
+            */
+
+            if (!block->_previous)
+            {
+                _head = block;
+            }
+
+            auto height = _random_height();
+            auto levels = height > _levels ? height : _levels;
+
+            node* update[max_levels];
+            size_t distance[max_levels];
+            _covering(block, levels, update, distance);
+
+            node* n = nullptr;
+            if (height)
+            {
+                n = _new_node(block, height);
+                block->_index_node = n;
+                _nodes++;
+                _node_levels += height;
+            }
+
+            for (size_t l = 0; l < levels; l++)
+            {
+                auto x = update[l];
+                if (l < height)
+                {
+                    // the new node takes over the part of x's span from its own block onwards
+                    n->levels()[l].next = x->levels()[l].next;
+                    n->levels()[l].previous = x;
+                    n->levels()[l].span = x->levels()[l].span - distance[l] + block->_size;
+                    if (n->levels()[l].next)
+                    {
+                        n->levels()[l].next->levels()[l].previous = n;
+                    }
+
+                    x->levels()[l].next = n;
+                    x->levels()[l].span = distance[l];
+                }
+                else
+                {
+                    x->levels()[l].span += block->_size;
+                }
+            }
+
+            _levels = levels;
+        }
+
+        void erased(Block* block)
+        {
+            /*
+
+            erased
+            Removes 'block', which is about to be unlinked from the chain, from the index
+
+            */
+
+            if (block == _head)
+            {
+                _head = block->_next;
+            }
+
+            node* update[max_levels];
+            size_t distance[max_levels];
+            _covering(block, _levels, update, distance);
+
+            auto n = _node_of(block);
+            auto height = n ? n->height : 0;
+            for (size_t l = 0; l < _levels; l++)
+            {
+                auto x = update[l];
+                if (l < height)
+                {
+                    // x's link now reaches as far as the removed node's did
+                    x->levels()[l].next = n->levels()[l].next;
+                    x->levels()[l].span += n->levels()[l].span - block->_size;
+                    if (n->levels()[l].next)
+                    {
+                        n->levels()[l].next->levels()[l].previous = x;
+                    }
+                }
+                else
+                {
+                    x->levels()[l].span -= block->_size;
+                }
+            }
+
+            if (n)
+            {
+                block->_index_node = nullptr;
+                _nodes--;
+                _node_levels -= height;
+                _delete_node(n);
+            }
+
+            while (_levels && !_header->levels()[_levels - 1].next)
+            {
+                _levels--;
+            }
+        }
+
+        size_t memory_usage() const noexcept
+        {
+            // the header is a node of every level
+            return sizeof(*this) + (_nodes + 1) * sizeof(node) + (_node_levels + max_levels) * sizeof(level);
+        }
+
+        skip_index()
+            : _header(_new_node(nullptr, max_levels))
+            , _head(nullptr)
+            , _levels(0)
+            , _nodes(0)
+            , _node_levels(0)
+            , _random(0x9e3779b97f4a7c15ull) { }
+
+        skip_index(const skip_index&) = delete;
+        skip_index& operator=(const skip_index&) = delete;
+
+        ~skip_index()
+        {
+            _destroy_nodes();
+            _delete_node(_header);
+        }
+    };
+
+
+    template <typename Block, size_t Fanout = 16>
+    class counted_btree
+    {
+        /*
+
+        counted_btree
+        A counted B+-tree whose leaves are the blocks, giving O(log n) lookups, splices and resizes
+
+        Each internal node holds up to 'Fanout' children, with the number of elements under each,
+        so a lookup descends from the root subtracting counts until it reaches a block. The nodes
+        just above the blocks are the leaf nodes; a block's '_index_node' points to its leaf node,
+        and a node to its parent, so resizing a block adds to one count on each level on the way
+        back up. Children are searched for from the back of their node, where appends land.
+
+        A full node is split in half, except that a block or node appended after the last child of
+        a full node starts a new node on its own, so a list built by appending keeps its nodes
+        full. A node that falls below half full is merged with a sibling if the two fit in one
+        node, or else takes a child from it.
+
+        The nodes a split needs are set aside before anything changes, so an allocation failure
+        leaves the tree as it was.
+
+        */
+
+        static_assert(Fanout >= 4, "counted_btree nodes need room for at least 4 children");
+
+        struct node
+        {
+            node* parent;       // on the spare list, the next spare node
+            bool leaf;          // whether the children are blocks
+            size_t count;
+            size_t sizes[Fanout];
+            void* children[Fanout];
+        };
+
+        node* _root;
+        size_t _depth;
+        size_t _nodes;
+
+        // nodes set aside for splits, and freed nodes kept for reuse
+        node* _spare;
+        size_t _spares;
+
+        node* _take_node(bool leaf) noexcept
+        {
+            // the caller has reserved the node
+            auto n = _spare;
+            _spare = n->parent;
+            _spares--;
+            _nodes++;
+
+            n->parent = nullptr;
+            n->leaf = leaf;
+            n->count = 0;
+            return n;
+        }
+
+        void _free_node(node* n) noexcept
+        {
+            _nodes--;
+            if (_spares > _depth)
+            {
+                delete n;
+                return;
+            }
+
+            n->parent = _spare;
+            _spare = n;
+            _spares++;
+        }
+
+        void _reserve(node* n)
+        {
+            // sets aside a node for every full node from 'n' up, and one more for a new root
+            size_t needed = 1;
+            for (; n && n->count == Fanout; n = n->parent)
+            {
+                needed++;
+            }
+
+            while (_spares < needed)
+            {
+                auto spare = new node();
+                spare->parent = _spare;
+                _spare = spare;
+                _spares++;
+            }
+        }
+
+        static size_t _slot_of(const node* parent, const void* child) noexcept
+        {
+            size_t slot = parent->count;
+            while (parent->children[--slot] != child) { }
+            return slot;
+        }
+
+        static void _adopt(node* n, size_t slot) noexcept
+        {
+            // points the child in 'slot' back at 'n'
+            if (n->leaf)
+            {
+                static_cast<Block*>(n->children[slot])->_index_node = n;
+            }
+            else
+            {
+                static_cast<node*>(n->children[slot])->parent = n;
+            }
+        }
+
+        static size_t _total(const node* n) noexcept
+        {
+            size_t total = 0;
+            for (size_t i = 0; i < n->count; i++)
+            {
+                total += n->sizes[i];
+            }
+
+            return total;
+        }
+
+        static void _propagate(node* n, size_t delta) noexcept
+        {
+            // adds 'delta' (modulo 2^64, so it may be negative) to the count of 'n' in each of its ancestors
+            for (auto parent = n->parent; parent; n = parent, parent = parent->parent)
+            {
+                parent->sizes[_slot_of(parent, n)] += delta;
+            }
+        }
+
+        static void _place(node* n, size_t slot, void* child, size_t size) noexcept
+        {
+            // puts 'child' in 'slot' of 'n', which must have room, without touching the ancestors
+            for (auto i = n->count; i > slot; i--)
+            {
+                n->children[i] = n->children[i - 1];
+                n->sizes[i] = n->sizes[i - 1];
+            }
+
+            n->children[slot] = child;
+            n->sizes[slot] = size;
+            n->count++;
+            _adopt(n, slot);
+        }
+
+        static void _take_out(node* n, size_t slot) noexcept
+        {
+            // removes the child in 'slot' of 'n', without touching the ancestors
+            for (auto i = slot + 1; i < n->count; i++)
+            {
+                n->children[i - 1] = n->children[i];
+                n->sizes[i - 1] = n->sizes[i];
+            }
+
+            n->count--;
+        }
+
+        void _insert_child(node* n, size_t slot, void* child, size_t size) noexcept
+        {
+            /*
+
+            _insert_child
+            Inserts 'child', holding 'size' elements, in 'slot' of 'n', splitting nodes as needed
+
+            Enough nodes must have been reserved.
+
+            */
+
+            if (n->count < Fanout)
+            {
+                _place(n, slot, child, size);
+                _propagate(n, size);
+                return;
+            }
+
+            // appending to a full node starts a new one; anything else splits it in half
+            auto sibling = _take_node(n->leaf);
+            size_t keep = slot == Fanout ? Fanout : Fanout / 2;
+            for (auto i = keep; i < Fanout; i++)
+            {
+                sibling->children[i - keep] = n->children[i];
+                sibling->sizes[i - keep] = n->sizes[i];
+                _adopt(sibling, i - keep);
+            }
+
+            sibling->count = Fanout - keep;
+            n->count = keep;
+
+            if (slot <= keep && keep < Fanout)
+            {
+                _place(n, slot, child, size);
+            }
+            else
+            {
+                _place(sibling, slot - keep, child, size);
+            }
+
+            auto n_total = _total(n);
+            auto sibling_total = _total(sibling);
+
+            if (!n->parent)
+            {
+                // the root split, so the tree grows a level
+                auto root = _take_node(false);
+                root->children[0] = n;
+                root->sizes[0] = n_total;
+                root->children[1] = sibling;
+                root->sizes[1] = sibling_total;
+                root->count = 2;
+                n->parent = root;
+                sibling->parent = root;
+                _root = root;
+                _depth++;
+                return;
+            }
+
+            // 'n' keeps its place in the parent with a new count, and the sibling follows it
+            auto parent = n->parent;
+            auto n_slot = _slot_of(parent, n);
+            auto old = parent->sizes[n_slot];
+            parent->sizes[n_slot] = n_total;
+            _propagate(parent, n_total - old);
+            _insert_child(parent, n_slot + 1, sibling, sibling_total);
+        }
+
+        void _rebalance(node* n) noexcept
+        {
+            /*
+
+            _rebalance
+            Restores the node occupancy after 'n' lost a child
+
+            */
+
+            if (n == _root)
+            {
+                if (n->count == 0)
+                {
+                    _root = nullptr;
+                    _depth = 0;
+                    _free_node(n);
+                }
+                else if (!n->leaf && n->count == 1)
+                {
+                    // a root with one child is not needed
+                    _root = static_cast<node*>(n->children[0]);
+                    _root->parent = nullptr;
+                    _depth--;
+                    _free_node(n);
+                }
+
+                return;
+            }
+
+            if (n->count * 2 >= Fanout)
+            {
+                return;
+            }
+
+            // an appended node may have started a parent of its own, leaving no sibling to pair with
+            auto parent = n->parent;
+            if (parent->count == 1)
+            {
+                if (n->count == 0)
+                {
+                    _take_out(parent, 0);
+                    _free_node(n);
+                    _rebalance(parent);
+                }
+
+                return;
+            }
+
+            // pair 'n' with its left sibling, or its right one if it has none
+            auto slot = _slot_of(parent, n);
+            auto left_slot = slot > 0 ? slot - 1 : slot;
+            auto left = static_cast<node*>(parent->children[left_slot]);
+            auto right = static_cast<node*>(parent->children[left_slot + 1]);
+
+            if (left->count + right->count <= Fanout)
+            {
+                for (size_t i = 0; i < right->count; i++)
+                {
+                    left->children[left->count] = right->children[i];
+                    left->sizes[left->count] = right->sizes[i];
+                    _adopt(left, left->count);
+                    left->count++;
+                }
+
+                // the parent's total is unchanged, so only it needs updating
+                parent->sizes[left_slot] += parent->sizes[left_slot + 1];
+                _take_out(parent, left_slot + 1);
+                _free_node(right);
+                _rebalance(parent);
+            }
+            else if (n == left)
+            {
+                auto moved = right->sizes[0];
+                _place(left, left->count, right->children[0], moved);
+                _take_out(right, 0);
+                parent->sizes[left_slot] += moved;
+                parent->sizes[left_slot + 1] -= moved;
+            }
+            else
+            {
+                auto last = left->count - 1;
+                auto moved = left->sizes[last];
+                _place(right, 0, left->children[last], moved);
+                _take_out(left, last);
+                parent->sizes[left_slot] -= moved;
+                parent->sizes[left_slot + 1] += moved;
+            }
+        }
+
+        void _destroy(node* n) noexcept
+        {
+            for (size_t i = 0; i < n->count; i++)
+            {
+                if (n->leaf)
+                {
+                    static_cast<Block*>(n->children[i])->_index_node = nullptr;
+                }
+                else
+                {
+                    _destroy(static_cast<node*>(n->children[i]));
+                }
+            }
+
+            delete n;
+        }
+    public:
+        void build(Block* head)
+        {
+            // appends every block in turn; appending keeps the nodes full
+            clear();
+            for (auto block = head; block; block = block->_next)
+            {
+                inserted(block);
+            }
+        }
+
+        void clear() noexcept
+        {
+            if (_root)
+            {
+                _destroy(_root);
+            }
+
+            _root = nullptr;
+            _depth = 0;
+            _nodes = 0;
+        }
+
+        Block* find(size_t pos, size_t& offset, size_t& walked) const
+        {
+            /*
+
+            find
+            Returns the block holding position 'pos', setting 'offset' to the position within it
+
+            */
+
+            walked = 0;
+            auto n = _root;
+            while (true)
+            {
+                size_t i = 0;
+                while (pos >= n->sizes[i])
+                {
+                    pos -= n->sizes[i];
+                    i++;
+                }
+
+                walked++;
+                if (n->leaf)
+                {
+                    offset = pos;
+                    return static_cast<Block*>(n->children[i]);
+                }
+
+                n = static_cast<node*>(n->children[i]);
+            }
+        }
+
+        void resized(Block* block, std::ptrdiff_t delta) noexcept
+        {
+            auto n = static_cast<node*>(block->_index_node);
+            n->sizes[_slot_of(n, block)] += static_cast<size_t>(delta);
+            _propagate(n, static_cast<size_t>(delta));
+        }
+
+        void inserted(Block* block)
+        {
+            /*
+
+            inserted
+            Adds 'block', which has just been linked into the chain, next to its neighbour
+
+            */
+
+            // while building, the next block is not in the tree yet
+            node* n;
+            size_t slot;
+            if (block->_previous)
+            {
+                n = static_cast<node*>(block->_previous->_index_node);
+                slot = _slot_of(n, block->_previous) + 1;
+            }
+            else if (block->_next && block->_next->_index_node)
+            {
+                n = static_cast<node*>(block->_next->_index_node);
+                slot = 0;
+            }
+            else
+            {
+                // the first block
+                _reserve(nullptr);
+                _root = _take_node(true);
+                _depth = 1;
+                _place(_root, 0, block, block->_size);
+                return;
+            }
+
+            _reserve(n);
+            _insert_child(n, slot, block, block->_size);
+        }
+
+        void erased(Block* block) noexcept
+        {
+            /*
+
+            erased
+            Removes 'block', which is about to be unlinked from the chain, from the tree
+
+            */
+
+            auto n = static_cast<node*>(block->_index_node);
+            if (!n)
+            {
+                // the block was never added
+                return;
+            }
+
+            auto slot = _slot_of(n, block);
+            auto size = n->sizes[slot];
+            _take_out(n, slot);
+            _propagate(n, 0 - size);
+            block->_index_node = nullptr;
+            _rebalance(n);
+        }
+
+        size_t memory_usage() const noexcept
+        {
+            return sizeof(*this) + (_nodes + _spares) * sizeof(node);
+        }
+
+        counted_btree() noexcept
+            : _root(nullptr)
+            , _depth(0)
+            , _nodes(0)
+            , _spare(nullptr)
+            , _spares(0) { }
+
+        counted_btree(const counted_btree&) = delete;
+        counted_btree& operator=(const counted_btree&) = delete;
+
+        ~counted_btree()
+        {
+            clear();
+            while (_spare)
+            {
+                auto next = _spare->parent;
+                delete _spare;
+                _spare = next;
+            }
+        }
+    };
+
+
+    template <typename Block>
+    class fenwick_index
+    {
+        /*
+
+        fenwick_index
+        A block directory with a Fenwick (binary indexed) tree over the blocks' sizes
+
+        Entry i of the tree holds the elements in the blocks numbered i - lowbit(i) + 1 to i
+        (numbering from 1), so a lookup descends over the powers of two, and resizing a block
+        updates the entries covering it; both take O(log blocks) steps through two flat arrays.
+        Each block records its number in '_index_number'.
+
+        Blocks added or removed at the end are O(log blocks) too, since the entries before them are
+        unaffected. Anywhere else, the blocks after it are renumbered and the tree is rebuilt, in
+        O(blocks), so this suits lists that mostly append and only occasionally edit the middle.
+
+        */
+
+        std::vector<Block*> _blocks;
+        std::vector<size_t> _tree;  // _tree[0] is unused
+
+        static size_t _lowbit(size_t i) noexcept
+        {
+            return i & (0 - i);
+        }
+
+        size_t _prefix(size_t i) const noexcept
+        {
+            // the elements in the first i blocks
+            size_t sum = 0;
+            for (; i > 0; i -= _lowbit(i))
+            {
+                sum += _tree[i];
+            }
+
+            return sum;
+        }
+
+        void _rebuild() noexcept
+        {
+            // renumbers the blocks and rebuilds the tree from their sizes, in O(blocks)
+            auto n = _blocks.size();
+            for (size_t i = 1; i <= n; i++)
+            {
+                _blocks[i - 1]->_index_number = i - 1;
+                _tree[i] = _blocks[i - 1]->_size;
+            }
+
+            for (size_t i = 1; i <= n; i++)
+            {
+                auto parent = i + _lowbit(i);
+                if (parent <= n)
+                {
+                    _tree[parent] += _tree[i];
+                }
+            }
+        }
+
+        bool _indexed(const Block* block) const noexcept
+        {
+            return block->_index_number < _blocks.size() && _blocks[block->_index_number] == block;
+        }
+    public:
+        void build(Block* head)
+        {
+            /*
+
+            build
+            Numbers the chain starting at 'head' and builds the tree over it
+
+            */
+
+            clear();
+            for (auto block = head; block; block = block->_next)
+            {
+                _blocks.push_back(block);
+            }
+
+            _tree.resize(_blocks.size() + 1);
+            _rebuild();
+        }
+
+        void clear() noexcept
+        {
+            // stale numbers need no reset: '_indexed' checks a block's number against the directory
+            _blocks.clear();
+            _tree.assign(1, 0);
+        }
+
+        Block* find(size_t pos, size_t& offset, size_t& walked) const
+        {
+            /*
+
+            find
+            Returns the block holding position 'pos', setting 'offset' to the position within it
+
+            Finds the most blocks whose elements all come before 'pos'; the block after them holds it.
+
+            */
+
+            auto n = _blocks.size();
+            size_t step = 1;
+            while (step * 2 <= n)
+            {
+                step *= 2;
+            }
+
+            walked = 0;
+            size_t before = 0;
+            for (; step; step /= 2)
+            {
+                walked++;
+                if (before + step <= n && _tree[before + step] <= pos)
+                {
+                    before += step;
+                    pos -= _tree[before];
+                }
+            }
+
+            offset = pos;
+            return _blocks[before];
+        }
+
+        void resized(Block* block, std::ptrdiff_t delta) noexcept
+        {
+            for (auto i = block->_index_number + 1; i < _tree.size(); i += _lowbit(i))
+            {
+                _tree[i] += static_cast<size_t>(delta);
+            }
+        }
+
+        void inserted(Block* block)
+        {
+            /*
+
+            inserted
+            Numbers 'block', which has just been linked into the chain
+
+            */
+
+            // make room first, so that a failure leaves the index as it was
+            if (_blocks.size() == _blocks.capacity())
+            {
+                _blocks.reserve(_blocks.size() * 2 + 1);
+            }
+
+            if (_tree.size() == _tree.capacity())
+            {
+                _tree.reserve(_tree.size() * 2 + 1);
+            }
+
+            if (!block->_next || !_indexed(block->_next))
+            {
+                // appended: the new entry covers the block and the lowbit - 1 blocks before it
+                auto i = _blocks.size() + 1;
+                block->_index_number = _blocks.size();
+                _blocks.push_back(block);
+                _tree.push_back(block->_size + _prefix(i - 1) - _prefix(i - _lowbit(i)));
+                return;
+            }
+
+            auto number = block->_next->_index_number;
+            _blocks.insert(_blocks.begin() + number, block);
+            _tree.push_back(0);
+            _rebuild();
+        }
+
+        void erased(Block* block) noexcept
+        {
+            /*
+
+            erased
+            Removes 'block', which is about to be unlinked from the chain, from the directory and tree
+
+            */
+
+            if (!_indexed(block))
+            {
+                // the block was never added
+                return;
+            }
+
+            auto number = block->_index_number;
+            _tree.pop_back();
+            if (number + 1 == _blocks.size())
+            {
+                _blocks.pop_back();
+                return;
+            }
+
+            _blocks.erase(_blocks.begin() + number);
+            _rebuild();
+        }
+
+        size_t memory_usage() const noexcept
+        {
+            return sizeof(*this) + _blocks.capacity() * sizeof(Block*) + _tree.capacity() * sizeof(size_t);
+        }
+
+        fenwick_index()
+            : _tree(1, 0) { }
+
+        fenwick_index(const fenwick_index&) = delete;
+        fenwick_index& operator=(const fenwick_index&) = delete;
+
+        ~fenwick_index()
+        {
+            clear();
+        }
+    };
+}
@@ -0,0 +1,603 @@
+#pragma once
+
+/*
+
+block_io.hpp
+Copyright 2020 Riley Lannon
+
+Batched block reads and writes, using io_uring where the kernel allows it and pread/pwrite otherwise
+
+*/
+
+#include "list_io.hpp"
+
+#ifdef SEGMENTED_LIST_POSIX_IO
+
+#include <vector>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SEGMENTED_LIST_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <ctime>
+#endif
+#endif
+
+namespace segmented_list
+{
+    namespace io
+    {
+        class block_io
+        {
+            /*
+
+            block_io
+            Queues block-sized reads and writes at explicit offsets and completes them in bulk
+
+            With the io_uring backend, up to 'queue_depth' operations are in flight at once and are
+            submitted with a single system call per batch. Buffers registered with
+            'register_buffers' are used with the fixed-buffer opcodes, which spares the kernel from
+            pinning and unpinning the pages on every operation. Only memory that lives as long as
+            the registration is worth registering: paged_list registers its frame pool, but the
+            segmented_list overloads do not register the list's blocks, which are separate heap
+            allocations, so they always use the ordinary opcodes.
+
+            If io_uring is not available (an old kernel, a seccomp filter, or a non-Linux system),
+            or the sync backend is asked for, every operation is performed immediately with
+            pread/pwrite instead. Callers do not need to tell the difference, except in speed.
+
+            Buffers must stay valid, and must not be touched, until 'wait_all' returns.
+
+            */
+        public:
+            enum backend { backend_sync = 0, backend_uring = 1 };
+
+        private:
+            struct request
+            {
+                int fd;
+                bool write;
+                int buffer_index;   // index of a registered buffer, or -1
+                char* buffer;
+                size_t remaining;
+                off_t offset;
+                iovec iov;          // used by the vectored opcodes; must outlive the submission
+            };
+
+            backend _backend;
+            std::vector<iovec> _registered;
+
+#ifdef SEGMENTED_LIST_IO_URING
+            int _ring_fd;
+            unsigned _entries;
+
+            void* _sq_ring;
+            size_t _sq_ring_size;
+            void* _cq_ring;
+            size_t _cq_ring_size;
+            io_uring_sqe* _sqes;
+            size_t _sqes_size;
+
+            unsigned* _sq_head;
+            unsigned* _sq_tail;
+            unsigned* _sq_mask;
+            unsigned* _sq_array;
+            unsigned* _cq_head;
+            unsigned* _cq_tail;
+            unsigned* _cq_mask;
+            io_uring_cqe* _cqes;
+
+            unsigned _to_submit;
+            unsigned _in_flight;
+
+            std::vector<request> _requests;
+            std::vector<unsigned> _free_slots;
+            int _error;
+
+            bool _setup(unsigned entries)
+            {
+                /*
+
+                _setup
+                Creates the ring and maps its queues; returns false if io_uring cannot be used
+
+                */
+
+                io_uring_params params;
+                std::memset(&params, 0, sizeof(params));
+
+                int fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+                if (fd < 0)
+                {
+                    return false;
+                }
+
+                _ring_fd = fd;
+                _entries = params.sq_entries;
+                _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+                _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+                bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+                if (single_mmap)
+                {
+                    _sq_ring_size = _sq_ring_size > _cq_ring_size ? _sq_ring_size : _cq_ring_size;
+                    _cq_ring_size = _sq_ring_size;
+                }
+
+                _sq_ring = ::mmap(nullptr, _sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+                if (_sq_ring == MAP_FAILED)
+                {
+                    _sq_ring = nullptr;
+                    _teardown();
+                    return false;
+                }
+
+                if (single_mmap)
+                {
+                    _cq_ring = _sq_ring;
+                }
+                else
+                {
+                    _cq_ring = ::mmap(nullptr, _cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+                    if (_cq_ring == MAP_FAILED)
+                    {
+                        _cq_ring = nullptr;
+                        _teardown();
+                        return false;
+                    }
+                }
+
+                _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+                auto sqes = ::mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+                if (sqes == MAP_FAILED)
+                {
+                    _teardown();
+                    return false;
+                }
+
+                _sqes = static_cast<io_uring_sqe*>(sqes);
+
+                auto sq = static_cast<char*>(_sq_ring);
+                _sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+                _sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+                _sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+                _sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+                auto cq = static_cast<char*>(_cq_ring);
+                _cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+                _cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+                _cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+                _cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+                // one request slot per submission queue entry bounds the operations in flight
+                _requests.resize(_entries);
+                for (unsigned i = _entries; i > 0; i--)
+                {
+                    _free_slots.push_back(i - 1);
+                }
+
+                return true;
+            }
+
+            void _teardown()
+            {
+                if (_sqes)
+                {
+                    ::munmap(_sqes, _sqes_size);
+                    _sqes = nullptr;
+                }
+
+                if (_cq_ring && _cq_ring != _sq_ring)
+                {
+                    ::munmap(_cq_ring, _cq_ring_size);
+                }
+
+                _cq_ring = nullptr;
+
+                if (_sq_ring)
+                {
+                    ::munmap(_sq_ring, _sq_ring_size);
+                    _sq_ring = nullptr;
+                }
+
+                if (_ring_fd >= 0)
+                {
+                    ::close(_ring_fd);
+                    _ring_fd = -1;
+                }
+            }
+
+            int _enter(unsigned to_submit, unsigned min_complete) noexcept
+            {
+                // returns the entries submitted, or -errno
+                while (true)
+                {
+                    auto result = ::syscall(__NR_io_uring_enter, _ring_fd, to_submit, min_complete,
+                        min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+                    if (result >= 0)
+                    {
+                        return static_cast<int>(result);
+                    }
+                    else if (errno != EINTR)
+                    {
+                        return -errno;
+                    }
+                }
+            }
+
+            void _abandon() noexcept
+            {
+                /*
+
+                _abandon
+                Closes a ring that has stopped working, and performs later operations with the sync backend
+
+                Entries still in the submission queue were never taken by the kernel, so they are
+                dropped. The ones it did take may still be using their buffers, and closing the ring
+                does not wait for them, so each one's completion is waited for first; they are not
+                resubmitted. The error that led here is reported by 'wait_all'.
+
+                */
+
+                auto queued = *_sq_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+                _in_flight -= queued;
+                _to_submit = 0;
+
+                while (_in_flight > 0)
+                {
+                    if (_complete(false) == 0 && _enter(0, 1) < 0)
+                    {
+                        // completions are still posted while io_uring_enter fails; poll for them
+                        timespec pause{ 0, 1000000 };
+                        ::nanosleep(&pause, nullptr);
+                    }
+                }
+
+                _teardown();
+                _backend = backend::backend_sync;
+            }
+
+            unsigned _complete(bool resubmit) noexcept
+            {
+                /*
+
+                _complete
+                Handles every completion posted so far, returning how many there were
+
+                Short transfers, and those the kernel asks to retry, are resubmitted for the
+                remainder if 'resubmit' is set and are errors otherwise. A transfer of 0 bytes is
+                an error: a read has hit the end of the file, and a write would never make progress.
+
+                */
+
+                unsigned completed = 0;
+                auto head = *_cq_head;
+                auto tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+                while (head != tail)
+                {
+                    auto& cqe = _cqes[head & *_cq_mask];
+                    auto slot = static_cast<unsigned>(cqe.user_data);
+                    auto result = cqe.res;
+                    head++;
+                    completed++;
+                    _in_flight--;
+
+                    auto& r = _requests[slot];
+                    bool retry = result == -EINTR || result == -EAGAIN;
+                    bool error = (result <= 0 && !retry) || (!resubmit && (retry || static_cast<size_t>(result) < r.remaining));
+
+                    if (error)
+                    {
+                        _error = result < 0 && !retry ? -result : EIO;
+                        _free_slots.push_back(slot);
+                    }
+                    else if (retry)
+                    {
+                        _push(slot);
+                    }
+                    else if (static_cast<size_t>(result) < r.remaining)
+                    {
+                        r.buffer += result;
+                        r.remaining -= static_cast<size_t>(result);
+                        r.offset += result;
+
+                        // the fixed opcodes only need the address to stay inside the registered buffer
+                        _push(slot);
+                    }
+                    else
+                    {
+                        _free_slots.push_back(slot);
+                    }
+                }
+
+                __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+                return completed;
+            }
+
+            void _push(unsigned slot)
+            {
+                /*
+
+                _push
+                Fills a submission queue entry for the request in 'slot'
+
+                */
+
+                auto& r = _requests[slot];
+                auto tail = *_sq_tail;
+                auto index = tail & *_sq_mask;
+                auto& sqe = _sqes[index];
+                std::memset(&sqe, 0, sizeof(sqe));
+
+                sqe.fd = r.fd;
+                sqe.off = static_cast<uint64_t>(r.offset);
+                sqe.user_data = slot;
+
+                if (r.buffer_index >= 0)
+                {
+                    sqe.opcode = r.write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+                    sqe.addr = reinterpret_cast<uint64_t>(r.buffer);
+                    sqe.len = static_cast<uint32_t>(r.remaining);
+                    sqe.buf_index = static_cast<uint16_t>(r.buffer_index);
+                }
+                else
+                {
+                    r.iov.iov_base = r.buffer;
+                    r.iov.iov_len = r.remaining;
+                    sqe.opcode = r.write ? IORING_OP_WRITEV : IORING_OP_READV;
+                    sqe.addr = reinterpret_cast<uint64_t>(&r.iov);
+                    sqe.len = 1;
+                }
+
+                _sq_array[index] = index;
+                __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+                _to_submit++;
+                _in_flight++;
+            }
+
+            void _reap(unsigned min_complete)
+            {
+                /*
+
+                _reap
+                Submits what is queued, waits for at least 'min_complete' completions, and handles them
+
+                Errors are remembered and reported by 'wait_all' (see '_complete'). Nothing is thrown
+                from here, so a caller draining the ring always gets to the end: if io_uring_enter
+                fails for any reason but a temporary shortage, the ring is abandoned (see '_abandon').
+
+                */
+
+                auto submitted = _enter(_to_submit, min_complete);
+                if (submitted < 0)
+                {
+                    if (submitted != -EAGAIN && submitted != -EBUSY)
+                    {
+                        _error = -submitted;
+                        _abandon();
+                        return;
+                    }
+
+                    submitted = 0;
+                }
+
+                _to_submit -= static_cast<unsigned>(submitted);
+                _complete(true);
+            }
+#endif
+
+            int _find_buffer(const void* buffer, size_t length) const
+            {
+                // returns the registered buffer containing [buffer, buffer + length), or -1
+                auto p = static_cast<const char*>(buffer);
+                for (size_t i = 0; i < _registered.size(); i++)
+                {
+                    auto base = static_cast<const char*>(_registered[i].iov_base);
+                    if (p >= base && p + length <= base + _registered[i].iov_len)
+                    {
+                        return static_cast<int>(i);
+                    }
+                }
+
+                return -1;
+            }
+
+            void _submit(int fd, bool write, void* buffer, size_t length, off_t offset)
+            {
+                if (length == 0)
+                {
+                    return;
+                }
+
+#ifdef SEGMENTED_LIST_IO_URING
+                // make room in the ring by completing earlier operations
+                while (_backend == backend::backend_uring && _free_slots.empty())
+                {
+                    _reap(1);
+                }
+
+                if (_backend == backend::backend_uring)
+                {
+                    auto slot = _free_slots.back();
+                    _free_slots.pop_back();
+                    _requests[slot] = request{ fd, write, _find_buffer(buffer, length), static_cast<char*>(buffer), length, offset, iovec{} };
+                    _push(slot);
+                    return;
+                }
+#endif
+
+                iovec iov{ buffer, length };
+                if (write)
+                {
+                    pwritev_fully(fd, &iov, 1, offset);
+                }
+                else
+                {
+                    preadv_fully(fd, &iov, 1, offset);
+                }
+            }
+        public:
+            backend get_backend() const noexcept
+            {
+                return _backend;
+            }
+
+            bool register_buffers(const iovec* buffers, size_t count)
+            {
+                /*
+
+                register_buffers
+                Registers memory that later reads and writes will come from, replacing any earlier registration
+
+                Operations whose buffer lies inside a registered region use the fixed-buffer
+                opcodes. Returns false if the registration was refused (for example, because of
+                RLIMIT_MEMLOCK); operations then simply use ordinary buffers.
+
+                */
+
+                wait_all();
+                _registered.clear();
+
+#ifdef SEGMENTED_LIST_IO_URING
+                if (_backend == backend::backend_uring)
+                {
+                    ::syscall(__NR_io_uring_register, _ring_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+                    if (count == 0)
+                    {
+                        return true;
+                    }
+
+                    if (::syscall(__NR_io_uring_register, _ring_fd, IORING_REGISTER_BUFFERS, buffers, static_cast<unsigned>(count)) != 0)
+                    {
+                        return false;
+                    }
+
+                    _registered.assign(buffers, buffers + count);
+                    return true;
+                }
+#endif
+
+                (void)buffers;
+                return count == 0;
+            }
+
+            void read(int fd, void* buffer, size_t length, off_t offset)
+            {
+                // queues a read of 'length' bytes at 'offset' into 'buffer'
+                _submit(fd, false, buffer, length, offset);
+            }
+
+            void write(int fd, const void* buffer, size_t length, off_t offset)
+            {
+                // queues a write of 'length' bytes from 'buffer' at 'offset'
+                _submit(fd, true, const_cast<void*>(buffer), length, offset);
+            }
+
+            void wait_all()
+            {
+                /*
+
+                wait_all
+                Blocks until every queued operation has completed
+
+                Throws std::system_error if any of them failed, but only once none is left in
+                flight, so the caller may free the buffers whether or not it throws.
+
+                */
+
+#ifdef SEGMENTED_LIST_IO_URING
+                while (_backend == backend::backend_uring && _in_flight > 0)
+                {
+                    _reap(1);
+                }
+
+                // also reports the error that made the ring be abandoned
+                if (_error)
+                {
+                    auto error = _error;
+                    _error = 0;
+                    SEGMENTED_LIST_THROW(std::system_error(error, std::generic_category(), "block_io"));
+                }
+#endif
+            }
+
+            // constructors
+
+            explicit block_io(backend preferred = backend::backend_uring, unsigned queue_depth = 256)
+                : _backend(backend::backend_sync)
+#ifdef SEGMENTED_LIST_IO_URING
+                , _ring_fd(-1)
+                , _entries(0)
+                , _sq_ring(nullptr)
+                , _sq_ring_size(0)
+                , _cq_ring(nullptr)
+                , _cq_ring_size(0)
+                , _sqes(nullptr)
+                , _sqes_size(0)
+                , _to_submit(0)
+                , _in_flight(0)
+                , _error(0)
+#endif
+            {
+                // falls back to the sync backend if the ring cannot be created
+#ifdef SEGMENTED_LIST_IO_URING
+                if (preferred == backend::backend_uring && _setup(queue_depth))
+                {
+                    _backend = backend::backend_uring;
+                }
+#else
+                (void)preferred;
+                (void)queue_depth;
+#endif
+            }
+
+            block_io(const block_io&) = delete;
+            block_io& operator=(const block_io&) = delete;
+
+            ~block_io()
+            {
+#ifdef SEGMENTED_LIST_IO_URING
+                if (_backend == backend::backend_uring)
+                {
+                    // the kernel may still be using our buffers; let everything finish first
+                    while (_in_flight > 0)
+                    {
+                        _reap(1);
+                    }
+                }
+
+                _teardown();
+#endif
+            }
+        };
+
+        template <typename T>
+        void write_image_blocks(int fd, const image_layout<T>& layout, const T* const* blocks, size_t count, block_io& io)
+        {
+            /*
+
+            write_image_blocks
+            Like the pwritev version, but queues one write per block on 'io' and waits for them all
+
+            No padding is written; slots past a block's live elements are left as they were.
+
+            */
+
+            for (size_t i = 0; i < count; i++)
+            {
+                if (blocks[i])
+                {
+                    const auto& entry = layout.directory[i];
+                    io.write(fd, blocks[i], entry.size * sizeof(T), static_cast<off_t>(entry.offset));
+                }
+            }
+
+            io.wait_all();
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,46 @@
+#pragma once
+
+/*
+
+list_config.hpp
+Copyright 2020 Riley Lannon
+
+Build configuration shared by the segmented_list headers
+
+The headers work with or without exceptions. When built with -fno-exceptions, anything that
+would have thrown calls std::abort instead.
+
+Define SEGMENTED_LIST_ASSERT_BOUNDS to turn the bounds checks in operator[], front, back, pop_back,
+erase and the iterators into assertions: they are checked in debug builds and compiled out when
+NDEBUG is set. 'at' still checks, as the standard containers do, and so do errors that do not come
+from a bad position or an empty list (I/O, memory budgets).
+
+SEGMENTED_LIST_PREFETCH hints that an address will soon be read (or written, if 'write' is 1). It
+does nothing on compilers without __builtin_prefetch.
+
+*/
+
+#include <cassert>
+#include <cstdlib>
+#include <stdexcept>
+
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+#define SEGMENTED_LIST_EXCEPTIONS 1
+#define SEGMENTED_LIST_THROW(exception) throw exception
+#else
+// the exception is named in an unevaluated operand, so what it refers to still counts as used
+#define SEGMENTED_LIST_THROW(exception) ((void)sizeof((exception)), std::abort())
+#endif
+
+#ifdef SEGMENTED_LIST_ASSERT_BOUNDS
+#define SEGMENTED_LIST_CHECK_BOUNDS(condition, what) assert((condition) && what)
+#else
+#define SEGMENTED_LIST_CHECK_BOUNDS(condition, what) \
+    do { if (!(condition)) { SEGMENTED_LIST_THROW(std::out_of_range(what)); } } while (0)
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SEGMENTED_LIST_PREFETCH(address, write) __builtin_prefetch((address), (write))
+#else
+#define SEGMENTED_LIST_PREFETCH(address, write) ((void)(address))
+#endif
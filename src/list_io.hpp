@@ -0,0 +1,491 @@
+#pragma once
+
+/*
+
+list_io.hpp
+Copyright 2020 Riley Lannon
+
+On-disk formats and low-level POSIX I/O helpers used by segmented_list serialization
+
+*/
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <system_error>
+#include <stdexcept>
+#include <vector>
+
+#include "list_config.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SEGMENTED_LIST_POSIX_IO 1
+#include <climits>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace segmented_list
+{
+    namespace io
+    {
+        /*
+
+        io
+        A namespace for the serialized formats and the routines that read and write them
+
+        */
+
+        // identifies the byte order of the machine that wrote a file
+        const uint32_t byte_order_mark = 0x01020304;
+
+        struct stream_header
+        {
+            /*
+
+            stream_header
+            Precedes the elements written by segmented_list::write_to
+
+            The elements follow the header back to back, in list order, with no padding between
+            blocks. The stream does not depend on the writer's block size, so it may be read into a
+            list with a different one.
+
+            */
+
+            static const uint32_t current_version = 1;
+
+            char magic[8];
+            uint32_t version;
+            uint32_t byte_order;
+            uint64_t element_size;
+            uint64_t element_count;
+
+            stream_header()
+                : magic{ 'S', 'E', 'G', 'L', 'I', 'S', 'T', 0 }
+                , version(current_version)
+                , byte_order(byte_order_mark)
+                , element_size(0)
+                , element_count(0) { }
+
+            bool valid(size_t expected_element_size) const
+            {
+                stream_header reference;
+                return std::memcmp(magic, reference.magic, sizeof(magic)) == 0
+                    && version == current_version
+                    && byte_order == byte_order_mark
+                    && element_size == expected_element_size;
+            }
+        };
+
+        struct image_header
+        {
+            /*
+
+            image_header
+            The first bytes of a list image, a layout meant to be memory-mapped and used in place
+
+            An image is laid out as:
+                * the image_header
+                * the block directory, 'block_count' image_block_entry records
+                * padding up to 'data_offset', which is a multiple of the page size
+                * the block payloads, at the offsets recorded in the directory
+
+            Payloads are page-aligned when a block spans at least a page. Smaller blocks are packed
+            at cache-line boundaries instead, so that an image of a list with small blocks is not
+            mostly padding. Every payload slot is sized for a full block, so a block can be
+            rewritten in place as it fills up.
+
+            'checkpoint_id' identifies the list that wrote the image through
+            segmented_list::checkpoint_incremental, so that a later checkpoint can tell whether the
+            slots in the file still belong to it; it is 0 for images made by write_image. A
+            checkpointed image reserves room for two directories before 'data_offset', and
+            'directory_offset' names the live one; the next checkpoint writes the other.
+
+            'checksum' is an FNV-1a hash of the header (with 'checksum' zeroed) and the directory.
+            The payloads are not covered; validating them would mean reading the whole file.
+
+            */
+
+            static const uint32_t current_version = 1;
+
+            // set when every block but the last is full, allowing positions to be found by division
+            static const uint64_t flag_dense = 1;
+
+            char magic[8];
+            uint32_t version;
+            uint32_t byte_order;
+            uint64_t element_size;
+            uint64_t block_size;
+            uint64_t element_count;
+            uint64_t block_count;
+            uint64_t page_size;
+            uint64_t directory_offset;
+            uint64_t data_offset;
+            uint64_t slot_size;
+            uint64_t file_size;
+            uint64_t flags;
+            uint64_t checkpoint_id;
+            uint64_t checksum;
+
+            image_header()
+                : magic{ 'S', 'E', 'G', 'L', 'I', 'M', 'G', 0 }
+                , version(current_version)
+                , byte_order(byte_order_mark)
+                , element_size(0)
+                , block_size(0)
+                , element_count(0)
+                , block_count(0)
+                , page_size(0)
+                , directory_offset(0)
+                , data_offset(0)
+                , slot_size(0)
+                , file_size(0)
+                , flags(0)
+                , checkpoint_id(0)
+                , checksum(0) { }
+        };
+
+        struct image_block_entry
+        {
+            uint64_t offset;    // file offset of the block's payload
+            uint64_t first;     // list position of the block's first element
+            uint64_t size;      // number of live elements in the block
+        };
+
+        inline uint64_t fnv1a(const void* data, size_t length, uint64_t hash = 14695981039346656037ull)
+        {
+            /*
+
+            fnv1a
+            Extends the 64-bit FNV-1a hash 'hash' with 'length' bytes at 'data'
+
+            */
+
+            auto bytes = static_cast<const unsigned char*>(data);
+            for (size_t i = 0; i < length; i++)
+            {
+                hash ^= bytes[i];
+                hash *= 1099511628211ull;
+            }
+
+            return hash;
+        }
+
+        inline uint64_t image_checksum(const image_header& header, const image_block_entry* directory)
+        {
+            image_header copy = header;
+            copy.checksum = 0;
+
+            auto hash = fnv1a(&copy, sizeof(copy));
+            return fnv1a(directory, header.block_count * sizeof(image_block_entry), hash);
+        }
+
+        inline uint64_t round_up(uint64_t value, uint64_t alignment)
+        {
+            return (value + alignment - 1) / alignment * alignment;
+        }
+
+        inline uint64_t image_slot_alignment(uint64_t block_bytes, uint64_t page_size)
+        {
+            // blocks of at least a page get page-aligned slots; smaller ones are packed by cache line
+            return block_bytes >= page_size ? page_size : 64;
+        }
+
+        template <typename T>
+        struct image_layout
+        {
+            /*
+
+            image_layout
+            The header and directory describing where each block of a list goes in an image
+
+            */
+
+            image_header header;
+            std::vector<image_block_entry> directory;
+        };
+
+#ifdef SEGMENTED_LIST_POSIX_IO
+
+#ifdef IOV_MAX
+        const int max_iovecs = IOV_MAX;
+#else
+        const int max_iovecs = 1024;
+#endif
+
+        inline void writev_fully(int fd, iovec* iov, int count)
+        {
+            /*
+
+            writev_fully
+            Writes every buffer described by 'iov', resubmitting after short writes and interruptions
+
+            The iovec array is modified as data is consumed. Throws std::system_error on failure.
+
+            */
+
+            while (count > 0)
+            {
+                auto written = ::writev(fd, iov, count);
+                if (written < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+
+                    SEGMENTED_LIST_THROW(std::system_error(errno, std::generic_category(), "segmented_list writev"));
+                }
+
+                // skip over the buffers that were written completely, then trim the partial one
+                auto remaining = static_cast<size_t>(written);
+                while (count > 0 && remaining >= iov->iov_len)
+                {
+                    remaining -= iov->iov_len;
+                    iov++;
+                    count--;
+                }
+
+                if (count > 0)
+                {
+                    iov->iov_base = static_cast<char*>(iov->iov_base) + remaining;
+                    iov->iov_len -= remaining;
+                }
+            }
+        }
+
+        inline void readv_fully(int fd, iovec* iov, int count)
+        {
+            /*
+
+            readv_fully
+            Fills every buffer described by 'iov', resubmitting after short reads and interruptions
+
+            The iovec array is modified as data is consumed. Throws std::system_error on failure, or
+            std::runtime_error if the file ends before the buffers are full.
+
+            */
+
+            while (count > 0)
+            {
+                auto got = ::readv(fd, iov, count);
+                if (got < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+
+                    SEGMENTED_LIST_THROW(std::system_error(errno, std::generic_category(), "segmented_list readv"));
+                }
+                else if (got == 0)
+                {
+                    SEGMENTED_LIST_THROW(std::runtime_error("segmented_list readv: unexpected end of file"));
+                }
+
+                auto remaining = static_cast<size_t>(got);
+                while (count > 0 && remaining >= iov->iov_len)
+                {
+                    remaining -= iov->iov_len;
+                    iov++;
+                    count--;
+                }
+
+                if (count > 0)
+                {
+                    iov->iov_base = static_cast<char*>(iov->iov_base) + remaining;
+                    iov->iov_len -= remaining;
+                }
+            }
+        }
+
+        inline void pwritev_fully(int fd, iovec* iov, int count, off_t offset)
+        {
+            /*
+
+            pwritev_fully
+            Like writev_fully, but writes at 'offset' without using or moving the file position
+
+            */
+
+            while (count > 0)
+            {
+                auto written = ::pwritev(fd, iov, count, offset);
+                if (written < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+
+                    SEGMENTED_LIST_THROW(std::system_error(errno, std::generic_category(), "segmented_list pwritev"));
+                }
+
+                offset += written;
+                auto remaining = static_cast<size_t>(written);
+                while (count > 0 && remaining >= iov->iov_len)
+                {
+                    remaining -= iov->iov_len;
+                    iov++;
+                    count--;
+                }
+
+                if (count > 0)
+                {
+                    iov->iov_base = static_cast<char*>(iov->iov_base) + remaining;
+                    iov->iov_len -= remaining;
+                }
+            }
+        }
+
+        inline void preadv_fully(int fd, iovec* iov, int count, off_t offset)
+        {
+            /*
+
+            preadv_fully
+            Like readv_fully, but reads from 'offset' without using or moving the file position
+
+            */
+
+            while (count > 0)
+            {
+                auto got = ::preadv(fd, iov, count, offset);
+                if (got < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+
+                    SEGMENTED_LIST_THROW(std::system_error(errno, std::generic_category(), "segmented_list preadv"));
+                }
+                else if (got == 0)
+                {
+                    SEGMENTED_LIST_THROW(std::runtime_error("segmented_list preadv: unexpected end of file"));
+                }
+
+                offset += got;
+                auto remaining = static_cast<size_t>(got);
+                while (count > 0 && remaining >= iov->iov_len)
+                {
+                    remaining -= iov->iov_len;
+                    iov++;
+                    count--;
+                }
+
+                if (count > 0)
+                {
+                    iov->iov_base = static_cast<char*>(iov->iov_base) + remaining;
+                    iov->iov_len -= remaining;
+                }
+            }
+        }
+
+        inline uint64_t page_size()
+        {
+            return static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+        }
+
+        template <typename T>
+        void write_image_metadata(int fd, const image_layout<T>& layout)
+        {
+            /*
+
+            write_image_metadata
+            Writes the header and directory of 'layout' to the start of 'fd'
+
+            */
+
+            iovec iov[2];
+            iov[0].iov_base = const_cast<image_header*>(&layout.header);
+            iov[0].iov_len = sizeof(image_header);
+            iov[1].iov_base = const_cast<image_block_entry*>(layout.directory.data());
+            iov[1].iov_len = layout.directory.size() * sizeof(image_block_entry);
+
+            pwritev_fully(fd, iov, 2, 0);
+        }
+
+        template <typename T>
+        void write_image_directory(int fd, const image_layout<T>& layout)
+        {
+            // writes the directory of 'layout' at its 'directory_offset', leaving the header alone
+            iovec iov{ const_cast<image_block_entry*>(layout.directory.data()), layout.directory.size() * sizeof(image_block_entry) };
+            pwritev_fully(fd, &iov, 1, static_cast<off_t>(layout.header.directory_offset));
+        }
+
+        inline void write_image_header(int fd, const image_header& header)
+        {
+            // writes 'header' over the first bytes of 'fd'; it is small enough to land in one sector
+            iovec iov{ const_cast<image_header*>(&header), sizeof(image_header) };
+            pwritev_fully(fd, &iov, 1, 0);
+        }
+
+        template <typename T>
+        void write_image_blocks(int fd, const image_layout<T>& layout, const T* const* blocks, size_t count)
+        {
+            /*
+
+            write_image_blocks
+            Writes the payloads of 'count' blocks, where 'blocks[i]' is the data of directory entry i
+            (or nullptr to skip that block)
+
+            Runs of adjacent slots go out in a single pwritev. The gap after each block's live
+            elements is filled from a zero buffer so that a run is not broken by padding.
+
+            */
+
+            std::vector<char> zeros(layout.header.slot_size);
+
+            iovec iov[max_iovecs];
+            int used = 0;
+            off_t run_offset = 0;
+            uint64_t run_end = 0;
+
+            for (size_t i = 0; i < count; i++)
+            {
+                if (!blocks[i])
+                {
+                    continue;
+                }
+
+                const auto& entry = layout.directory[i];
+                auto bytes = entry.size * sizeof(T);
+
+                // start a new run if this slot does not follow the last one, or the batch is full
+                if (used > 0 && (entry.offset != run_end || used + 2 > max_iovecs))
+                {
+                    pwritev_fully(fd, iov, used, run_offset);
+                    used = 0;
+                }
+
+                if (used == 0)
+                {
+                    run_offset = static_cast<off_t>(entry.offset);
+                }
+
+                iov[used].iov_base = const_cast<T*>(blocks[i]);
+                iov[used].iov_len = bytes;
+                used++;
+
+                if (bytes < layout.header.slot_size)
+                {
+                    iov[used].iov_base = zeros.data();
+                    iov[used].iov_len = layout.header.slot_size - bytes;
+                    used++;
+                }
+
+                run_end = entry.offset + layout.header.slot_size;
+            }
+
+            if (used > 0)
+            {
+                pwritev_fully(fd, iov, used, run_offset);
+            }
+        }
+
+#endif
+    }
+}
@@ -0,0 +1,578 @@
+#pragma once
+
+/*
+
+mapped_list.hpp
+Copyright 2020 Riley Lannon
+
+Writing list images, and a read-only view that serves a list straight out of a memory-mapped image
+
+*/
+
+#include "segmented_list.hpp"
+#include "block_io.hpp"
+
+#ifdef SEGMENTED_LIST_POSIX_IO
+
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace segmented_list
+{
+    namespace io
+    {
+        template <typename T, typename Allocator, typename Instrumentation>
+        image_layout<T> plan_image(const segmented_list<T, Allocator, Instrumentation>& list, uint64_t page)
+        {
+            /*
+
+            plan_image
+            Computes the image header and block directory for 'list' without writing anything
+
+            */
+
+            image_layout<T> layout;
+            auto& header = layout.header;
+
+            header.element_size = sizeof(T);
+            header.block_size = list_block<T>::block_size();
+            header.element_count = list.size();
+            header.page_size = page;
+            header.directory_offset = sizeof(image_header);
+
+            auto block_bytes = header.block_size * sizeof(T);
+            header.slot_size = round_up(block_bytes, image_slot_alignment(block_bytes, page));
+
+            uint64_t first = 0;
+            bool dense = true;
+            for (auto seg : list.segments())
+            {
+                // a block that is not full anywhere but at the end rules out positional lookup by division
+                if (!layout.directory.empty() && layout.directory.back().size != header.block_size)
+                {
+                    dense = false;
+                }
+
+                layout.directory.push_back(image_block_entry{ 0, first, seg.size });
+                first += seg.size;
+            }
+
+            header.block_count = layout.directory.size();
+            header.data_offset = round_up(header.directory_offset + header.block_count * sizeof(image_block_entry), page);
+            for (size_t i = 0; i < layout.directory.size(); i++)
+            {
+                layout.directory[i].offset = header.data_offset + i * header.slot_size;
+            }
+
+            header.file_size = header.data_offset + header.block_count * header.slot_size;
+            header.flags = dense ? image_header::flag_dense : 0;
+            header.checksum = image_checksum(header, layout.directory.data());
+
+            return layout;
+        }
+
+        template <typename T, typename Allocator, typename Instrumentation>
+        void write_image(const segmented_list<T, Allocator, Instrumentation>& list, int fd, block_io* io = nullptr)
+        {
+            /*
+
+            write_image
+            Writes 'list' to 'fd' as an image that mapped_list can load without parsing or copying
+
+            The file is truncated (or extended) to exactly the size of the image. Only available for
+            trivially copyable T. Throws std::system_error if a write fails.
+
+            If 'io' is given, the blocks are queued on it instead of being written with pwritev.
+
+            */
+
+            static_assert(std::is_trivially_copyable<T>::value, "write_image requires a trivially copyable T");
+
+            auto layout = plan_image(list, page_size());
+
+            if (::ftruncate(fd, static_cast<off_t>(layout.header.file_size)) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "segmented_list write_image");
+            }
+
+            std::vector<const T*> blocks;
+            blocks.reserve(layout.directory.size());
+            for (auto seg : list.segments())
+            {
+                blocks.push_back(seg.data);
+            }
+
+            if (io)
+            {
+                write_image_blocks(fd, layout, blocks.data(), blocks.size(), *io);
+            }
+            else
+            {
+                write_image_blocks(fd, layout, blocks.data(), blocks.size());
+            }
+
+            write_image_metadata(fd, layout);
+        }
+    }
+
+
+    template <typename T>
+    class mapped_list
+    {
+        /*
+
+        mapped_list
+        A read-only list served directly from a memory-mapped image written by io::write_image
+
+        Opening an image maps the file and checks its header and checksum; nothing else is read or
+        copied. Elements are paged in by the kernel as they are touched, so opening a multi-gigabyte
+        image costs the same as opening a small one.
+
+        Template parameters:
+            * T -   The contained type; must match the type the image was written with
+
+        */
+
+        static_assert(std::is_trivially_copyable<T>::value, "mapped_list requires a trivially copyable T");
+
+        const char* _mapping;
+        size_t _mapping_size;
+
+        const io::image_header* _header;
+        const io::image_block_entry* _directory;
+
+        void _unmap()
+        {
+            if (_mapping)
+            {
+                ::munmap(const_cast<char*>(_mapping), _mapping_size);
+            }
+
+            _mapping = nullptr;
+            _mapping_size = 0;
+            _header = nullptr;
+            _directory = nullptr;
+        }
+
+        void _map(int fd)
+        {
+            /*
+
+            _map
+            Maps the image open on 'fd' and validates its header, directory and checksum
+
+            Every directory entry is checked against the mapping here, once, so lookups can trust
+            the directory afterwards. The checks are written so that no field, however large, can
+            overflow them.
+
+            */
+
+            struct stat st;
+            if (::fstat(fd, &st) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "mapped_list");
+            }
+
+            auto size = static_cast<size_t>(st.st_size);
+            if (size < sizeof(io::image_header))
+            {
+                throw std::runtime_error("mapped_list: file is too small to be an image");
+            }
+
+            auto mapping = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (mapping == MAP_FAILED)
+            {
+                throw std::system_error(errno, std::generic_category(), "mapped_list mmap");
+            }
+
+            _mapping = static_cast<const char*>(mapping);
+            _mapping_size = size;
+            _header = reinterpret_cast<const io::image_header*>(_mapping);
+
+            io::image_header reference;
+            auto& header = *_header;
+            bool valid = std::memcmp(header.magic, reference.magic, sizeof(reference.magic)) == 0
+                && header.version == io::image_header::current_version
+                && header.byte_order == io::byte_order_mark
+                && header.element_size == sizeof(T)
+                && header.block_size > 0
+                && header.file_size <= size
+                && header.data_offset <= size
+                && header.directory_offset >= sizeof(io::image_header)
+                && header.directory_offset <= size
+                && header.directory_offset % alignof(io::image_block_entry) == 0
+                && header.block_count <= (size - header.directory_offset) / sizeof(io::image_block_entry);
+
+            if (!valid)
+            {
+                _unmap();
+                throw std::runtime_error("mapped_list: incompatible image");
+            }
+
+            _directory = reinterpret_cast<const io::image_block_entry*>(_mapping + header.directory_offset);
+            if (io::image_checksum(header, _directory) != header.checksum)
+            {
+                _unmap();
+                throw std::runtime_error("mapped_list: checksum mismatch");
+            }
+
+            // each block must lie inside the mapping, and the blocks must cover the positions in order
+            uint64_t first = 0;
+            for (size_t i = 0; i < header.block_count && valid; i++)
+            {
+                auto& entry = _directory[i];
+                valid = entry.offset >= header.data_offset
+                    && entry.offset <= size
+                    && entry.offset % alignof(T) == 0
+                    && entry.size <= header.block_size
+                    && entry.size <= (size - entry.offset) / sizeof(T)
+                    && entry.first == first
+                    && (!(header.flags & io::image_header::flag_dense) || i + 1 == header.block_count || entry.size == header.block_size);
+                first += entry.size;
+            }
+
+            if (!valid || first != header.element_count)
+            {
+                _unmap();
+                throw std::runtime_error("mapped_list: corrupt block directory");
+            }
+        }
+
+        const T* _block_data(size_t block) const
+        {
+            return reinterpret_cast<const T*>(_mapping + _directory[block].offset);
+        }
+
+        size_t _find_block(size_t pos) const
+        {
+            /*
+
+            _find_block
+            Returns the directory index of the block containing position 'pos'
+
+            Dense images are indexed by division; otherwise the directory is binary searched on 'first'.
+
+            */
+
+            if (_header->flags & io::image_header::flag_dense)
+            {
+                return pos / _header->block_size;
+            }
+
+            auto last = _directory + _header->block_count;
+            auto it = std::upper_bound(_directory, last, pos, [](size_t p, const io::image_block_entry& e) {
+                return p < e.first;
+            });
+            return static_cast<size_t>(it - _directory) - 1;
+        }
+    public:
+        using value_type = T;
+        using reference = const T & ;
+        using const_reference = const T & ;
+        using pointer = const T * ;
+        using const_pointer = const T * ;
+        using size_type = size_t;
+
+        class const_iterator
+        {
+            /*
+
+            const_iterator
+            Walks the image block by block through the directory
+
+            */
+
+            const mapped_list* _list;
+            size_t _block;
+            size_t _elem_index;
+
+            friend class mapped_list;
+
+            const_iterator(const mapped_list* list, size_t block, size_t idx)
+                : _list(list)
+                , _block(block)
+                , _elem_index(idx) { }
+        public:
+            using value_type = T;
+            using pointer = const T * ;
+            using reference = const T & ;
+            using iterator_category = std::bidirectional_iterator_tag;
+            using difference_type = std::ptrdiff_t;
+
+            const_iterator()
+                : _list(nullptr)
+                , _block(0)
+                , _elem_index(0) { }
+
+            reference operator*() const
+            {
+                return _list->_block_data(_block)[_elem_index];
+            }
+
+            pointer operator->() const
+            {
+                return &_list->_block_data(_block)[_elem_index];
+            }
+
+            const_iterator& operator++()
+            {
+                _elem_index++;
+                if (_elem_index == _list->_directory[_block].size)
+                {
+                    _block++;
+                    _elem_index = 0;
+                }
+
+                return *this;
+            }
+
+            const_iterator operator++(int)
+            {
+                const_iterator it{ *this };
+                ++(*this);
+                return it;
+            }
+
+            const_iterator& operator--()
+            {
+                if (_elem_index == 0)
+                {
+                    _block--;
+                    _elem_index = _list->_directory[_block].size - 1;
+                }
+                else
+                {
+                    _elem_index--;
+                }
+
+                return *this;
+            }
+
+            const_iterator operator--(int)
+            {
+                const_iterator it{ *this };
+                --(*this);
+                return it;
+            }
+
+            bool operator==(const const_iterator& right) const
+            {
+                return _block == right._block && _elem_index == right._elem_index;
+            }
+
+            bool operator!=(const const_iterator& right) const
+            {
+                return _block != right._block || _elem_index != right._elem_index;
+            }
+        };
+
+        using iterator = const_iterator;
+
+        class segment_iterator
+        {
+            /*
+
+            segment_iterator
+            Yields each block of the image as a segment pointing into the mapping
+
+            */
+
+            const mapped_list* _list;
+            size_t _block;
+        public:
+            using value_type = segment<const T>;
+            using iterator_category = std::forward_iterator_tag;
+            using difference_type = std::ptrdiff_t;
+
+            segment_iterator(const mapped_list* list, size_t block)
+                : _list(list)
+                , _block(block) { }
+
+            value_type operator*() const
+            {
+                return value_type{ _list->_block_data(_block), _list->_directory[_block].size };
+            }
+
+            segment_iterator& operator++()
+            {
+                _block++;
+                return *this;
+            }
+
+            bool operator==(const segment_iterator& right) const
+            {
+                return _block == right._block;
+            }
+
+            bool operator!=(const segment_iterator& right) const
+            {
+                return _block != right._block;
+            }
+        };
+
+        struct segment_range
+        {
+            segment_iterator first;
+            segment_iterator last;
+
+            segment_iterator begin() const
+            {
+                return first;
+            }
+
+            segment_iterator end() const
+            {
+                return last;
+            }
+        };
+
+        size_t size() const noexcept
+        {
+            return _header ? _header->element_count : 0;
+        }
+
+        bool empty() const noexcept
+        {
+            return size() == 0;
+        }
+
+        size_t block_count() const noexcept
+        {
+            return _header ? _header->block_count : 0;
+        }
+
+        [[nodiscard]]
+        const_reference at(size_type pos) const
+        {
+            if (pos < size())
+            {
+                auto block = _find_block(pos);
+                return _block_data(block)[pos - _directory[block].first];
+            }
+            else
+            {
+                throw std::out_of_range("mapped_list");
+            }
+        }
+
+        [[nodiscard]]
+        const_reference operator[](size_type pos) const
+        {
+            // an alias for 'at'
+            return at(pos);
+        }
+
+        const_reference front() const
+        {
+            return at(0);
+        }
+
+        const_reference back() const
+        {
+            return at(size() - 1);
+        }
+
+        const_iterator begin() const
+        {
+            return const_iterator(this, 0, 0);
+        }
+
+        const_iterator end() const
+        {
+            // blocks are never empty in an image, so the end is the start of the block past the last
+            return const_iterator(this, block_count(), 0);
+        }
+
+        const_iterator cbegin() const
+        {
+            return begin();
+        }
+
+        const_iterator cend() const
+        {
+            return end();
+        }
+
+        segment_range segments() const
+        {
+            return segment_range{ segment_iterator(this, 0), segment_iterator(this, block_count()) };
+        }
+
+        // constructors
+
+        explicit mapped_list(int fd)
+            : _mapping(nullptr)
+            , _mapping_size(0)
+            , _header(nullptr)
+            , _directory(nullptr)
+        {
+            // maps the image open on 'fd'; the descriptor may be closed afterwards
+            _map(fd);
+        }
+
+        explicit mapped_list(const char* path)
+            : _mapping(nullptr)
+            , _mapping_size(0)
+            , _header(nullptr)
+            , _directory(nullptr)
+        {
+            int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "mapped_list open");
+            }
+
+            try
+            {
+                _map(fd);
+            }
+            catch (...)
+            {
+                ::close(fd);
+                throw;
+            }
+
+            // the mapping stays valid after the descriptor is closed
+            ::close(fd);
+        }
+
+        mapped_list(const mapped_list&) = delete;
+        mapped_list& operator=(const mapped_list&) = delete;
+
+        mapped_list(mapped_list&& other) noexcept
+            : _mapping(other._mapping)
+            , _mapping_size(other._mapping_size)
+            , _header(other._header)
+            , _directory(other._directory)
+        {
+            other._mapping = nullptr;
+            other._mapping_size = 0;
+            other._header = nullptr;
+            other._directory = nullptr;
+        }
+
+        mapped_list& operator=(mapped_list&& other) noexcept
+        {
+            if (this != &other)
+            {
+                _unmap();
+                std::swap(_mapping, other._mapping);
+                std::swap(_mapping_size, other._mapping_size);
+                std::swap(_header, other._header);
+                std::swap(_directory, other._directory);
+            }
+
+            return *this;
+        }
+
+        ~mapped_list()
+        {
+            _unmap();
+        }
+    };
+}
+
+#endif
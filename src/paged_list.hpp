@@ -0,0 +1,690 @@
+#pragma once
+
+/*
+
+paged_list.hpp
+Copyright 2020 Riley Lannon
+
+A segmented list that keeps a bounded number of blocks in memory and spills the rest to disk
+
+*/
+
+#include "segmented_list.hpp"
+#include "block_codec.hpp"
+#include "block_io.hpp"
+
+#ifdef SEGMENTED_LIST_POSIX_IO
+
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <fcntl.h>
+
+namespace segmented_list
+{
+    struct paging_stats
+    {
+        /*
+
+        paging_stats
+        Counters describing how a paged_list's residency cache has behaved
+
+        */
+
+        size_t hits;            // block accesses served from a resident frame
+        size_t misses;          // block accesses that had to read the block from the spill file
+        size_t evictions;       // resident blocks dropped to make room
+        size_t prefetches;      // blocks hinted to the kernel ahead of a sequential scan
+        size_t bytes_paged_in;
+        size_t bytes_paged_out;
+        size_t bytes_read;      // bytes actually read from the spill file, after compression
+        size_t bytes_written;   // bytes actually written to the spill file, after compression
+    };
+
+
+    template <typename T, size_t N = 21, typename Codec = raw_codec<T> >
+    class paged_list
+    {
+        /*
+
+        paged_list
+        An out-of-core list: only 'resident_blocks' blocks are held in memory at a time
+
+        Blocks that do not fit are written to a spill file, each at a fixed slot, and read back
+        when they are next touched through operator[], iteration or 'segments'. Frames are
+        recycled with the CLOCK algorithm (an approximation of LRU that only needs a reference bit
+        per frame). When accesses move through the blocks in order, the next 'prefetch_depth'
+        blocks are hinted to the kernel so their reads overlap with the scan.
+
+        Spilled blocks are cold by definition, so they may be compressed: with a codec other than
+        raw_codec, each block is encoded as it is written back and decoded when it is faulted in.
+        Frames always hold plain elements, so compression is invisible to everything but 'stats'.
+
+        References, pointers and segments into the list remain valid only until another block has
+        to be faulted in, since that may evict the frame they point into.
+
+        Template parameters:
+            * T -   The contained type; must be trivially copyable
+            * N -   The number of elements in each block
+            * Codec -
+                    The codec applied to spilled blocks (see block_codec.hpp)
+
+        */
+
+        static_assert(std::is_trivially_copyable<T>::value, "paged_list requires a trivially copyable T");
+
+        static const size_t no_frame = static_cast<size_t>(-1);
+
+        struct frame
+        {
+            std::array<T, N> arr;
+            size_t block;       // the block held by this frame, or no_frame if the frame is free
+            bool referenced;    // CLOCK reference bit
+            bool dirty;         // the frame differs from the block's spill slot
+        };
+
+        struct block_entry
+        {
+            size_t frame;       // the frame holding this block, or no_frame if it is only on disk
+            bool spilled;       // the spill slot holds a copy of this block
+            size_t encoded;     // the number of bytes in the spill slot
+            size_t spilled_size;    // the number of elements in the spill slot, which pop_back may leave above the block's size
+        };
+
+        static const bool compressed = !std::is_same<Codec, raw_codec<T> >::value;
+
+        int _fd;
+        size_t _size;
+        size_t _prefetch_depth;
+
+        mutable std::vector<frame> _frames;
+        mutable std::vector<block_entry> _blocks;
+        mutable size_t _clock_hand;
+        mutable size_t _last_block;
+        mutable size_t _prefetched_until;   // blocks before this have already been hinted
+        mutable paging_stats _stats;
+        io::block_io* _block_io;
+        mutable std::vector<unsigned char> _scratch;    // holds one encoded block when compressing
+
+        static size_t _slot_bytes()
+        {
+            return Codec::max_encoded_size(N);
+        }
+
+        static off_t _slot_offset(size_t block)
+        {
+            return static_cast<off_t>(block * _slot_bytes());
+        }
+
+        size_t _block_size(size_t block) const
+        {
+            // every block but the last is full
+            return block + 1 < _blocks.size() ? N : _size - block * N;
+        }
+
+        void _write_back(frame& f) const
+        {
+            /*
+
+            _write_back
+            Writes a dirty frame to its block's spill slot
+
+            */
+
+            auto bytes = _block_size(f.block) * sizeof(T);
+            void* data = f.arr.data();
+            auto encoded = bytes;
+            if (compressed)
+            {
+                encoded = Codec::encode(f.arr.data(), _block_size(f.block), _scratch.data());
+                data = _scratch.data();
+            }
+
+            if (_block_io)
+            {
+                _block_io->write(_fd, data, encoded, _slot_offset(f.block));
+                _block_io->wait_all();
+            }
+            else
+            {
+                iovec iov{ data, encoded };
+                io::pwritev_fully(_fd, &iov, 1, _slot_offset(f.block));
+            }
+
+            _blocks[f.block].spilled = true;
+            _blocks[f.block].encoded = encoded;
+            _blocks[f.block].spilled_size = _block_size(f.block);
+            f.dirty = false;
+            _stats.bytes_paged_out += bytes;
+            _stats.bytes_written += encoded;
+        }
+
+        size_t _claim_frame() const
+        {
+            /*
+
+            _claim_frame
+            Finds a frame to reuse, evicting the block it holds if necessary
+
+            Sweeps the clock hand over the frames, clearing reference bits until it finds a frame
+            that is free or has not been referenced since the last sweep.
+
+            */
+
+            while (true)
+            {
+                auto index = _clock_hand;
+                auto& f = _frames[index];
+                _clock_hand = (_clock_hand + 1) % _frames.size();
+
+                if (f.block == no_frame)
+                {
+                    return index;
+                }
+                else if (f.referenced)
+                {
+                    f.referenced = false;
+                }
+                else
+                {
+                    if (f.dirty)
+                    {
+                        _write_back(f);
+                    }
+
+                    _blocks[f.block].frame = no_frame;
+                    f.block = no_frame;
+                    _stats.evictions++;
+                    return index;
+                }
+            }
+        }
+
+        void _prefetch(size_t block) const
+        {
+            /*
+
+            _prefetch
+            Asks the kernel to start reading the spill slots of the blocks after 'block'
+
+            */
+
+#ifdef POSIX_FADV_WILLNEED
+            auto first = block + 1 > _prefetched_until ? block + 1 : _prefetched_until;
+            for (size_t next = first; next <= block + _prefetch_depth && next < _blocks.size(); next++)
+            {
+                _prefetched_until = next + 1;
+                if (_blocks[next].frame == no_frame && _blocks[next].spilled)
+                {
+                    ::posix_fadvise(_fd, _slot_offset(next), static_cast<off_t>(_blocks[next].encoded), POSIX_FADV_WILLNEED);
+                    _stats.prefetches++;
+                }
+            }
+#else
+            (void)block;
+#endif
+        }
+
+        frame& _fault(size_t block) const
+        {
+            /*
+
+            _fault
+            Returns the frame holding 'block', reading it in from the spill file if it is not resident
+
+            */
+
+            auto& entry = _blocks[block];
+            if (entry.frame != no_frame)
+            {
+                _stats.hits++;
+            }
+            else
+            {
+                _stats.misses++;
+
+                // the frame is only given the block once it holds its data; if the read or the
+                // decode throws, the frame stays free and the block stays out
+                auto index = _claim_frame();
+                auto& f = _frames[index];
+
+                if (entry.spilled)
+                {
+                    auto bytes = _block_size(block) * sizeof(T);
+                    void* data = compressed ? static_cast<void*>(_scratch.data()) : static_cast<void*>(f.arr.data());
+                    if (_block_io)
+                    {
+                        _block_io->read(_fd, data, entry.encoded, _slot_offset(block));
+                        _block_io->wait_all();
+                    }
+                    else
+                    {
+                        iovec iov{ data, entry.encoded };
+                        io::preadv_fully(_fd, &iov, 1, _slot_offset(block));
+                    }
+
+                    if (compressed)
+                    {
+                        Codec::decode(_scratch.data(), entry.encoded, f.arr.data(), entry.spilled_size);
+                    }
+
+                    _stats.bytes_paged_in += bytes;
+                    _stats.bytes_read += entry.encoded;
+                }
+
+                f.block = block;
+                f.dirty = false;
+                entry.frame = index;
+            }
+
+            // sequential access is detected when a block follows the one touched before it
+            if (block == _last_block + 1)
+            {
+                _prefetch(block);
+            }
+
+            _last_block = block;
+
+            auto& f = _frames[entry.frame];
+            f.referenced = true;
+            return f;
+        }
+    public:
+        using value_type = T;
+        using reference = T & ;
+        using const_reference = const T & ;
+        using pointer = T * ;
+        using const_pointer = const T * ;
+        using size_type = size_t;
+
+        template <bool is_const = false>
+        class list_iterator
+        {
+            /*
+
+            list_iterator
+            Walks the list by block and index, faulting blocks in as they are reached
+
+            */
+
+            using list_pointer =
+                typename std::conditional_t<is_const, const paged_list *, paged_list * >;
+
+            list_pointer _list;
+            size_t _block;
+            size_t _elem_index;
+
+            friend class paged_list;
+
+            list_iterator(list_pointer list, size_t block, size_t idx)
+                : _list(list)
+                , _block(block)
+                , _elem_index(idx) { }
+        public:
+            using value_type = T;
+            using pointer =
+                typename std::conditional_t<is_const, const value_type *, value_type * >;
+            using reference =
+                typename std::conditional_t<is_const, const value_type &, value_type & >;
+            using iterator_category = std::forward_iterator_tag;
+            using difference_type = std::ptrdiff_t;
+
+            reference operator*() const
+            {
+                auto& f = _list->_fault(_block);
+                if (!is_const)
+                {
+                    f.dirty = true;
+                }
+
+                return f.arr[_elem_index];
+            }
+
+            pointer operator->() const
+            {
+                return &**this;
+            }
+
+            list_iterator& operator++()
+            {
+                _elem_index++;
+                if (_elem_index == N)
+                {
+                    _block++;
+                    _elem_index = 0;
+                }
+
+                return *this;
+            }
+
+            list_iterator operator++(int)
+            {
+                list_iterator it{ *this };
+                ++(*this);
+                return it;
+            }
+
+            bool operator==(const list_iterator& right) const
+            {
+                return _block == right._block && _elem_index == right._elem_index;
+            }
+
+            bool operator!=(const list_iterator& right) const
+            {
+                return _block != right._block || _elem_index != right._elem_index;
+            }
+        };
+
+        using iterator = list_iterator<false>;
+        using const_iterator = list_iterator<true>;
+
+        template <bool is_const = false>
+        class segment_iterator
+        {
+            /*
+
+            segment_iterator
+            Yields each block as a segment, faulting it in first
+
+            */
+
+            using list_pointer =
+                typename std::conditional_t<is_const, const paged_list *, paged_list * >;
+
+            list_pointer _list;
+            size_t _block;
+        public:
+            using value_type = segment<typename std::conditional_t<is_const, const T, T> >;
+            using iterator_category = std::forward_iterator_tag;
+            using difference_type = std::ptrdiff_t;
+
+            segment_iterator(list_pointer list, size_t block)
+                : _list(list)
+                , _block(block) { }
+
+            value_type operator*() const
+            {
+                auto& f = _list->_fault(_block);
+                if (!is_const)
+                {
+                    f.dirty = true;
+                }
+
+                return value_type{ f.arr.data(), _list->_block_size(_block) };
+            }
+
+            segment_iterator& operator++()
+            {
+                _block++;
+                return *this;
+            }
+
+            bool operator==(const segment_iterator& right) const
+            {
+                return _block == right._block;
+            }
+
+            bool operator!=(const segment_iterator& right) const
+            {
+                return _block != right._block;
+            }
+        };
+
+        template <bool is_const = false>
+        struct segment_range
+        {
+            segment_iterator<is_const> first;
+            segment_iterator<is_const> last;
+
+            segment_iterator<is_const> begin() const
+            {
+                return first;
+            }
+
+            segment_iterator<is_const> end() const
+            {
+                return last;
+            }
+        };
+
+        size_t size() const noexcept
+        {
+            return _size;
+        }
+
+        bool empty() const noexcept
+        {
+            return _size == 0;
+        }
+
+        size_t block_count() const noexcept
+        {
+            return _blocks.size();
+        }
+
+        size_t resident_blocks() const noexcept
+        {
+            return _frames.size();
+        }
+
+        const paging_stats& stats() const noexcept
+        {
+            return _stats;
+        }
+
+        void reset_stats() noexcept
+        {
+            _stats = paging_stats{};
+        }
+
+        bool set_block_io(io::block_io* block_io)
+        {
+            /*
+
+            set_block_io
+            Routes spill file reads and writes through 'block_io' (or back to pread/pwrite, if nullptr)
+
+            The frame pool is registered with 'block_io' as a single fixed buffer, replacing any
+            buffers registered with it before. Returns whether the registration succeeded; if it
+            did not, the frames are still used as ordinary buffers.
+
+            */
+
+            _block_io = block_io;
+            if (!block_io)
+            {
+                return true;
+            }
+
+            iovec pool{ _frames.data(), _frames.size() * sizeof(frame) };
+            return block_io->register_buffers(&pool, 1);
+        }
+
+        void set_prefetch_depth(size_t depth) noexcept
+        {
+            _prefetch_depth = depth;
+        }
+
+        [[nodiscard]]
+        reference at(size_type pos)
+        {
+            if (pos >= _size)
+            {
+                throw std::out_of_range("paged_list");
+            }
+
+            // a mutable reference may be written through, so the block must be written back on eviction
+            auto& f = _fault(pos / N);
+            f.dirty = true;
+            return f.arr[pos % N];
+        }
+
+        [[nodiscard]]
+        const_reference at(size_type pos) const
+        {
+            if (pos >= _size)
+            {
+                throw std::out_of_range("paged_list");
+            }
+
+            return _fault(pos / N).arr[pos % N];
+        }
+
+        [[nodiscard]]
+        reference operator[](size_type pos)
+        {
+            // an alias for 'at'
+            return at(pos);
+        }
+
+        [[nodiscard]]
+        const_reference operator[](size_type pos) const
+        {
+            return at(pos);
+        }
+
+        iterator begin()
+        {
+            return iterator(this, 0, 0);
+        }
+
+        iterator end()
+        {
+            return iterator(this, _size / N, _size % N);
+        }
+
+        const_iterator begin() const
+        {
+            return const_iterator(this, 0, 0);
+        }
+
+        const_iterator end() const
+        {
+            return const_iterator(this, _size / N, _size % N);
+        }
+
+        segment_range<false> segments()
+        {
+            return segment_range<false>{ segment_iterator<false>(this, 0), segment_iterator<false>(this, _blocks.size()) };
+        }
+
+        segment_range<true> segments() const
+        {
+            return segment_range<true>{ segment_iterator<true>(this, 0), segment_iterator<true>(this, _blocks.size()) };
+        }
+
+        void push_back(const T& val)
+        {
+            /*
+
+            push_back
+            Appends 'val', starting a new block (in a fresh frame) when the last one is full
+
+            */
+
+            if (_size == _blocks.size() * N)
+            {
+                _blocks.push_back(block_entry{ no_frame, false, 0, 0 });
+            }
+
+            auto& f = _fault(_blocks.size() - 1);
+            f.arr[_size % N] = val;
+            f.dirty = true;
+            _size++;
+        }
+
+        void pop_back()
+        {
+            /*
+
+            pop_back
+            Removes the last element, releasing the last block's frame when it empties
+
+            */
+
+            if (_size == 0)
+            {
+                throw std::out_of_range("paged_list");
+            }
+
+            _size--;
+            if (_size == (_blocks.size() - 1) * N)
+            {
+                auto& entry = _blocks.back();
+                if (entry.frame != no_frame)
+                {
+                    _frames[entry.frame].block = no_frame;
+                    _frames[entry.frame].dirty = false;
+                }
+
+                _blocks.pop_back();
+            }
+        }
+
+        void clear()
+        {
+            for (auto& f : _frames)
+            {
+                f.block = no_frame;
+                f.dirty = false;
+                f.referenced = false;
+            }
+
+            _blocks.clear();
+            _size = 0;
+            _last_block = no_frame;
+            _prefetched_until = 0;
+
+            // the spill file's contents are no longer needed
+            if (::ftruncate(_fd, 0) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "paged_list ftruncate");
+            }
+        }
+
+        // constructors
+
+        explicit paged_list(size_t resident_blocks, const char* spill_directory = "/tmp", size_t prefetch_depth = 2)
+            : _fd(-1)
+            , _size(0)
+            , _prefetch_depth(prefetch_depth)
+            , _frames(resident_blocks > 0 ? resident_blocks : 1)
+            , _clock_hand(0)
+            , _last_block(no_frame)
+            , _prefetched_until(0)
+            , _stats()
+            , _block_io(nullptr)
+            , _scratch(compressed ? _slot_bytes() : 0)
+        {
+            // the spill file is created in 'spill_directory' and unlinked at once, so it never outlives the list
+            std::string path = std::string(spill_directory) + "/paged_list.XXXXXX";
+            _fd = ::mkstemp(&path[0]);
+            if (_fd < 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "paged_list mkstemp");
+            }
+
+            ::unlink(path.c_str());
+
+            for (auto& f : _frames)
+            {
+                f.block = no_frame;
+                f.referenced = false;
+                f.dirty = false;
+            }
+        }
+
+        paged_list(const paged_list&) = delete;
+        paged_list& operator=(const paged_list&) = delete;
+
+        ~paged_list()
+        {
+            if (_fd >= 0)
+            {
+                ::close(_fd);
+            }
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,757 @@
+#pragma once
+
+/*
+
+persistent_list.hpp
+Copyright 2020 Riley Lannon
+
+A segmented list whose blocks live in a memory-mapped file
+
+*/
+
+#include "segmented_list.hpp"
+
+#ifdef SEGMENTED_LIST_POSIX_IO
+
+#include <cstddef>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace segmented_list
+{
+    namespace io
+    {
+        struct arena_header
+        {
+            /*
+
+            arena_header
+            The first bytes of a persistent_list arena file
+
+            The rest of the file is a sequence of block records. Blocks are linked by file offset
+            rather than by pointer, so the arena can be remapped at a different address (or reopened
+            by another process) without fixing anything up. An offset of 0 means "no block", since
+            the header always occupies the start of the file.
+
+            Records hold no size: every block but the tail is full, so the sizes follow from
+            'element_count'. Records below 'arena_end' that are not in the chain are free, and the
+            free list is rebuilt from the chain when the arena is opened.
+
+            */
+
+            static const uint32_t current_version = 2;
+
+            char magic[8];
+            uint32_t version;
+            uint32_t byte_order;
+            uint64_t element_size;
+            uint64_t block_size;
+            uint64_t element_count;
+            uint64_t block_count;
+            uint64_t head;          // offset of the first block
+            uint64_t tail;          // offset of the last block
+            uint64_t arena_end;     // offset just past the last block record ever carved out
+
+            arena_header()
+                : magic{ 'S', 'E', 'G', 'L', 'P', 'R', 'S', 0 }
+                , version(current_version)
+                , byte_order(byte_order_mark)
+                , element_size(0)
+                , block_size(0)
+                , element_count(0)
+                , block_count(0)
+                , head(0)
+                , tail(0)
+                , arena_end(0) { }
+        };
+    }
+
+
+    template <typename T, size_t N = 21>
+    class persistent_list
+    {
+        /*
+
+        persistent_list
+        A durable, append-friendly list whose block arena is a memory-mapped file
+
+        Elements are written straight into the page cache by push_back; 'sync' flushes the ranges
+        dirtied since the last sync, making the list durable up to that point. The header, which
+        holds the element count and the ends of the chain, is kept in memory and written to the
+        file only by 'sync', once the blocks it describes are on stable storage.
+
+        Nothing the committed header reaches is relinked before the next sync: a block emptied by
+        pop_back or clear stays linked after the tail as a spare, to be refilled in place, and only
+        becomes free once a header that no longer covers it is committed. After a crash, the file
+        therefore holds the chain and size of the last sync. The one exception is element values:
+        an element removed since then whose position was filled again may show the new value.
+
+        The file grows with ftruncate, and the mapping follows it with mremap where available (or
+        an munmap/mmap pair otherwise). Because blocks link by file offset, growth never requires
+        the existing blocks to be touched.
+
+        Template parameters:
+            * T -   The contained type; must be trivially copyable
+            * N -   The number of elements in each block
+
+        */
+
+        static_assert(std::is_trivially_copyable<T>::value, "persistent_list requires a trivially copyable T");
+
+        struct block_record
+        {
+            uint64_t previous;
+            uint64_t next;
+            T arr[N];
+        };
+
+        int _fd;
+        char* _mapping;
+        size_t _mapping_size;
+
+        // the live header; the copy at the start of the file is only updated by '_commit_header'
+        io::arena_header _arena;
+
+        // emptied blocks still linked after the tail, nearest last; they become free at the next sync
+        std::vector<uint64_t> _spare;
+
+        // records no committed header reaches, free for reuse
+        std::vector<uint64_t> _free;
+
+        // the lowest and highest offsets written since the last sync
+        uint64_t _dirty_begin;
+        uint64_t _dirty_end;
+
+        void _commit_header()
+        {
+            /*
+
+            _commit_header
+            Writes the live header over the one in the file with pwrite, and waits for it with fdatasync
+
+            The header bytes of the mapping are never written through it, so the kernel cannot
+            write back a header ahead of 'sync'; the pwrite goes through the same page cache.
+
+            */
+
+            iovec iov{ &_arena, sizeof(_arena) };
+            io::pwritev_fully(_fd, &iov, 1, 0);
+            if (::fdatasync(_fd) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "persistent_list fdatasync");
+            }
+        }
+
+        block_record* _block(uint64_t offset) const
+        {
+            return offset ? reinterpret_cast<block_record*>(_mapping + offset) : nullptr;
+        }
+
+        static uint64_t _first_block_offset()
+        {
+            return io::round_up(sizeof(io::arena_header), alignof(block_record) > 64 ? alignof(block_record) : 64);
+        }
+
+        static uint64_t _record_size()
+        {
+            return io::round_up(sizeof(block_record), alignof(block_record));
+        }
+
+        size_t _block_size(uint64_t offset) const noexcept
+        {
+            // every block but the tail is full
+            return offset == _arena.tail ? _arena.element_count - (_arena.block_count - 1) * N : N;
+        }
+
+        void _mark_dirty(uint64_t begin, uint64_t end)
+        {
+            if (_dirty_begin == _dirty_end)
+            {
+                _dirty_begin = begin;
+                _dirty_end = end;
+            }
+            else
+            {
+                _dirty_begin = begin < _dirty_begin ? begin : _dirty_begin;
+                _dirty_end = end > _dirty_end ? end : _dirty_end;
+            }
+        }
+
+        void _grow(size_t required)
+        {
+            /*
+
+            _grow
+            Extends the file and the mapping to at least 'required' bytes, doubling to amortize the cost
+
+            */
+
+            auto new_size = _mapping_size ? _mapping_size : static_cast<size_t>(io::page_size());
+            while (new_size < required)
+            {
+                new_size *= 2;
+            }
+
+            if (::ftruncate(_fd, static_cast<off_t>(new_size)) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "persistent_list ftruncate");
+            }
+
+            void* mapping = MAP_FAILED;
+#ifdef MREMAP_MAYMOVE
+            if (_mapping)
+            {
+                mapping = ::mremap(_mapping, _mapping_size, new_size, MREMAP_MAYMOVE);
+            }
+            else
+#endif
+            {
+                if (_mapping)
+                {
+                    // the pages are shared with the file, so nothing is lost by unmapping
+                    ::munmap(_mapping, _mapping_size);
+                    _mapping = nullptr;
+                }
+
+                mapping = ::mmap(nullptr, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+            }
+
+            if (mapping == MAP_FAILED)
+            {
+                throw std::system_error(errno, std::generic_category(), "persistent_list mmap");
+            }
+
+            _mapping = static_cast<char*>(mapping);
+            _mapping_size = new_size;
+        }
+
+        uint64_t _alloc_block()
+        {
+            /*
+
+            _alloc_block
+            Appends an empty block record to the chain
+
+            A spare is taken first, since it is already linked after the tail and needs no writes;
+            otherwise a free record is recycled, or a new one is carved from the end of the arena.
+            Neither of those is reachable from the committed header, so linking them is safe.
+
+            */
+
+            uint64_t offset;
+            if (!_spare.empty())
+            {
+                offset = _spare.back();
+                _spare.pop_back();
+            }
+            else
+            {
+                if (!_free.empty())
+                {
+                    offset = _free.back();
+                    _free.pop_back();
+                }
+                else
+                {
+                    offset = _arena.arena_end;
+                    if (offset + _record_size() > _mapping_size)
+                    {
+                        _grow(offset + _record_size());
+                    }
+
+                    _arena.arena_end = offset + _record_size();
+                }
+
+                auto block = _block(offset);
+                block->previous = _arena.tail;
+                block->next = 0;
+                _mark_dirty(offset, offset + offsetof(block_record, arr));
+
+                if (_arena.tail)
+                {
+                    _block(_arena.tail)->next = offset;
+                    _mark_dirty(_arena.tail, _arena.tail + offsetof(block_record, arr));
+                }
+            }
+
+            if (!_arena.tail)
+            {
+                _arena.head = offset;
+            }
+
+            _arena.tail = offset;
+            _arena.block_count++;
+
+            return offset;
+        }
+
+        void _map_existing()
+        {
+            /*
+
+            _map_existing
+            Maps an arena file that already has contents and validates its header
+
+            */
+
+            struct stat st;
+            if (::fstat(_fd, &st) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "persistent_list");
+            }
+
+            auto size = static_cast<size_t>(st.st_size);
+            auto mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+            if (mapping == MAP_FAILED)
+            {
+                throw std::system_error(errno, std::generic_category(), "persistent_list mmap");
+            }
+
+            _mapping = static_cast<char*>(mapping);
+            _mapping_size = size;
+
+            io::arena_header reference;
+            auto& header = _arena;
+            if (size >= sizeof(io::arena_header))
+            {
+                std::memcpy(&header, _mapping, sizeof(header));
+            }
+
+            bool valid = size >= sizeof(io::arena_header)
+                && std::memcmp(header.magic, reference.magic, sizeof(reference.magic)) == 0
+                && header.version == io::arena_header::current_version
+                && header.byte_order == io::byte_order_mark
+                && header.element_size == sizeof(T)
+                && header.block_size == N
+                && header.arena_end >= _first_block_offset()
+                && header.arena_end <= size
+                && (header.arena_end - _first_block_offset()) % _record_size() == 0
+                && header.block_count <= (header.arena_end - _first_block_offset()) / _record_size()
+                && header.element_count <= header.block_count * N
+                && (header.block_count == 0 || header.element_count > (header.block_count - 1) * N);
+
+            if (!valid)
+            {
+                throw std::runtime_error("persistent_list: incompatible arena file");
+            }
+
+            // walk the chain, checking every link, and make every other record free
+            auto records = (header.arena_end - _first_block_offset()) / _record_size();
+            std::vector<bool> linked(records, false);
+            uint64_t previous = 0;
+            uint64_t current = header.head;
+            for (uint64_t i = 0; i < header.block_count; i++)
+            {
+                if (current < _first_block_offset() || current >= header.arena_end
+                    || (current - _first_block_offset()) % _record_size() != 0
+                    || linked[(current - _first_block_offset()) / _record_size()]
+                    || _block(current)->previous != previous)
+                {
+                    throw std::runtime_error("persistent_list: corrupt block chain");
+                }
+
+                linked[(current - _first_block_offset()) / _record_size()] = true;
+                previous = current;
+                current = i + 1 < header.block_count ? _block(current)->next : 0;
+            }
+
+            if (previous != header.tail || (header.block_count == 0 && header.head != 0))
+            {
+                throw std::runtime_error("persistent_list: corrupt block chain");
+            }
+
+            // highest first, so the lowest records are reused first
+            for (auto i = records; i-- > 0; )
+            {
+                if (!linked[i])
+                {
+                    _free.push_back(_first_block_offset() + i * _record_size());
+                }
+            }
+        }
+
+        void _release()
+        {
+            if (_mapping)
+            {
+                ::munmap(_mapping, _mapping_size);
+                _mapping = nullptr;
+            }
+
+            if (_fd >= 0)
+            {
+                ::close(_fd);
+                _fd = -1;
+            }
+        }
+    public:
+        using value_type = T;
+        using reference = T & ;
+        using const_reference = const T & ;
+        using pointer = T * ;
+        using const_pointer = const T * ;
+        using size_type = size_t;
+
+        template <bool is_const = false>
+        class list_iterator
+        {
+            /*
+
+            list_iterator
+            Walks the arena's block chain; holds the list rather than a raw pointer, since the
+            mapping may move when the arena grows
+
+            */
+
+            using list_pointer =
+                typename std::conditional_t<is_const, const persistent_list *, persistent_list * >;
+
+            list_pointer _list;
+            uint64_t _block;
+            size_t _elem_index;
+
+            friend class persistent_list;
+
+            list_iterator(list_pointer list, uint64_t block, size_t idx)
+                : _list(list)
+                , _block(block)
+                , _elem_index(idx) { }
+        public:
+            using value_type = T;
+            using pointer =
+                typename std::conditional_t<is_const, const value_type *, value_type * >;
+            using reference =
+                typename std::conditional_t<is_const, const value_type &, value_type & >;
+            using iterator_category = std::forward_iterator_tag;
+            using difference_type = std::ptrdiff_t;
+
+            reference operator*() const
+            {
+                return _list->_block(_block)->arr[_elem_index];
+            }
+
+            pointer operator->() const
+            {
+                return &_list->_block(_block)->arr[_elem_index];
+            }
+
+            list_iterator& operator++()
+            {
+                _elem_index++;
+                if (_elem_index == _list->_block_size(_block))
+                {
+                    // the tail's link is not the end of the list; spares may follow it
+                    _block = _block == _list->_arena.tail ? 0 : _list->_block(_block)->next;
+                    _elem_index = 0;
+                }
+
+                return *this;
+            }
+
+            list_iterator operator++(int)
+            {
+                list_iterator it{ *this };
+                ++(*this);
+                return it;
+            }
+
+            bool operator==(const list_iterator& right) const
+            {
+                return _block == right._block && _elem_index == right._elem_index;
+            }
+
+            bool operator!=(const list_iterator& right) const
+            {
+                return _block != right._block || _elem_index != right._elem_index;
+            }
+        };
+
+        using iterator = list_iterator<false>;
+        using const_iterator = list_iterator<true>;
+
+        size_t size() const noexcept
+        {
+            return _arena.element_count;
+        }
+
+        bool empty() const noexcept
+        {
+            return size() == 0;
+        }
+
+        size_t capacity() const noexcept
+        {
+            return _arena.block_count * N;
+        }
+
+        size_t file_size() const noexcept
+        {
+            return _mapping_size;
+        }
+
+        [[nodiscard]]
+        reference at(size_type pos)
+        {
+            return const_cast<reference>(static_cast<const persistent_list*>(this)->at(pos));
+        }
+
+        [[nodiscard]]
+        const_reference at(size_type pos) const
+        {
+            /*
+
+            at
+            Returns the element at 'pos', walking the chain from whichever end is closer
+
+            Every block but the last is full, so the block number is found by division.
+
+            */
+
+            auto& header = _arena;
+            if (pos >= header.element_count)
+            {
+                throw std::out_of_range("persistent_list");
+            }
+
+            auto block_number = pos / N;
+            uint64_t current;
+            if (block_number <= header.block_count / 2)
+            {
+                current = header.head;
+                for (size_t i = 0; i < block_number; i++)
+                {
+                    current = _block(current)->next;
+                }
+            }
+            else
+            {
+                current = header.tail;
+                for (size_t i = header.block_count - 1; i > block_number; i--)
+                {
+                    current = _block(current)->previous;
+                }
+            }
+
+            return _block(current)->arr[pos % N];
+        }
+
+        [[nodiscard]]
+        reference operator[](size_type pos)
+        {
+            // an alias for 'at'
+            return at(pos);
+        }
+
+        [[nodiscard]]
+        const_reference operator[](size_type pos) const
+        {
+            return at(pos);
+        }
+
+        reference back()
+        {
+            if (empty())
+            {
+                throw std::out_of_range("persistent_list");
+            }
+
+            return _block(_arena.tail)->arr[_block_size(_arena.tail) - 1];
+        }
+
+        iterator begin()
+        {
+            return iterator(this, _arena.head, 0);
+        }
+
+        iterator end()
+        {
+            return iterator(this, 0, 0);
+        }
+
+        const_iterator begin() const
+        {
+            return const_iterator(this, _arena.head, 0);
+        }
+
+        const_iterator end() const
+        {
+            return const_iterator(this, 0, 0);
+        }
+
+        void push_back(const T& val)
+        {
+            /*
+
+            push_back
+            Appends 'val', writing it directly into the mapped arena
+
+            */
+
+            auto tail = _arena.tail;
+            if (!tail || _block_size(tail) == N)
+            {
+                tail = _alloc_block();
+            }
+
+            auto index = _arena.element_count - (_arena.block_count - 1) * N;
+            _block(tail)->arr[index] = val;
+            _arena.element_count++;
+
+            auto elem_offset = tail + offsetof(block_record, arr) + index * sizeof(T);
+            _mark_dirty(elem_offset, elem_offset + sizeof(T));
+        }
+
+        void pop_back()
+        {
+            /*
+
+            pop_back
+            Removes the last element; an emptied block stays linked after the tail as a spare
+
+            */
+
+            if (_arena.element_count == 0)
+            {
+                throw std::out_of_range("persistent_list");
+            }
+
+            auto offset = _arena.tail;
+            _arena.element_count--;
+
+            if (_arena.element_count == (_arena.block_count - 1) * N)
+            {
+                _arena.tail = _block(offset)->previous;
+                if (!_arena.tail)
+                {
+                    _arena.head = 0;
+                }
+
+                _arena.block_count--;
+                _spare.push_back(offset);
+            }
+        }
+
+        void clear()
+        {
+            /*
+
+            clear
+            Removes every element, keeping the blocks as spares and the arena's file size for reuse
+
+            */
+
+            // the tail's spares stay behind it, so the chain from the head is pushed in reverse
+            for (auto offset = _arena.tail; offset; offset = _block(offset)->previous)
+            {
+                _spare.push_back(offset);
+            }
+
+            _arena.element_count = 0;
+            _arena.block_count = 0;
+            _arena.head = 0;
+            _arena.tail = 0;
+        }
+
+        void sync()
+        {
+            /*
+
+            sync
+            Flushes every range dirtied since the last sync to stable storage, then the header
+
+            Throws std::system_error if the flush fails; the file then still holds the header of
+            the last successful sync.
+
+            */
+
+            auto page = io::page_size();
+            if (_dirty_begin != _dirty_end)
+            {
+                auto begin = _dirty_begin / page * page;
+                auto end = io::round_up(_dirty_end, page);
+                end = end > _mapping_size ? _mapping_size : end;
+
+                if (::msync(_mapping + begin, end - begin, MS_SYNC) != 0)
+                {
+                    throw std::system_error(errno, std::generic_category(), "persistent_list msync");
+                }
+            }
+
+            // the header is committed last, so it never describes blocks that are not yet durable
+            _commit_header();
+
+            // no committed header reaches the spares any more
+            _free.insert(_free.end(), _spare.rbegin(), _spare.rend());
+            _spare.clear();
+
+            _dirty_begin = 0;
+            _dirty_end = 0;
+        }
+
+        // constructors
+
+        explicit persistent_list(const char* path, int mode = 0644)
+            : _fd(-1)
+            , _mapping(nullptr)
+            , _mapping_size(0)
+            , _dirty_begin(0)
+            , _dirty_end(0)
+        {
+            // opens the arena at 'path', creating it if it does not exist
+            _fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, mode);
+            if (_fd < 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "persistent_list open");
+            }
+
+            try
+            {
+                struct stat st;
+                if (::fstat(_fd, &st) != 0)
+                {
+                    throw std::system_error(errno, std::generic_category(), "persistent_list");
+                }
+
+                if (st.st_size == 0)
+                {
+                    // a new arena; lay down the header
+                    _grow(_first_block_offset() + _record_size());
+                    _arena.element_size = sizeof(T);
+                    _arena.block_size = N;
+                    _arena.arena_end = _first_block_offset();
+                    _commit_header();
+                }
+                else
+                {
+                    _map_existing();
+                }
+            }
+            catch (...)
+            {
+                _release();
+                throw;
+            }
+        }
+
+        persistent_list(const persistent_list&) = delete;
+        persistent_list& operator=(const persistent_list&) = delete;
+
+        ~persistent_list()
+        {
+            // the header only reaches the file through 'sync', so a list that is closed cleanly is synced
+            try
+            {
+                sync();
+            }
+            catch (...)
+            {
+                // nothing can be reported from here; the file keeps the last successful sync
+            }
+
+            _release();
+        }
+    };
+}
+
+#endif
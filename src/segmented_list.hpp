@@ -8,10 +8,25 @@ Copyright 2020 Riley Lannon
 */
 
 #include <memory>
+#include <algorithm>
 #include <type_traits>
 #include <exception>
+#include <stdexcept>
 #include <iterator>
 #include <initializer_list>
+#include <cstdint>
+#include <array>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <random>
+#include <vector>
+
+#include "list_config.hpp"
+#include "list_io.hpp"
+#include "block_index.hpp"
 
 namespace segmented_list
 {
@@ -34,7 +49,10 @@ namespace segmented_list
 
         */
 
-        template <typename, typename > friend class segmented_list;
+        template <typename, typename, typename > friend class segmented_list;
+        template <typename> friend class skip_index;
+        template <typename, size_t> friend class counted_btree;
+        template <typename> friend class fenwick_index;
 
         std::array<T, N> _arr;
 
@@ -44,11 +62,25 @@ namespace segmented_list
         const size_t _capacity;
         size_t _size;
 
+        // checkpoint bookkeeping: whether the block changed since the last checkpoint, and where it went
+        static const size_t no_slot = static_cast<size_t>(-1);
+        bool _dirty;
+        size_t _slot;
+
+        // the block's entry in the list's counted index, if it has one (see block_index.hpp): the
+        // skip list's and B+-tree's node, or the Fenwick tree's block number
+        void* _index_node;
+        size_t _index_number;
+
         list_block(list_block<T, N>* prev, list_block<T, N>* next)
             : _previous(prev)
             , _next(next)
             , _capacity(N)
-            , _size(0) { }
+            , _size(0)
+            , _dirty(true)
+            , _slot(no_slot)
+            , _index_node(nullptr)
+            , _index_number(0) { }
     public:
         using value_type = T;
         using reference = value_type & ;
@@ -77,6 +109,21 @@ namespace segmented_list
             return _size == 0;
         }
 
+        bool full() const
+        {
+            return _size == _capacity;
+        }
+
+        pointer data()
+        {
+            return _arr.data();
+        }
+
+        const_pointer data() const
+        {
+            return _arr.data();
+        }
+
         void push_back(const T& val)
         {
             /*
@@ -87,15 +134,11 @@ namespace segmented_list
 
             */
 
-            if (_size < _capacity)
-            {
-                _arr[_size] = val;
-                _size += 1;
-            }
-            else
-            {
-                throw std::out_of_range("list_block");
-            }   
+            SEGMENTED_LIST_CHECK_BOUNDS(_size < _capacity, "list_block");
+
+            _arr[_size] = val;
+            _size += 1;
+            _dirty = true;
         }
 
         void pop_back()
@@ -107,30 +150,46 @@ namespace segmented_list
 
             */
 
-            if (_size == 0)
-            {
-                throw std::out_of_range("list_block");
-            }
-            else
-            {
-                // do not call the destructor explicitly, as the std::array destructor will do that
-                // this means the element is left in a valid but indeterminate state
-                _size -= 1;
-            }
+            SEGMENTED_LIST_CHECK_BOUNDS(_size != 0, "list_block");
+
+            // do not call the destructor explicitly, as the std::array destructor will do that
+            // this means the element is left in a valid but indeterminate state
+            _size -= 1;
+        }
+
+        void clear()
+        {
+            /*
+
+            clear
+            Removes every element from the array, leaving them in a valid but indeterminate state
+
+            */
+
+            _size = 0;
+            _dirty = true;
         }
 
         list_block(list_block<T, N>* tail)
             : _previous(tail)
             , _next(nullptr)
             , _capacity(N)
-            , _size(0) { }
+            , _size(0)
+            , _dirty(true)
+            , _slot(no_slot)
+            , _index_node(nullptr)
+            , _index_number(0) { }
 
         list_block(const list_block<T, N>& other)
             : _arr(other._arr)
             , _previous(nullptr)
             , _next(nullptr)
             , _capacity(other._capacity)
-            , _size(other._size) { }
+            , _size(other._size)
+            , _dirty(true)
+            , _slot(no_slot)
+            , _index_node(nullptr)
+            , _index_number(0) { }
 
         list_block(list_block<T, N>&& other)
             : _arr(other._arr)
@@ -138,6 +197,10 @@ namespace segmented_list
             , _next(other._next)
             , _capacity(other._capacity)
             , _size(other._size) 
+            , _dirty(true)
+            , _slot(no_slot)
+            , _index_node(nullptr)
+            , _index_number(0)
             { 
                 other._next = nullptr; 
                 other._previous = nullptr;
@@ -147,869 +210,3126 @@ namespace segmented_list
             : _capacity(N)
             , _size(0)
             , _previous(nullptr)
-            , _next(nullptr) { }
+            , _next(nullptr)
+            , _dirty(true)
+            , _slot(no_slot)
+            , _index_node(nullptr)
+            , _index_number(0) { }
     };
 
 
-    template<typename T, typename Allocator = std::allocator<list_block<T> > >
-    class segmented_list
+    class block_reclaimer
     {
         /*
 
-        segmented_list
+        block_reclaimer
+        A background worker that destroys and deallocates block chains detached by a segmented_list
 
-        Template parameters:
-            * T -   The contained type
-            * Allocator -    The allocator to use; defaults to allocator<list_block<T>>
+        There is a single process-wide instance, created on first use. It is intentionally never
+        destroyed, so lists with static storage duration may still hand off their blocks during
+        program shutdown; any work still queued at exit is simply dropped along with the process.
 
         */
 
-        // like a linked list, track head and tail nodes
-        list_block<T>* _head;
-        list_block<T>* _tail;
-        list_block<T>* _reserved;   // keep one block reserved upon a deallocation
+        std::mutex _mutex;
+        std::condition_variable _work_available;
+        std::condition_variable _idle;
+        std::deque<std::function<void()> > _queue;
+        bool _busy;
+        std::thread _worker;
 
-        Allocator _allocator;
+        void _run()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (true)
+            {
+                _work_available.wait(lock, [this]() { return !_queue.empty(); });
 
-        size_t _capacity;
-        size_t _size;
-        size_t _num_blocks;
+                auto job = std::move(_queue.front());
+                _queue.pop_front();
+                _busy = true;
+
+                // perform the reclamation outside of the lock so submitters never wait on it
+                lock.unlock();
+                job();
+                lock.lock();
+
+                _busy = false;
+                if (_queue.empty())
+                {
+                    _idle.notify_all();
+                }
+            }
+        }
+
+        block_reclaimer()
+            : _busy(false)
+            , _worker([this]() { _run(); }) { }
+    public:
+        block_reclaimer(const block_reclaimer&) = delete;
+        block_reclaimer& operator=(const block_reclaimer&) = delete;
+
+        static block_reclaimer& instance()
+        {
+            static block_reclaimer* reclaimer = new block_reclaimer();
+            return *reclaimer;
+        }
 
-        void _alloc_block()
+        void submit(std::function<void()> job)
         {
             /*
 
-            _alloc_block
-            Adds a new empty block to the list
+            submit
+            Queues 'job' to be run on the reclaimer thread
 
-            May perform an allocation if necessary. However, if there is a reserved block, it will utilize that.
-            
             */
 
-            if (_reserved)
             {
-                // update the relationships
-                _tail->_next = _reserved;
-                _reserved->_previous = _tail;
-
-                // update the tail node
-                _tail = _reserved;
+                std::lock_guard<std::mutex> lock(_mutex);
+                _queue.push_back(std::move(job));
             }
-            else
-            {
-                // allocates a new block and appends it
-                auto allocated = std::allocator_traits<Allocator>::allocate(_allocator, 1);
-                std::allocator_traits<Allocator>::construct(_allocator, allocated, _tail);
+            _work_available.notify_one();
+        }
 
-                if (_num_blocks == 0)
-                {
-                    _head = allocated;
-                }
-                else if (_num_blocks == 1)
-                {
-                    _head->_next = allocated;
-                }
-                else
-                {
-                    _tail->_next = allocated;
-                }
+        void drain()
+        {
+            /*
 
-                _tail = allocated;
-            }
+            drain
+            Blocks until every job submitted so far has been run
 
-            _capacity += list_block<T>::block_size();
-            _num_blocks++;
+            */
+
+            std::unique_lock<std::mutex> lock(_mutex);
+            _idle.wait(lock, [this]() { return _queue.empty() && !_busy; });
         }
-    
-        
-    public:
-        // define our iterator states (valid/invalid)
-        enum iter_state { iter_valid = 0, before_begin = 1, past_end = 2 };
+    };
 
-        // define the iterator class
-        template <bool is_const = false>
-        class list_iterator
+
+    template <typename T>
+    struct segment
+    {
+        /*
+
+        segment
+        A contiguous run of elements inside a container, such as the live part of one block
+
+        T may be const-qualified for read-only segments.
+
+        */
+
+        T* data;
+        size_t size;
+
+        T* begin() const
         {
-        public:
-            using value_type = T;
-            using pointer = 
-                typename std::conditional_t<is_const, const value_type *, value_type * >;
-            using reference = 
-                typename std::conditional_t<is_const, const value_type &, value_type & >;
-            using const_pointer = const value_type * ;
-            using const_reference = const value_type & ;
-            using iterator_category = std::bidirectional_iterator_tag;
-            using difference_type = std::ptrdiff_t;
+            return data;
+        }
 
-            // Operator overloads
+        T* end() const
+        {
+            return data + size;
+        }
+    };
 
-            bool operator==(const list_iterator& right)
-            {
-                return _block_pointer == right._block_pointer && _elem_index == right._elem_index && _state == right._state;
-            }
 
-            bool operator!=(const list_iterator& right)
-            {
-                return _block_pointer != right._block_pointer || _elem_index != right._elem_index || _state != right._state;
-            }
+    class log2_histogram
+    {
+        /*
 
-            list_iterator::reference operator*()
-            {
-                if (
-                    (_state == iter_state::iter_valid) && 
-                    (_elem_index < (_block_pointer->capacity()) ) 
-                ) {
-                    return _block_pointer->_arr[_elem_index];
-                }
-                else
-                {
-                    throw std::out_of_range("segmented_list iterator operator*");
-                }
-            }
+        log2_histogram
+        Counts values in power-of-two buckets: bucket 0 holds 0, and bucket i holds [2^(i-1), 2^i)
 
-            list_iterator::const_reference operator*() const
-            {
-                if (
-                    (_state == iter_state::iter_valid) && 
-                    (_elem_index < _block_pointer->capacity() ) 
-                ) {
-                    return _block_pointer->_arr[_elem_index];
-                }
-                else
-                {
-                    throw std::out_of_range("segmented_list iterator operator*");
-                }
-            }
+        */
 
-            list_iterator::pointer operator->()
+        std::array<size_t, 65> _counts;
+    public:
+        static size_t bucket(size_t value) noexcept
+        {
+            size_t b = 0;
+            while (value)
             {
-                if (_state == iter_state::iter_valid && (_elem_index < (_block_pointer->capacity()) ) )
-                {
-                    return &_block_pointer->_arr[_elem_index];
-                }
-                else
-                {
-                    throw std::out_of_range("segmented_list iterator operator->");
-                }
+                b++;
+                value >>= 1;
             }
 
-            list_iterator::const_pointer operator->() const
-            {
-                if (_state == iter_state::iter_valid && (_elem_index < (_block_pointer->capacity()) ) )
-                {
-                    return &_block_pointer->_arr[_elem_index];
-                }
-                else
-                {
-                    throw std::out_of_range("segmented_list iterator operator->");
-                }
-            }
+            return b;
+        }
 
-            list_iterator& operator++()
-            {
-                if (_state == iter_state::iter_valid)
-                {
-                    _elem_index++;
+        static size_t bucket_floor(size_t b) noexcept
+        {
+            // the smallest value counted in bucket 'b'
+            return b == 0 ? 0 : static_cast<size_t>(1) << (b - 1);
+        }
 
-                    // check to see if we need to move to the next block
-                    if (_elem_index == list_block<value_type>::block_size())
-                    {
-                        if (_block_pointer->_next)
-                        {
-                            _elem_index = 0;
-                            _block_pointer = _block_pointer->_next;
-                        }
-                        else
-                        {
-                            _state = iter_state::past_end;
-                        }
-                    }
-                    else if (_elem_index == _block_pointer->size())
-                    {
-                        _state = iter_state::past_end;
-                    }
-                }
-                else
-                {
-                    throw std::out_of_range("segmented_list iterator operator++");
-                }
+        void record(size_t value) noexcept
+        {
+            _counts[bucket(value)]++;
+        }
 
-                return *this;
-            }
+        size_t operator[](size_t b) const noexcept
+        {
+            return _counts[b];
+        }
 
-            list_iterator operator++(int)
-            {
-                list_iterator li { *this };
+        size_t buckets() const noexcept
+        {
+            return _counts.size();
+        }
 
-                if (_state == iter_state::iter_valid)
-                {
-                    _elem_index++;
+        log2_histogram() noexcept
+            : _counts{} { }
+    };
 
-                    // check to see if we need to move to the next block
-                    if (_elem_index == list_block<value_type>::block_size())
-                    {
-                        if (_block_pointer->_next)
-                        {
-                            _elem_index = 0;
-                            _block_pointer = _block_pointer->_next;
-                        }
-                        else
-                        {
-                            _state = iter_state::past_end;
-                        }
-                    }
-                    else if (_elem_index == _block_pointer->size())
-                    {
-                        _state = iter_state::past_end;
-                    }
-                }
-                else
-                {
-                    throw std::out_of_range("segmented_list iterator operator++(int)");
-                }
-                
-                return li;
-            }
 
-            list_iterator& operator--()
-            {
-                if (_state == iter_state::iter_valid)
-                {
-                    if (_elem_index == 0)
-                    {
-                        if (_block_pointer->_previous)
-                        {
-                            _elem_index = list_block<value_type>::block_size() - 1;
-                            _block_pointer = _block_pointer->_previous;
-                        }
-                        else
-                        {
-                            _elem_index = 0;
-                            _state = iter_state::before_begin;
-                        }
-                    }
-                    else
-                    {
-                        _elem_index--;
-                    }
-                }
-                else if (_state == iter_state::past_end)
-                {
-                    _elem_index = _block_pointer->size() - 1;
-                    _state = iter_state::iter_valid;
-                }
-                else
-                {
-                    throw std::out_of_range("segmented_list iterator operator--");
-                }
-                
-                return *this;
-            }
+    // how a list finds the block holding a position (see indexing_policy)
+    enum class index_mode { chain, directory, skip_list, counted_btree, fenwick };
 
-            list_iterator operator--(int)
-            {
-                list_iterator li { *this };
 
-                if (_state == iter_state::iter_valid)
-                {
+    struct indexing_policy
+    {
+        /*
+
+        indexing_policy
+        How a segmented_list finds the block that serves a positional lookup
+
+        'mode' selects the index:
+            * chain -       (the default) Adapt between walking the chain and a block directory, as below
+            * directory -   Build the block directory at once and keep it however small the list gets
+            * skip_list -   Keep express links over the chain (see skip_index)
+            * counted_btree -
+                            Keep a B+-tree over the blocks (see counted_btree)
+            * fenwick -     Keep a directory with a Fenwick tree over the block sizes (see fenwick_index)
+
+        Without a directory, a lookup walks the block chain from the nearer end. The list samples its
+        lookups in windows of 'sample_lookups'; once a window averages 'build_hops' links walked or
+        more, it builds a directory of block pointers, making every lookup a single index. The
+        directory is then kept up to date as blocks come and go, and dropped again when the list
+        shrinks below 'drop_blocks' blocks (which also stops smaller lists from building one).
+
+        Set 'build_hops' to SIZE_MAX never to build a directory, or to 0 to build one as soon as a
+        large enough list has been looked up 'sample_lookups' times.
+
+        Chain walks and the directory rely on every block but the last being full, so insert and
+        erase shift every element after the position. A counted index (skip_list, counted_btree or fenwick) instead finds
+        blocks by the elements they hold, and insert and erase stay within one block: a full block
+        is split in two, and a block that drops below half full is merged with a neighbour if the
+        two fit in one block. The sampling thresholds do not apply to a counted index.
+
+        */
+
+        index_mode mode = index_mode::chain;
+        size_t build_hops = 8;
+        size_t drop_blocks = 16;
+        size_t sample_lookups = 256;
+    };
+
+
+    struct no_instrumentation
+    {
+        /*
+
+        no_instrumentation
+        The default instrumentation policy: every event is an empty inline call, so nothing is recorded or stored
+
+        An instrumentation policy receives these events from segmented_list:
+            * on_lookup(blocks_walked) -    A positional lookup walked 'blocks_walked' links to find its block
+            * on_block_acquired(recycled) - A block was added to the list, either the reserved
+                                            block ('recycled') or a fresh allocation
+            * on_blocks_released(count, reserved) -
+                                            'count' blocks left the list; if 'reserved', the
+                                            block was kept as the reserve instead of being freed
+            * on_elements_moved(count) -    insert or erase shifted 'count' elements
+            * on_index_changed(mode) -      The list started looking blocks up with 'mode'
+
+        */
+
+        void on_lookup(size_t) noexcept { }
+        void on_block_acquired(bool) noexcept { }
+        void on_blocks_released(size_t, bool) noexcept { }
+        void on_elements_moved(size_t) noexcept { }
+        void on_index_changed(index_mode) noexcept { }
+    };
+
+
+    struct list_statistics
+    {
+        /*
+
+        list_statistics
+        An instrumentation policy that counts operations and records how far lookups and shifts go
+
+        Use it to decide whether a workload would benefit from a lookup index or a different block
+        size: long walks in 'lookup_walks' favour an index, and many blocks acquired and released
+        in alternation suggest the block size is too small.
+
+        */
+
+        size_t lookups;
+        size_t blocks_walked;       // the total over all lookups
+        size_t blocks_allocated;    // blocks taken from the allocator
+        size_t blocks_recycled;     // blocks taken from the reserve instead
+        size_t blocks_freed;        // blocks given back to the allocator
+        size_t blocks_reserved;     // emptied blocks kept as the reserve
+        size_t shifts;              // insert and erase calls that moved elements
+        size_t elements_moved;
+        index_mode index;           // how lookups currently find their block
+        size_t index_builds;        // times the block directory or a counted index was built
+        size_t index_drops;         // times the list went back to walking the chain
+
+        log2_histogram lookup_walks;    // blocks walked per lookup
+        log2_histogram shift_moves;     // elements moved per insert or erase
+
+        void on_lookup(size_t walked) noexcept
+        {
+            lookups++;
+            blocks_walked += walked;
+            lookup_walks.record(walked);
+        }
+
+        void on_block_acquired(bool recycled) noexcept
+        {
+            (recycled ? blocks_recycled : blocks_allocated)++;
+        }
+
+        void on_blocks_released(size_t count, bool reserved) noexcept
+        {
+            (reserved ? blocks_reserved : blocks_freed) += count;
+        }
+
+        void on_elements_moved(size_t count) noexcept
+        {
+            shifts++;
+            elements_moved += count;
+            shift_moves.record(count);
+        }
+
+        void on_index_changed(index_mode mode) noexcept
+        {
+            index = mode;
+            (mode == index_mode::chain ? index_drops : index_builds)++;
+        }
+
+        list_statistics() noexcept
+            : lookups(0)
+            , blocks_walked(0)
+            , blocks_allocated(0)
+            , blocks_recycled(0)
+            , blocks_freed(0)
+            , blocks_reserved(0)
+            , shifts(0)
+            , elements_moved(0)
+            , index(index_mode::chain)
+            , index_builds(0)
+            , index_drops(0) { }
+    };
+
+
+    enum class block_event { allocated, recycled, reserved, freed };
+
+
+    struct block_event_hooks
+    {
+        /*
+
+        block_event_hooks
+        An instrumentation policy that reports every change in the blocks a list holds to 'handler'
+
+        The handler is called with the event and the number of blocks involved:
+            * allocated -   A block was taken from the allocator
+            * recycled -    The reserved block was put back into use instead
+            * reserved -    An emptied block was kept as the reserve instead of being freed
+            * freed -       Blocks were given back to the allocator (or handed to the reclaimer)
+
+        Each block occupies sizeof(list_block<T>) bytes, which is what per-tenant accounting
+        should charge. A list whose events alternate between 'reserved' and 'recycled' is
+        oscillating across a block boundary. Leave 'handler' empty to ignore events.
+
+        'allocated' and 'recycled' are reported before the block is taken, so a handler that throws
+        stops the list from growing and leaves it unchanged.
+
+        */
+
+        std::function<void(block_event, size_t)> handler;
+
+        void on_lookup(size_t) noexcept { }
+
+        void on_block_acquired(bool recycled)
+        {
+            if (handler)
+            {
+                handler(recycled ? block_event::recycled : block_event::allocated, 1);
+            }
+        }
+
+        void on_blocks_released(size_t count, bool reserved)
+        {
+            if (handler)
+            {
+                handler(reserved ? block_event::reserved : block_event::freed, count);
+            }
+        }
+
+        void on_elements_moved(size_t) noexcept { }
+        void on_index_changed(index_mode) noexcept { }
+    };
+
+
+    enum class budget_policy { fail, evict_head, callback };
+
+
+    struct memory_budget
+    {
+        /*
+
+        memory_budget
+        A cap on the blocks a segmented_list may hold, and what to do when it would be exceeded
+
+        Both limits apply; a block is charged sizeof(list_block<T>) bytes against 'max_bytes'. Blocks
+        in reserve or pending reclamation count too. When the list needs a block beyond the budget:
+            * fail -        push_back throws budget_exceeded, try_push_back returns false
+            * evict_head -  The first block (and the elements in it) is dropped and reused at the back,
+                            turning the list into a ring of the most recent elements
+            * callback -    'on_exceeded' is called with the bytes held and the bytes wanted; it may
+                            make room elsewhere and return true to allow the block, or false to fail
+
+        */
+
+        size_t max_blocks = SIZE_MAX;
+        size_t max_bytes = SIZE_MAX;
+        budget_policy policy = budget_policy::fail;
+        std::function<bool(size_t, size_t)> on_exceeded;
+    };
+
+
+    class budget_exceeded : public std::length_error
+    {
+        // thrown when a list cannot grow within its memory budget
+    public:
+        budget_exceeded()
+            : std::length_error("segmented_list memory budget exceeded") { }
+    };
+
+
+    struct memory_footprint
+    {
+        /*
+
+        memory_footprint
+        A breakdown of the bytes a segmented_list holds, as returned by 'memory_usage'
+
+        Allocator overhead (malloc headers and rounding) is not included, since the list cannot see it.
+
+        */
+
+        size_t elements;        // live elements
+        size_t slack;           // unused element slots in live blocks
+        size_t block_headers;   // links, counters and padding of live blocks
+        size_t spare_blocks;    // whole blocks held but not in use: the reserve and blocks pending reclamation
+        size_t index;           // lookup structures kept alongside the blocks
+        size_t container;       // the list object itself
+
+        size_t total() const noexcept
+        {
+            return elements + slack + block_headers + spare_blocks + index + container;
+        }
+    };
+
+
+    template<typename T, typename Allocator = std::allocator<list_block<T> >, typename Instrumentation = no_instrumentation>
+    class segmented_list
+    {
+        /*
+
+        segmented_list
+
+        Template parameters:
+            * T -   The contained type
+            * Allocator -    The allocator to use; defaults to allocator<list_block<T>>
+            * Instrumentation -
+                    Receives events about lookups, block allocation and element moves; defaults
+                    to no_instrumentation, which compiles them out (see list_statistics)
+
+        */
+
+        // like a linked list, track head and tail nodes
+        list_block<T>* _head;
+        list_block<T>* _tail;
+        list_block<T>* _reserved;   // keep one block reserved upon a deallocation
+
+        Allocator _allocator;
+
+        size_t _capacity;
+        size_t _size;
+        size_t _num_blocks;
+
+    public:
+        // define how blocks are given back when the list is cleared or destroyed
+        enum reclaim_mode { reclaim_immediate = 0, reclaim_background = 1 };
+
+    private:
+        reclaim_mode _reclaim_mode;
+
+        // identifies this list's checkpoints in an image file; 0 until the first checkpoint
+        uint64_t _checkpoint_id;
+
+        // blocks detached by 'clear_incremental' that 'step' has not yet destroyed
+        list_block<T>* _pending;
+        size_t _pending_blocks;
+
+        // lookups are const, so the policy may be updated from const members
+        mutable Instrumentation _instrumentation;
+
+        // the memory budget, if one was set
+        std::unique_ptr<memory_budget> _budget;
+
+        // lookups are const but may build the directory, so the indexing state is mutable
+        indexing_policy _indexing;
+        mutable index_mode _index_mode;
+
+        // in directory mode, the live blocks in order from '_directory_front'; blocks evicted from the head leave a prefix that is trimmed lazily
+        mutable std::vector<list_block<T>*> _directory;
+        mutable size_t _directory_front;
+
+        // lookups, and the links they walked, since the indexing policy last checked
+        mutable size_t _sampled_lookups;
+        mutable size_t _sampled_hops;
+
+        // the block the last chain walk ended on, and its block number; nullptr when unknown
+        mutable list_block<T>* _finger;
+        mutable size_t _finger_number;
+
+        // the counted index, in skip_list, counted_btree or fenwick mode
+        std::unique_ptr<skip_index<list_block<T> > > _skip_index;
+        std::unique_ptr<counted_btree<list_block<T> > > _btree_index;
+        std::unique_ptr<fenwick_index<list_block<T> > > _fenwick_index;
+
+        static size_t _destroy_chain(Allocator& alloc, list_block<T>*& current, size_t max_blocks = SIZE_MAX)
+        {
+            /*
+
+            _destroy_chain
+            Destroys and deallocates up to 'max_blocks' blocks from 'current' onwards, following the '_next' links
+
+            On return, 'current' points to the first block that was not destroyed (or nullptr if the
+            whole chain is gone). Returns the number of blocks destroyed.
+
+            */
+
+            size_t destroyed = 0;
+            while (current && destroyed < max_blocks)
+            {
+                // get the next block (to save the address)
+                auto next = current->_next;
+                
+                // destroy and deallocate the block
+                std::allocator_traits<Allocator>::destroy(alloc, current);
+                std::allocator_traits<Allocator>::deallocate(alloc, current, 1);
+
+                // update the current block
+                current = next;
+                destroyed++;
+            }
+
+            return destroyed;
+        }
+
+        bool _counted() const noexcept
+        {
+            // whether blocks are found by a counted index, which allows blocks that are not full
+            return _index_mode == index_mode::skip_list || _index_mode == index_mode::counted_btree
+                || _index_mode == index_mode::fenwick;
+        }
+
+        template <typename Visitor>
+        void _visit_index(Visitor visit) const
+        {
+            // calls 'visit' with the counted index in use, if there is one
+            switch (_index_mode)
+            {
+            case index_mode::skip_list:
+                visit(*_skip_index);
+                break;
+            case index_mode::counted_btree:
+                visit(*_btree_index);
+                break;
+            case index_mode::fenwick:
+                visit(*_fenwick_index);
+                break;
+            default:
+                break;
+            }
+        }
+
+        list_block<T>* _detach_blocks(list_block<T>* rest)
+        {
+            /*
+
+            _detach_blocks
+            Unlinks every block (including the reserved one) from the list and returns them as a single chain
+
+            The chain 'rest' is linked after the detached blocks, so the result can be pushed onto an
+            existing chain without walking either one. The list is left empty, with a size and capacity of 0.
+
+            */
+
+            // the blocks are still alive, so the index can let go of them
+            _visit_index([](auto& index) { index.clear(); });
+
+            list_block<T>* chain = rest;
+            if (_head)
+            {
+                _tail->_next = rest;
+                chain = _head;
+            }
+
+            if (_reserved)
+            {
+                _reserved->_next = chain;
+                chain = _reserved;
+            }
+
+            _capacity = 0;
+            _size = 0;
+            _num_blocks = 0;
+
+            _head = nullptr;
+            _tail = nullptr;
+            _reserved = nullptr;
+            _finger = nullptr;
+
+            if (_index_mode == index_mode::directory)
+            {
+                if (_indexing.mode == index_mode::directory)
+                {
+                    _directory.clear();
+                    _directory_front = 0;
+                }
+                else
+                {
+                    _drop_directory();
+                }
+            }
+
+            return chain;
+        }
+
+        void _build_directory() const
+        {
+            /*
+
+            _build_directory
+            Switches to directory mode, recording every live block in order
+
+            */
+
+            _directory.clear();
+            _directory.reserve(_num_blocks);
+            for (auto block = _head; block; block = block->_next)
+            {
+                _directory.push_back(block);
+            }
+
+            _directory_front = 0;
+            _index_mode = index_mode::directory;
+            _instrumentation.on_index_changed(index_mode::directory);
+        }
+
+        void _drop_directory() const noexcept
+        {
+            // switches back to walking the chain, giving back the directory's memory
+            std::vector<list_block<T>*>().swap(_directory);
+            _directory_front = 0;
+            _sampled_lookups = 0;
+            _sampled_hops = 0;
+            _index_mode = index_mode::chain;
+            _instrumentation.on_index_changed(index_mode::chain);
+        }
+
+        void _sample_lookup(size_t walked) const
+        {
+            /*
+
+            _sample_lookup
+            Counts a lookup that walked the chain, building the directory if the policy calls for it
+
+            */
+
+            _sampled_hops += walked;
+            if (++_sampled_lookups < _indexing.sample_lookups)
+            {
+                return;
+            }
+
+            if (_sampled_hops / _sampled_lookups >= _indexing.build_hops && _num_blocks >= _indexing.drop_blocks)
+            {
+                _build_directory();
+            }
+
+            _sampled_lookups = 0;
+            _sampled_hops = 0;
+        }
+
+        void _evict_head()
+        {
+            /*
+
+            _evict_head
+            Unlinks the first block, dropping its elements, and keeps it as the reserved block
+
+            The reserve must be empty.
+
+            */
+
+            auto evicted = _head;
+            _visit_index([evicted](auto& index) { index.erased(evicted); });
+
+            if (_finger == evicted)
+            {
+                _finger = nullptr;
+            }
+            _finger_number--;
+
+            _head = evicted->_next;
+            if (_head)
+            {
+                _head->_previous = nullptr;
+            }
+            else
+            {
+                _tail = nullptr;
+            }
+
+            _size -= evicted->_size;
+            _capacity -= list_block<T>::block_size();
+            _num_blocks--;
+
+            evicted->_next = nullptr;
+            evicted->_size = 0;
+            _reserved = evicted;
+
+            if (_index_mode == index_mode::directory)
+            {
+                // trim the evicted prefix once it outweighs the live entries, so a ring list stays amortized O(1)
+                if (++_directory_front * 2 > _directory.size())
+                {
+                    _directory.erase(_directory.begin(), _directory.begin() + _directory_front);
+                    _directory_front = 0;
+                }
+            }
+
+            _instrumentation.on_blocks_released(1, true);
+        }
+
+        bool _within_budget(bool may_evict)
+        {
+            /*
+
+            _within_budget
+            Returns whether one more block may be allocated, applying the budget policy if it may not
+
+            If 'may_evict' is false, evict_head is treated as fail; only appends may drop elements.
+
+            */
+
+            auto limit = _budget->max_blocks;
+            if (_budget->max_bytes / sizeof(list_block<T>) < limit)
+            {
+                limit = _budget->max_bytes / sizeof(list_block<T>);
+            }
+
+            if (_num_blocks + _pending_blocks < limit)
+            {
+                return true;
+            }
+
+            // blocks pending reclamation are going anyway, so they are given back first
+            if (_pending_blocks)
+            {
+                step(_pending_blocks);
+                if (_num_blocks < limit)
+                {
+                    return true;
+                }
+            }
+
+            switch (_budget->policy)
+            {
+            case budget_policy::evict_head:
+                if (may_evict && _num_blocks)
+                {
+                    _evict_head();
+                    return true;
+                }
+                return false;
+            case budget_policy::callback:
+                return _budget->on_exceeded && _budget->on_exceeded(_num_blocks * sizeof(list_block<T>), sizeof(list_block<T>));
+            default:
+                return false;
+            }
+        }
+
+        void _alloc_block(bool may_evict = false, list_block<T>* after = nullptr)
+        {
+            // throws budget_exceeded if the budget leaves no room for the block
+            if (!_try_alloc_block(may_evict, after))
+            {
+                SEGMENTED_LIST_THROW(budget_exceeded());
+            }
+        }
+
+        bool _try_alloc_block(bool may_evict, list_block<T>* after = nullptr)
+        {
+            /*
+
+            _try_alloc_block
+            Adds a new empty block to the list, after the block 'after' or, if that is nullptr, at the end
+
+            May perform an allocation if necessary. However, if there is a reserved block, it will utilize that.
+            Returns false, leaving the list unchanged, if the memory budget does not allow another block.
+            Only a counted index allows blocks to be added anywhere but the end.
+            
+            */
+
+            // the reserve is already paid for; anything else is checked against the budget
+            if (_budget && !_reserved && !_within_budget(may_evict))
+            {
+                return false;
+            }
+
+            // reported before the list changes, so a hook that throws vetoes the allocation
+            bool recycling = _reserved != nullptr;
+            _instrumentation.on_block_acquired(recycling);
+
+            // make room in the directory first, so that nothing can fail once the block is linked;
+            // the slot itself is only added then, so a failed allocation leaves no empty entry
+            if (_index_mode == index_mode::directory && _directory.size() == _directory.capacity())
+            {
+                _directory.reserve(_directory.size() * 2 + 1);
+            }
+
+            auto previous = after ? after : _tail;
+            list_block<T>* block;
+            if (recycling)
+            {
+                // take the reserved block; it no longer owns a checkpoint slot
+                block = _reserved;
+                _reserved = nullptr;
+
+                block->_size = 0;
+                block->_dirty = true;
+                block->_slot = list_block<T>::no_slot;
+            }
+            else
+            {
+                // allocates a new block
+                block = std::allocator_traits<Allocator>::allocate(_allocator, 1);
+                std::allocator_traits<Allocator>::construct(_allocator, block, previous);
+            }
+
+            // update the relationships
+            block->_previous = previous;
+            block->_next = previous ? previous->_next : nullptr;
+            if (block->_next)
+            {
+                block->_next->_previous = block;
+            }
+            else
+            {
+                _tail = block;
+            }
+
+            if (previous)
+            {
+                previous->_next = block;
+            }
+            else
+            {
+                _head = block;
+            }
+
+            _capacity += list_block<T>::block_size();
+            _num_blocks++;
+
+            if (_index_mode == index_mode::directory)
+            {
+                _directory.push_back(_tail);
+            }
+
+#ifdef SEGMENTED_LIST_EXCEPTIONS
+            try
+#endif
+            {
+                _visit_index([block](auto& index) { index.inserted(block); });
+            }
+#ifdef SEGMENTED_LIST_EXCEPTIONS
+            catch (...)
+            {
+                // the index could not take the block in; it is still empty, so it is simply given back
+                _release_block(block);
+                throw;
+            }
+#endif
+
+            return true;
+        }
+    
+        
+    public:
+        // define our iterator states (valid/invalid)
+        enum iter_state { iter_valid = 0, before_begin = 1, past_end = 2 };
+
+        // define the iterator class
+        template <bool is_const = false>
+        class list_iterator
+        {
+        public:
+            using value_type = T;
+            using pointer = 
+                typename std::conditional_t<is_const, const value_type *, value_type * >;
+            using reference = 
+                typename std::conditional_t<is_const, const value_type &, value_type & >;
+            using const_pointer = const value_type * ;
+            using const_reference = const value_type & ;
+            using iterator_category = std::bidirectional_iterator_tag;
+            using difference_type = std::ptrdiff_t;
+
+            // Operator overloads
+
+            bool operator==(const list_iterator& right) const
+            {
+                return _block_pointer == right._block_pointer && _elem_index == right._elem_index && _state == right._state;
+            }
+
+            bool operator!=(const list_iterator& right) const
+            {
+                return _block_pointer != right._block_pointer || _elem_index != right._elem_index || _state != right._state;
+            }
+
+            list_iterator::reference operator*()
+            {
+                SEGMENTED_LIST_CHECK_BOUNDS(_state == iter_state::iter_valid && _elem_index < _block_pointer->capacity(),
+                    "segmented_list iterator operator*");
+
+                if (!is_const)
+                {
+                    // writes through a mutable iterator must be picked up by the next checkpoint
+                    _block_pointer->_dirty = true;
+                }
+
+                return _block_pointer->_arr[_elem_index];
+            }
+
+            list_iterator::const_reference operator*() const
+            {
+                SEGMENTED_LIST_CHECK_BOUNDS(_state == iter_state::iter_valid && _elem_index < _block_pointer->capacity(),
+                    "segmented_list iterator operator*");
+
+                return _block_pointer->_arr[_elem_index];
+            }
+
+            list_iterator::pointer operator->()
+            {
+                SEGMENTED_LIST_CHECK_BOUNDS(_state == iter_state::iter_valid && _elem_index < _block_pointer->capacity(),
+                    "segmented_list iterator operator->");
+
+                if (!is_const)
+                {
+                    _block_pointer->_dirty = true;
+                }
+
+                return &_block_pointer->_arr[_elem_index];
+            }
+
+            list_iterator::const_pointer operator->() const
+            {
+                SEGMENTED_LIST_CHECK_BOUNDS(_state == iter_state::iter_valid && _elem_index < _block_pointer->capacity(),
+                    "segmented_list iterator operator->");
+
+                return &_block_pointer->_arr[_elem_index];
+            }
+
+            list_iterator& operator++()
+            {
+                SEGMENTED_LIST_CHECK_BOUNDS(_state == iter_state::iter_valid, "segmented_list iterator operator++");
+
+                if (_state == iter_state::iter_valid)
+                {
+                    _elem_index++;
+
+                    // check to see if we need to move to the next block
+                    if (_elem_index == _block_pointer->size())
+                    {
+                        if (_block_pointer->_next)
+                        {
+                            _elem_index = 0;
+                            _block_pointer = _block_pointer->_next;
+                        }
+                        else
+                        {
+                            _state = iter_state::past_end;
+                        }
+                    }
+                }
+
+                return *this;
+            }
+
+            list_iterator operator++(int)
+            {
+                list_iterator li { *this };
+
+                SEGMENTED_LIST_CHECK_BOUNDS(_state == iter_state::iter_valid, "segmented_list iterator operator++(int)");
+
+                if (_state == iter_state::iter_valid)
+                {
+                    _elem_index++;
+
+                    // check to see if we need to move to the next block
+                    if (_elem_index == _block_pointer->size())
+                    {
+                        if (_block_pointer->_next)
+                        {
+                            _elem_index = 0;
+                            _block_pointer = _block_pointer->_next;
+                        }
+                        else
+                        {
+                            _state = iter_state::past_end;
+                        }
+                    }
+                }
+                
+                return li;
+            }
+
+            list_iterator& operator--()
+            {
+                SEGMENTED_LIST_CHECK_BOUNDS(_state != iter_state::before_begin, "segmented_list iterator operator--");
+
+                if (_state == iter_state::iter_valid)
+                {
+                    if (_elem_index == 0)
+                    {
+                        if (_block_pointer->_previous)
+                        {
+                            _block_pointer = _block_pointer->_previous;
+                            _elem_index = _block_pointer->size() - 1;
+                        }
+                        else
+                        {
+                            _elem_index = 0;
+                            _state = iter_state::before_begin;
+                        }
+                    }
+                    else
+                    {
+                        _elem_index--;
+                    }
+                }
+                else if (_state == iter_state::past_end)
+                {
+                    _elem_index = _block_pointer->size() - 1;
+                    _state = iter_state::iter_valid;
+                }
+                
+                return *this;
+            }
+
+            list_iterator operator--(int)
+            {
+                list_iterator li { *this };
+
+                SEGMENTED_LIST_CHECK_BOUNDS(_state != iter_state::before_begin, "segmented_list iterator operator--(int)");
+
+                if (_state == iter_state::iter_valid)
+                {
                     if (_elem_index == 0)
                     {
-                        if (_block_pointer->_previous)
-                        {
-                            _elem_index = list_block<value_type>::block_size() - 1;
-                            _block_pointer = _block_pointer->_previous;
-                        }
-                        else
-                        {
-                            _elem_index = 0;
-                            _state = iter_state::before_begin;
-                        }
+                        if (_block_pointer->_previous)
+                        {
+                            _block_pointer = _block_pointer->_previous;
+                            _elem_index = _block_pointer->size() - 1;
+                        }
+                        else
+                        {
+                            _elem_index = 0;
+                            _state = iter_state::before_begin;
+                        }
+                    }
+                    else
+                    {
+                        _elem_index--;
+                    }
+                }
+                else if (_state == iter_state::past_end)
+                {
+                    _elem_index = _block_pointer->size() - 1;
+                    _state = iter_state::iter_valid;
+                }
+
+                return li;
+            }
+
+            template<bool _is_const = is_const,
+                typename std::enable_if<_is_const, int>::type = 1>
+            list_iterator& operator=(const list_iterator<false>& it)
+            {
+                // converting copy assignment operator
+                _block_pointer = it._block_pointer;
+                _elem_index = it._elem_index;
+                _state = it._state;
+                return *this;
+            }
+
+            template<bool _is_const = is_const,
+                typename std::enable_if<_is_const, int>::type = 1>
+            list_iterator& operator=(list_iterator<false>&& it)
+            {
+                // converting move assignment operator
+                _block_pointer = it._block_pointer;
+                _elem_index = it._elem_index;
+                _state = it._state;
+                
+                it._block_pointer = nullptr;
+                it._elem_index = 0;
+                return *this;
+            }
+
+            list_iterator& operator=(const list_iterator& it)
+            {
+                // default copy assignment operator
+                _block_pointer = it._block_pointer;
+                _elem_index = it._elem_index;
+                _state = it._state;
+                return *this;
+            }
+
+            list_iterator& operator=(list_iterator&& it)
+            {
+                // default move assignment operator
+                _block_pointer = it._block_pointer;
+                _elem_index = it._elem_index;
+                _state = it._state;
+                
+                it._block_pointer = nullptr;
+                it._elem_index = 0;
+                return *this;
+            }
+
+            // Constructors
+
+            list_iterator() noexcept
+                : _block_pointer(nullptr)
+                , _elem_index(0)
+                , _state(iter_state::before_begin) {}
+
+            list_iterator(const list_iterator& it)
+                : _block_pointer(it._block_pointer)
+                , _elem_index(it._elem_index)
+                , _state(it._state)
+            {
+                // default copy constructor
+            }
+
+            list_iterator(list_iterator&& it)
+                : _block_pointer(it._block_pointer)
+                , _elem_index(it._elem_index)
+                , _state(it._state)
+            {
+                // default move constructor
+                it._block_pointer = nullptr;
+                it._elem_index = 0;
+            }
+
+            template<bool _is_const = is_const,
+                typename std::enable_if<_is_const, int>::type = 1>
+            list_iterator(const list_iterator<false>& it)
+                : _block_pointer(it._block_pointer)
+                , _elem_index(it._elem_index)
+                , _state(it._state)
+            {
+                // converting copy constructor
+            }
+
+            template<bool _is_const = is_const,
+                typename std::enable_if<_is_const, int>::type = 1>
+            list_iterator(list_iterator<false>&& it)
+                : _block_pointer(it._block_pointer)
+                , _elem_index(it._elem_index)
+                , _state(it._state)
+            {
+                // converting move constructor
+                it._block_pointer = nullptr;
+                it._elem_index = 0;
+            }
+        
+        private:
+            friend class segmented_list;    // ensure the parent class is a friend
+            template <bool> friend class list_iterator;     // const iterators are converted from mutable ones
+            iter_state _state;
+
+            list_block<value_type>* _block_pointer;  // pointer to the block we are in
+            size_t _elem_index; // index within the block
+
+            list_iterator(list_block<value_type>* p, size_t idx, iter_state state)
+                : _block_pointer(p)
+                , _elem_index(idx)
+                , _state(state)
+            {
+                // private constructor
+            }
+        };
+
+        // define our class traits
+        using value_type = T;
+        using reference = T & ;
+        using pointer = T * ;
+        using const_reference = const T & ;
+        using const_pointer = const T * ;
+        using size_type = size_t;
+        using allocator_type = Allocator;
+    
+    private:
+        list_block<T>* _block_at(size_type pos, size_type& offset) const
+        {
+            /*
+
+            _block_at
+            Returns the block containing the element at the specified position, setting 'offset' to its index in the block
+
+            Throws out_of_range if 'pos' is not a valid position (see SEGMENTED_LIST_ASSERT_BOUNDS).
+
+            */
+
+            SEGMENTED_LIST_CHECK_BOUNDS(pos < _size, "segmented_list");
+            return _find_block(pos, offset);
+        }
+
+        list_block<T>* _find_block(size_type pos, size_type& offset) const
+        {
+            /*
+
+            _find_block
+            Returns the block containing the element at the specified position, which must be less than the size
+
+            'offset' is set to the element's index in the block. The algorithm is as follows:
+                * Divide the index (pos) by the capacity of the block
+                * This will indicate the block number we need, and the remainder the offset
+                * Iterate through blocks until we find the proper one
+
+            Every block but the last is full, so the walk cannot run off either end. In directory
+            mode (see indexing_policy), the block is looked up in the directory instead, and with a
+            counted index, the index finds both the block and the offset.
+
+            */
+
+            if (_counted())
+            {
+                list_block<T>* block = nullptr;
+                size_t walked = 0;
+                _visit_index([&](auto& index) { block = index.find(pos, offset, walked); });
+                _instrumentation.on_lookup(walked);
+                return block;
+            }
+
+            // get the block number
+            auto block_number = pos / list_block<value_type>::block_size();
+            offset = pos % list_block<value_type>::block_size();
+
+            if (_index_mode == index_mode::directory)
+            {
+                _instrumentation.on_lookup(0);
+                return _directory[_directory_front + block_number];
+            }
+
+            /*
+
+            Get the proper node
+
+            The walk starts from whichever of the head, the tail and the finger (the block found by
+            the previous lookup) is nearest, and goes forwards or backwards from there. Sequential
+            and nearby lookups therefore walk at most a link or two.
+
+            */
+
+            auto distance = [block_number](size_t from) {
+                return from < block_number ? block_number - from : from - block_number;
+            };
+
+            auto current_node = _head;
+            size_t current_number = 0;
+            if (distance(_num_blocks - 1) < block_number)
+            {
+                current_node = _tail;
+                current_number = _num_blocks - 1;
+            }
+
+            if (_finger && distance(_finger_number) < distance(current_number))
+            {
+                current_node = _finger;
+                current_number = _finger_number;
+            }
+
+            size_t walked = distance(current_number);
+            for (; current_number < block_number; current_number++)
+            {
+                current_node = current_node->_next;
+            }
+            for (; current_number > block_number; current_number--)
+            {
+                current_node = current_node->_previous;
+            }
+
+            _finger = current_node;
+            _finger_number = block_number;
+
+            _instrumentation.on_lookup(walked);
+            _sample_lookup(walked);
+            return current_node;
+        }
+
+        constexpr reference _at(size_type pos) const
+        {
+            /*
+
+            _at
+            Returns the element at the specified position
+
+            Finds the containing block with '_block_at', then indexes its array with the offset
+            found along with it.
+            
+            The function will then return a reference. For const objects, this will be a
+            const_reference.
+
+            */
+
+            // '_block_at' checks the position
+            size_type offset = 0;
+            auto containing_node = _block_at(pos, offset);
+            return containing_node->_arr[offset];
+        }
+
+        reference _at_mutable(size_type pos)
+        {
+            /*
+
+            _at_mutable
+            Like '_at', but marks the containing block dirty, since the caller may write through the reference
+
+            */
+
+            size_type offset;
+            auto containing_node = _block_at(pos, offset);
+            containing_node->_dirty = true;
+            return containing_node->_arr[offset];
+        }
+
+        std::vector<size_type> _resolve_batch(const size_type* positions, size_type count, std::vector<T*>& elements, bool writing) const
+        {
+            /*
+
+            _resolve_batch
+            Finds the elements at a batch of positions, visiting each block they touch once
+
+            Returns the batch's slots sorted by position (equal positions keep their order), and
+            fills 'elements' with the element for each slot in that same order. The positions are
+            all checked before any block is looked up. Blocks are reached by following '_next' when
+            the next position is in the following block, and looked up with '_find_block' when it
+            is further on (or always, with the directory), so a dense batch walks the chain once and
+            a sparse one uses the index. When 'writing', every block touched is marked dirty.
+
+            */
+
+            for (size_type i = 0; i < count; i++)
+            {
+                SEGMENTED_LIST_CHECK_BOUNDS(positions[i] < _size, "segmented_list");
+            }
+
+            /*
+
+            Sort the positions alongside their slots. They are first bucketed by position, about
+            one per bucket, which leaves only short runs to sort; the runs are contiguous, unlike a
+            sort of the slots alone that compares through 'positions'.
+
+            */
+
+            std::vector<std::pair<size_type, size_type> > sorted(count);
+            if (std::is_sorted(positions, positions + count))
+            {
+                for (size_type i = 0; i < count; i++)
+                {
+                    sorted[i] = { positions[i], i };
+                }
+            }
+            else
+            {
+                auto width = _size / count + 1;     // the positions per bucket
+                std::vector<size_type> starts(_size / width + 2);
+                for (size_type i = 0; i < count; i++)
+                {
+                    starts[positions[i] / width + 1]++;
+                }
+
+                for (size_type b = 1; b < starts.size(); b++)
+                {
+                    starts[b] += starts[b - 1];
+                }
+
+                for (size_type i = 0; i < count; i++)
+                {
+                    sorted[starts[positions[i] / width]++] = { positions[i], i };
+                }
+
+                // each bucket's entries now end where the next bucket's begin
+                size_type begin = 0;
+                for (auto end : starts)
+                {
+                    if (end - begin > 1)
+                    {
+                        std::sort(sorted.begin() + begin, sorted.begin() + end);
+                    }
+
+                    begin = end;
+                }
+            }
+
+            // without a counted index, every block but the last is full, so a block's span is
+            // known without reading it; with the directory, a lookup never reads a block at all
+            auto counted = _counted();
+            auto follow = _index_mode != index_mode::directory;
+            auto span = [counted](const list_block<T>* block) {
+                return counted ? block->size() : list_block<T>::block_size();
+            };
+
+            std::vector<size_type> order(count);
+            elements.resize(count);
+            list_block<T>* block = nullptr;
+            size_type first = 0;    // the position of the block's first element
+            for (size_type i = 0; i < count; i++)
+            {
+                auto pos = sorted[i].first;
+                if (!block || pos >= first + span(block))
+                {
+                    if (follow && block && block->_next && pos < first + span(block) + span(block->_next))
+                    {
+                        first += span(block);
+                        block = block->_next;
+                    }
+                    else
+                    {
+                        size_type offset = 0;
+                        block = _find_block(pos, offset);
+                        first = pos - offset;
+                    }
+
+                    SEGMENTED_LIST_PREFETCH(block->_next, 0);
+                    if (writing)
+                    {
+                        block->_dirty = true;
+                    }
+                }
+
+                elements[i] = &block->_arr[pos - first];
+                order[i] = sorted[i].second;
+            }
+
+            return order;
+        }
+
+        void _release_block(list_block<T>* block)
+        {
+            /*
+
+            _release_block
+            Unlinks an emptied block from the list, keeping it as the reserve or giving it back to the allocator
+
+            Only a counted index allows a block other than the last to be released.
+
+            */
+
+            _visit_index([block](auto& index) { index.erased(block); });
+
+            if (block->_previous)
+            {
+                block->_previous->_next = block->_next;
+            }
+            else
+            {
+                _head = block->_next;
+            }
+
+            if (block->_next)
+            {
+                block->_next->_previous = block->_previous;
+            }
+            else
+            {
+                _tail = block->_previous;
+            }
+
+            if (_finger == block)
+            {
+                _finger = nullptr;
+            }
+
+            // if we have a block reserved already, deallocate this block
+            // otherwise, use _this_ block as our block in reserve
+            bool reserving = _reserved == nullptr;
+            if (!reserving)
+            {
+                // destroy and deallocate
+                std::allocator_traits<Allocator>::destroy(_allocator, block);
+                std::allocator_traits<Allocator>::deallocate(_allocator, block, 1);
+            }
+            else
+            {
+                // set this node as our reserve node
+                _reserved = block;
+                _reserved->_previous = nullptr;
+                _reserved->_next = nullptr;
+                _reserved->_size = 0;
+            }
+
+            // update the capacity
+            _capacity -= list_block<T>::block_size();
+            _num_blocks--;
+
+            if (_index_mode == index_mode::directory)
+            {
+                _directory.pop_back();
+                if (_num_blocks < _indexing.drop_blocks && _indexing.mode != index_mode::directory)
+                {
+                    _drop_directory();
+                }
+            }
+
+            _instrumentation.on_blocks_released(1, reserving);
+        }
+
+        void _pop_back()
+        {
+            /*
+
+            _pop_back
+            Removes the last element; the list must not be empty
+
+            */
+
+            // decrease the _tail size
+            _tail->_size -= 1;
+            _size--;
+            _visit_index([this](auto& index) { index.resized(_tail, -1); });
+
+            // if the size is zero, release the block
+            if (_tail->_size == 0)
+            {
+                _release_block(_tail);
+            }
+        }
+
+        size_t _merge_blocks(list_block<T>* into, list_block<T>* from)
+        {
+            /*
+
+            _merge_blocks
+            Moves every element of 'from' to the end of 'into', which it follows, and releases 'from'
+
+            The elements must fit. Returns the number of elements moved.
+
+            */
+
+            auto count = from->_size;
+            for (size_t i = 0; i < count; i++)
+            {
+                into->_arr[into->_size + i] = std::move(from->_arr[i]);
+            }
+
+            into->_size += count;
+            into->_dirty = true;
+            from->_size = 0;
+
+            auto delta = static_cast<std::ptrdiff_t>(count);
+            _visit_index([into, from, delta](auto& index) {
+                index.resized(into, delta);
+                index.resized(from, -delta);
+            });
+
+            _release_block(from);
+            return count;
+        }
+
+        list_iterator<false> _insert_local(list_block<T>* target, size_t target_index, T&& value)
+        {
+            /*
+
+            _insert_local
+            Inserts 'value' at 'target_index' in 'target', first splitting the block in two if it is full
+
+            Only a counted index allows the blocks that this leaves partially filled.
+
+            */
+
+            const auto block_size = list_block<T>::block_size();
+            size_t moved = 0;
+
+            if (target->full())
+            {
+                // the upper half moves to a new block after 'target'; growing in the middle never evicts
+                _alloc_block(false, target);
+                auto split = target->_next;
+                auto half = block_size / 2;
+                for (size_t i = half; i < block_size; i++)
+                {
+                    split->_arr[i - half] = std::move(target->_arr[i]);
+                }
+
+                split->_size = block_size - half;
+                target->_size = half;
+                split->_dirty = true;
+                target->_dirty = true;
+                moved += block_size - half;
+
+                auto delta = static_cast<std::ptrdiff_t>(block_size - half);
+                _visit_index([target, split, delta](auto& index) {
+                    index.resized(target, -delta);
+                    index.resized(split, delta);
+                });
+
+                if (target_index > half)
+                {
+                    target = split;
+                    target_index -= half;
+                }
+            }
+
+            for (auto i = target->_size; i > target_index; i--)
+            {
+                target->_arr[i] = std::move(target->_arr[i - 1]);
+            }
+            moved += target->_size - target_index;
+
+            target->_arr[target_index] = std::move(value);
+            target->_size++;
+            target->_dirty = true;
+            _size++;
+            _visit_index([target](auto& index) { index.resized(target, 1); });
+
+            _instrumentation.on_elements_moved(moved);
+            return list_iterator<false>(target, target_index, iter_state::iter_valid);
+        }
+
+        list_iterator<false> _erase_local(list_block<T>* block, size_t offset)
+        {
+            /*
+
+            _erase_local
+            Removes the element at 'offset' in 'block', returning an iterator to the element after it
+
+            A block left empty is released. One left less than half full is merged with the next
+            block, or else the previous one, if the two fit in one block. Only a counted index
+            allows the blocks that this leaves partially filled.
+
+            */
+
+            for (auto i = offset + 1; i < block->_size; i++)
+            {
+                block->_arr[i - 1] = std::move(block->_arr[i]);
+            }
+            size_t moved = block->_size - offset - 1;
+
+            block->_size--;
+            block->_dirty = true;
+            _size--;
+            _visit_index([block](auto& index) { index.resized(block, -1); });
+
+            if (block->_size == 0)
+            {
+                auto next = block->_next;
+                _instrumentation.on_elements_moved(moved);
+                _release_block(block);
+                return next ? list_iterator<false>(next, 0, iter_state::iter_valid) : end();
+            }
+
+            if (block->_size * 2 < list_block<T>::block_size())
+            {
+                auto next = block->_next;
+                auto previous = block->_previous;
+                if (next && block->_size + next->_size <= list_block<T>::block_size())
+                {
+                    moved += _merge_blocks(block, next);
+                }
+                else if (previous && previous->_size + block->_size <= list_block<T>::block_size())
+                {
+                    offset += previous->_size;
+                    moved += _merge_blocks(previous, block);
+                    block = previous;
+                }
+            }
+
+            _instrumentation.on_elements_moved(moved);
+
+            if (offset < block->_size)
+            {
+                return list_iterator<false>(block, offset, iter_state::iter_valid);
+            }
+
+            return block->_next ? list_iterator<false>(block->_next, 0, iter_state::iter_valid) : end();
+        }
+
+        void _compact()
+        {
+            /*
+
+            _compact
+            Moves elements towards the front so that every block but the last is full, releasing the blocks this empties
+
+            Chain walks and the directory depend on full blocks. Takes time proportional to the size.
+
+            */
+
+            if (!_head)
+            {
+                return;
+            }
+
+            // 'write' never passes 'read', so a block is only resized once it has been read
+            auto write = _head;
+            size_t write_index = 0;
+            size_t moved = 0;
+            for (auto read = _head; read; read = read->_next)
+            {
+                for (size_t i = 0; i < read->_size; i++)
+                {
+                    if (write_index == list_block<T>::block_size())
+                    {
+                        write->_size = write_index;
+                        write = write->_next;
+                        write_index = 0;
+                    }
+
+                    if (write != read || write_index != i)
+                    {
+                        write->_arr[write_index] = std::move(read->_arr[i]);
+                        write->_dirty = true;
+                        moved++;
+                    }
+
+                    write_index++;
+                }
+            }
+
+            write->_size = write_index;
+            while (_tail != write)
+            {
+                _tail->_size = 0;
+                _release_block(_tail);
+            }
+
+            if (moved)
+            {
+                _instrumentation.on_elements_moved(moved);
+            }
+        }
+
+        void _use_counted_index(index_mode mode)
+        {
+            /*
+
+            _use_counted_index
+            Builds the counted index for 'mode' over the current blocks and switches to it
+
+            The list is unchanged if building the index throws.
+
+            */
+
+            if (mode == index_mode::skip_list)
+            {
+                std::unique_ptr<skip_index<list_block<T> > > index(new skip_index<list_block<T> >());
+                index->build(_head);
+                _skip_index = std::move(index);
+            }
+            else if (mode == index_mode::counted_btree)
+            {
+                std::unique_ptr<counted_btree<list_block<T> > > index(new counted_btree<list_block<T> >());
+                index->build(_head);
+                _btree_index = std::move(index);
+            }
+            else
+            {
+                std::unique_ptr<fenwick_index<list_block<T> > > index(new fenwick_index<list_block<T> >());
+                index->build(_head);
+                _fenwick_index = std::move(index);
+            }
+
+            if (_index_mode == index_mode::directory)
+            {
+                _drop_directory();
+            }
+
+            _finger = nullptr;
+            _index_mode = mode;
+            _instrumentation.on_index_changed(mode);
+        }
+
+        void _drop_counted_index()
+        {
+            // switches back to walking the chain, compacting the blocks since it needs them full
+            _skip_index.reset();
+            _btree_index.reset();
+            _fenwick_index.reset();
+            _index_mode = index_mode::chain;
+            _compact();
+            _instrumentation.on_index_changed(index_mode::chain);
+        }
+
+#ifdef SEGMENTED_LIST_POSIX_IO
+        io::stream_header _stream_header() const noexcept
+        {
+            io::stream_header header;
+            header.element_size = sizeof(T);
+            header.element_count = _size;
+            return header;
+        }
+
+        size_t _begin_stream(int fd)
+        {
+            /*
+
+            _begin_stream
+            Clears the list, then reads and checks the stream header at the current offset of 'fd'
+
+            Returns the number of elements the stream holds.
+
+            */
+
+            clear();
+
+            io::stream_header header;
+            iovec header_iov{ &header, sizeof(header) };
+            io::readv_fully(fd, &header_iov, 1);
+
+            if (!header.valid(sizeof(T)))
+            {
+                SEGMENTED_LIST_THROW(std::runtime_error("segmented_list read_from: incompatible stream"));
+            }
+
+            return header.element_count;
+        }
+
+        void _alloc_stream_blocks(size_t count)
+        {
+            // appends full blocks, and a partial last one, sized to hold 'count' elements; the caller fills them
+            while (count > 0)
+            {
+                _alloc_block();
+                auto in_block = count < list_block<T>::block_size() ? count : list_block<T>::block_size();
+                _tail->_size = in_block;
+                _size += in_block;
+                count -= in_block;
+                _visit_index([this, in_block](auto& index) { index.resized(_tail, static_cast<std::ptrdiff_t>(in_block)); });
+            }
+        }
+
+        template <typename WriteBlocks>
+        void _checkpoint_incremental(int fd, WriteBlocks write_blocks)
+        {
+            /*
+
+            _checkpoint_incremental
+            Does the work of 'checkpoint_incremental', passing the changed blocks to 'write_blocks'
+
+            */
+
+            static_assert(std::is_trivially_copyable<T>::value, "segmented_list::checkpoint_incremental requires a trivially copyable T");
+
+            const auto no_slot = list_block<T>::no_slot;
+
+            io::image_layout<T> layout;
+            auto& header = layout.header;
+            header.element_size = sizeof(T);
+            header.block_size = list_block<T>::block_size();
+            header.element_count = _size;
+            header.block_count = _num_blocks;
+            header.page_size = io::page_size();
+            header.directory_offset = sizeof(io::image_header);
+
+            auto block_bytes = header.block_size * sizeof(T);
+            header.slot_size = io::round_up(block_bytes, io::image_slot_alignment(block_bytes, header.page_size));
+
+            // find out whether the file holds our last checkpoint
+            io::image_header existing;
+            auto got = ::pread(fd, &existing, sizeof(existing), 0);
+            bool incremental = got == static_cast<ssize_t>(sizeof(existing))
+                && _checkpoint_id != 0
+                && existing.checkpoint_id == _checkpoint_id
+                && existing.element_size == header.element_size
+                && existing.block_size == header.block_size
+                && existing.page_size == header.page_size
+                && existing.slot_size == header.slot_size
+                && existing.data_offset > header.directory_offset
+                && existing.data_offset <= existing.file_size;
+
+            // the two directory areas split the room before the payloads
+            auto directory_capacity = incremental
+                ? (existing.data_offset - header.directory_offset) / 2 / sizeof(io::image_block_entry)
+                : 0;
+            auto other_directory = header.directory_offset + directory_capacity * sizeof(io::image_block_entry);
+
+            struct stat st;
+            incremental = incremental
+                && (existing.directory_offset == header.directory_offset || existing.directory_offset == other_directory)
+                && existing.block_count <= directory_capacity
+                && _num_blocks <= directory_capacity
+                && ::fstat(fd, &st) == 0
+                && existing.file_size <= static_cast<uint64_t>(st.st_size);
+
+            // the slots the committed directory refers to must survive until a new one replaces it
+            size_t slot_count = 0;
+            std::vector<bool> committed;
+            if (incremental)
+            {
+                slot_count = (existing.file_size - existing.data_offset) / header.slot_size;
+                committed.assign(slot_count, false);
+
+                std::vector<io::image_block_entry> directory(existing.block_count);
+                iovec directory_iov{ directory.data(), directory.size() * sizeof(io::image_block_entry) };
+                io::preadv_fully(fd, &directory_iov, 1, static_cast<off_t>(existing.directory_offset));
+
+                incremental = io::image_checksum(existing, directory.data()) == existing.checksum;
+                for (size_t i = 0; incremental && i < directory.size(); i++)
+                {
+                    auto offset = directory[i].offset;
+                    incremental = offset >= existing.data_offset
+                        && (offset - existing.data_offset) % header.slot_size == 0
+                        && (offset - existing.data_offset) / header.slot_size < slot_count;
+
+                    if (incremental)
+                    {
+                        committed[(offset - existing.data_offset) / header.slot_size] = true;
+                    }
+                }
+            }
+
+            if (incremental)
+            {
+                header.data_offset = existing.data_offset;
+                header.directory_offset = existing.directory_offset == header.directory_offset ? other_directory : header.directory_offset;
+            }
+            else
+            {
+                // start over; reserve two directories with room for the list to double before another full rewrite
+                std::random_device rd;
+                _checkpoint_id = (static_cast<uint64_t>(rd()) << 32) | rd() | 1;
+
+                slot_count = 0;
+                committed.clear();
+
+                auto reserved_entries = _num_blocks * 2 > 64 ? _num_blocks * 2 : 64;
+                header.data_offset = io::round_up(header.directory_offset + 2 * reserved_entries * sizeof(io::image_block_entry), header.page_size);
+
+                for (auto current = _head; current; current = current->_next)
+                {
+                    current->_slot = no_slot;
+                    current->_dirty = true;
+                }
+            }
+
+            // an unchanged block keeps its committed slot; any other block is written to a slot the
+            // committed directory does not refer to, so the image it describes is never overwritten
+            std::vector<bool> used(committed);
+            std::vector<bool> kept(slot_count, false);
+            for (auto current = _head; current; current = current->_next)
+            {
+                auto slot = current->_slot;
+                if (!current->_dirty && slot != no_slot && slot < slot_count && committed[slot] && !kept[slot])
+                {
+                    kept[slot] = true;
+                }
+                else
+                {
+                    current->_slot = no_slot;
+                    current->_dirty = true;
+                }
+            }
+
+            size_t next_free = 0;
+            uint64_t first = 0;
+            bool dense = true;
+            std::vector<const T*> blocks;
+            blocks.reserve(_num_blocks);
+            layout.directory.reserve(_num_blocks);
+
+            for (auto current = _head; current; current = current->_next)
+            {
+                if (current->_slot == no_slot)
+                {
+                    while (next_free < used.size() && used[next_free])
+                    {
+                        next_free++;
                     }
-                    else
+
+                    if (next_free == used.size())
                     {
-                        _elem_index--;
+                        used.push_back(false);
                     }
+
+                    current->_slot = next_free;
+                    used[next_free] = true;
                 }
-                else if (_state == iter_state::past_end)
+
+                if (current->_next && current->_size != header.block_size)
                 {
-                    _elem_index = _block_pointer->size() - 1;
-                    _state = iter_state::iter_valid;
+                    dense = false;
                 }
-                else
+
+                layout.directory.push_back(io::image_block_entry{ header.data_offset + current->_slot * header.slot_size, first, current->_size });
+                blocks.push_back(current->_dirty ? current->_arr.data() : nullptr);
+                first += current->_size;
+            }
+
+            header.file_size = header.data_offset + used.size() * header.slot_size;
+            header.flags = dense ? io::image_header::flag_dense : 0;
+            header.checkpoint_id = _checkpoint_id;
+            header.checksum = io::image_checksum(header, layout.directory.data());
+
+            if (!incremental || used.size() > slot_count)
+            {
+                if (::ftruncate(fd, static_cast<off_t>(header.file_size)) != 0)
                 {
-                    throw std::out_of_range("segmented_list iterator operator--(int)");
+                    SEGMENTED_LIST_THROW(std::system_error(errno, std::generic_category(), "segmented_list checkpoint_incremental"));
                 }
+            }
 
-                return li;
+            // payloads and the new directory first, both where the committed header does not look;
+            // then the header that switches to them
+            write_blocks(layout, blocks.data(), blocks.size());
+            io::write_image_directory(fd, layout);
+
+            if (::fdatasync(fd) != 0)
+            {
+                SEGMENTED_LIST_THROW(std::system_error(errno, std::generic_category(), "segmented_list checkpoint_incremental"));
+            }
+
+            io::write_image_header(fd, header);
+            if (::fdatasync(fd) != 0)
+            {
+                SEGMENTED_LIST_THROW(std::system_error(errno, std::generic_category(), "segmented_list checkpoint_incremental"));
+            }
+
+            for (auto current = _head; current; current = current->_next)
+            {
+                current->_dirty = false;
+            }
+        }
+#endif
+    
+    public:
+        size_t size() const noexcept
+        {
+            return _size;
+        }
+
+        size_t capacity() const noexcept
+        {
+            // blocks awaiting reclamation are still held by the list, so they are counted here
+            return _capacity + _pending_blocks * list_block<T>::block_size();
+        }
+
+        size_t pending_blocks() const noexcept
+        {
+            return _pending_blocks;
+        }
+
+        memory_footprint memory_usage() const noexcept
+        {
+            /*
+
+            memory_usage
+            Returns the bytes held by the list, broken down by what they are used for
+
+            */
+
+            const size_t block_bytes = sizeof(list_block<T>);
+            const size_t slot_bytes = sizeof(T);
+
+            memory_footprint footprint;
+            footprint.elements = _size * slot_bytes;
+            footprint.slack = (_capacity - _size) * slot_bytes;
+            footprint.block_headers = _num_blocks * (block_bytes - list_block<T>::block_size() * slot_bytes);
+            footprint.spare_blocks = (_pending_blocks + (_reserved ? 1 : 0)) * block_bytes;
+            footprint.index = _directory.capacity() * sizeof(list_block<T>*);
+            _visit_index([&footprint](auto& index) { footprint.index += index.memory_usage(); });
+            footprint.container = sizeof(*this) + (_budget ? sizeof(memory_budget) : 0);
+            return footprint;
+        }
+
+        std::vector<size_t> block_occupancy_histogram() const
+        {
+            /*
+
+            block_occupancy_histogram
+            Returns, for each possible fill level k (0 to the block size), the number of live blocks holding k elements
+
+            Walks every block.
+
+            */
+
+            std::vector<size_t> histogram(list_block<T>::block_size() + 1);
+            for (auto block = _head; block; block = block->_next)
+            {
+                histogram[block->_size]++;
+            }
+
+            return histogram;
+        }
+
+        const Instrumentation& instrumentation() const noexcept
+        {
+            // the instrumentation policy, e.g. the counters of a list_statistics
+            return _instrumentation;
+        }
+
+        Instrumentation& instrumentation() noexcept
+        {
+            return _instrumentation;
+        }
+
+        size_t max_size() const noexcept
+        {
+            return std::allocator_traits<Allocator>::max_size(_allocator);
+        }
+
+        bool empty() const noexcept
+        {
+            return _size == 0;
+        }
+
+        Allocator get_allocator() const noexcept
+        {
+            return _allocator;
+        }
+
+        reclaim_mode get_reclaim_mode() const noexcept
+        {
+            return _reclaim_mode;
+        }
+
+        void set_reclaim_mode(reclaim_mode mode) noexcept
+        {
+            /*
+
+            set_reclaim_mode
+            Selects how 'clear' (and so the destructor) gives back the list's blocks
+
+            With reclaim_immediate (the default), every block is destroyed and deallocated before
+            'clear' returns, which takes time proportional to the number of blocks.
+
+            With reclaim_background, 'clear' detaches the block chain in constant time and hands it
+            to the block_reclaimer thread. The allocator is copied into the reclaimer, so it must be
+            safe to deallocate through that copy from another thread (std::allocator is).
+
+            */
+
+            _reclaim_mode = mode;
+        }
+
+        const memory_budget* get_budget() const noexcept
+        {
+            // the memory budget, or nullptr if the list may grow freely
+            return _budget.get();
+        }
+
+        void set_budget(const memory_budget& budget)
+        {
+            /*
+
+            set_budget
+            Caps the memory the list may hold; see memory_budget
+
+            The budget is checked whenever the list would take a new block from the allocator, so a
+            budget below what the list already holds only stops it from growing. Reusing the reserved
+            block is always allowed. Only push_back and try_push_back evict under evict_head; other
+            members that grow the list (insert, read_from) throw budget_exceeded instead.
+
+            */
+
+            _budget.reset(new memory_budget(budget));
+        }
+
+        void clear_budget() noexcept
+        {
+            _budget.reset();
+        }
+
+        const indexing_policy& get_indexing() const noexcept
+        {
+            return _indexing;
+        }
+
+        void set_indexing(const indexing_policy& indexing)
+        {
+            /*
+
+            set_indexing
+            Changes how the list finds the block holding a position; see indexing_policy
+
+            A change of mode takes effect at once. Building an index takes time proportional to the
+            number of blocks, and leaving a counted index moves the elements forward so that every
+            block but the last is full again, in time proportional to the size. Otherwise, a
+            directory the new policy would not keep is dropped at once, and the rest of the change
+            takes effect at the end of the current sampling window.
+
+            */
+
+            if (_counted() && indexing.mode != _index_mode)
+            {
+                _drop_counted_index();
+            }
+
+            switch (indexing.mode)
+            {
+            case index_mode::skip_list:
+            case index_mode::counted_btree:
+            case index_mode::fenwick:
+                if (_index_mode != indexing.mode)
+                {
+                    _use_counted_index(indexing.mode);
+                }
+                break;
+            case index_mode::directory:
+                if (_index_mode != index_mode::directory)
+                {
+                    _build_directory();
+                }
+                break;
+            default:
+                if (_index_mode == index_mode::directory && _num_blocks < indexing.drop_blocks)
+                {
+                    _drop_directory();
+                }
+                break;
+            }
+
+            _indexing = indexing;
+            _sampled_lookups = 0;
+            _sampled_hops = 0;
+        }
+
+        index_mode indexing_mode() const noexcept
+        {
+            // how lookups currently find their block
+            return _index_mode;
+        }
+
+        // define our iterators
+        using iterator = list_iterator<false>;
+        using const_iterator = list_iterator<true>;
+        using reverse_iterator = std::reverse_iterator<iterator>;
+        using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+        template <bool is_const = false>
+        class segment_iterator
+        {
+            /*
+
+            segment_iterator
+            Walks the block chain, yielding each block's live elements as a segment
+
+            */
+
+            using block_pointer = 
+                typename std::conditional_t<is_const, const list_block<T> *, list_block<T> * >;
+
+            block_pointer _block_pointer;
+        public:
+            using value_type = segment<typename std::conditional_t<is_const, const T, T> >;
+            using iterator_category = std::forward_iterator_tag;
+            using difference_type = std::ptrdiff_t;
+
+            explicit segment_iterator(block_pointer p)
+                : _block_pointer(p) { }
+
+            value_type operator*() const
+            {
+                if constexpr (!is_const)
+                {
+                    // a mutable segment may be written through
+                    _block_pointer->_dirty = true;
+                }
+
+                return value_type{ _block_pointer->_arr.data(), _block_pointer->_size };
+            }
+
+            segment_iterator& operator++()
+            {
+                _block_pointer = _block_pointer->_next;
+                return *this;
+            }
+
+            bool operator==(const segment_iterator& right) const
+            {
+                return _block_pointer == right._block_pointer;
+            }
+
+            bool operator!=(const segment_iterator& right) const
+            {
+                return _block_pointer != right._block_pointer;
+            }
+        };
+
+        template <bool is_const = false>
+        struct segment_range
+        {
+            segment_iterator<is_const> first;
+            segment_iterator<is_const> last;
+
+            segment_iterator<is_const> begin() const
+            {
+                return first;
+            }
+
+            segment_iterator<is_const> end() const
+            {
+                return last;
+            }
+        };
+
+        segment_range<false> segments()
+        {
+            /*
+
+            segments
+            Returns a range over the list's blocks, each given as a segment of its live elements
+
+            This allows bulk operations (copying, I/O, vectorized loops) to work a block at a time.
+
+            */
+
+            return segment_range<false>{ segment_iterator<false>(_head), segment_iterator<false>(nullptr) };
+        }
+
+        segment_range<true> segments() const
+        {
+            return segment_range<true>{ segment_iterator<true>(_head), segment_iterator<true>(nullptr) };
+        }
+
+        reference front()
+        {
+            SEGMENTED_LIST_CHECK_BOUNDS(_size != 0, "segmented_list");
+            return _head->_arr[0];
+        }
+
+        reference back()
+        {
+            SEGMENTED_LIST_CHECK_BOUNDS(_size != 0, "segmented list");
+            return _tail->_arr[_tail->size() - 1];
+        }
+
+        iterator begin()
+        {
+            if (_size == 0)
+            {
+                // an empty list begins at its end, so that iteration stops at once
+                return end();
+            }
+            else
+            {
+                // return an iterator to the first element
+                return iterator(_head, 0, iter_state::iter_valid);
+            }
+            
+        }
+
+        const_iterator begin() const
+        {
+            return cbegin();
+        }
+
+        const_iterator cbegin() const
+        {
+            if (_size == 0)
+            {
+                return cend();
             }
+            else
+            {
+                return const_iterator(_head, 0, iter_state::iter_valid);
+            }
+        }
+
+        reverse_iterator rbegin()
+        {
+            return std::reverse_iterator<iterator>{ end() };
+        }
+
+        const_reverse_iterator crbegin() const
+        {
+            return std::reverse_iterator<const_iterator>{ cend() };
+        }
+
+        iterator end()
+        {
+            return iterator(_tail, _tail ? _tail->size() : 0, iter_state::past_end);
+        }
+
+        const_iterator end() const
+        {
+            return cend();
+        }
+
+        const_iterator cend() const
+        {
+            return const_iterator(_tail, _tail ? _tail->size() : 0, iter_state::past_end);
+        }
+
+        reverse_iterator rend()
+        {
+            return std::reverse_iterator<iterator>{ begin() };
+        }
 
-            template<bool _is_const = is_const,
-                typename std::enable_if<_is_const, int>::value = 1>
-            list_iterator& operator=(const list_iterator<false>& it)
+        const_reverse_iterator crend() const
+        {
+            return std::reverse_iterator<const_iterator>{ cbegin() };
+        }
+        
+        [[nodiscard]]
+        reference at(size_type pos)
+        {
+            // checked even when SEGMENTED_LIST_ASSERT_BOUNDS is defined
+            if (pos >= _size)
             {
-                // converting copy assignment operator
-                _block_pointer = it._block_pointer;
-                _elem_index = it._elem_index;
-                _state = it._state;
+                SEGMENTED_LIST_THROW(std::out_of_range("segmented_list"));
             }
 
-            template<bool _is_const = is_const,
-                typename std::enable_if<_is_const, int>::value = 1>
-            list_iterator& operator=(list_iterator<false>&& it)
-            {
-                // converting move assignment operator
-                _block_pointer = it._block_pointer;
-                _elem_index = it._elem_index;
-                _state = it._state;
-                
-                it._block_pointer = nullptr;
-                it._elem_index = 0;
-            }
+            return this->_at_mutable(pos);
+        }
 
-            list_iterator& operator=(const list_iterator& it)
+        [[nodiscard]]
+        constexpr const_reference at(size_type pos) const
+        {
+            if (pos >= _size)
             {
-                // default copy assignment operator
-                _block_pointer = it._block_pointer;
-                _elem_index = it._elem_index;
-                _state = it._state;
+                SEGMENTED_LIST_THROW(std::out_of_range("segmented_list"));
             }
 
-            list_iterator& operator=(list_iterator&& it)
-            {
-                // default move assignment operator
-                _block_pointer = it._block_pointer;
-                _elem_index = it._elem_index;
-                _state = it._state;
-                
-                it._block_pointer = nullptr;
-                it._elem_index = 0;
-            }
+            return this->_at(pos);
+        }
 
-            // Constructors
+        [[nodiscard]]
+        reference operator[](size_type pos)
+        {
+            // an alias for 'at', unless SEGMENTED_LIST_ASSERT_BOUNDS is defined
+            return this->_at_mutable(pos);
+        }
 
-            list_iterator() noexcept
-                : _block_pointer(nullptr)
-                , _elem_index(0)
-                , _state(iter_state::before_begin) {}
+        [[nodiscard]]
+        constexpr const_reference operator[](size_type pos) const
+        {
+            // also an alias for 'at'
+            return this->_at(pos);
+        }
 
-            list_iterator(const list_iterator& it)
-                : _block_pointer(it._block_pointer)
-                , _elem_index(it._elem_index)
-                , _state(it._state)
-            {
-                // default copy constructor
-            }
+        [[nodiscard]]
+        pointer try_at(size_type pos)
+        {
+            /*
 
-            list_iterator(list_iterator&& it)
-                : _block_pointer(it._block_pointer)
-                , _elem_index(it._elem_index)
-                , _state(it._state)
-            {
-                // default move constructor
-                it._block_pointer = nullptr;
-                it._elem_index = 0;
-            }
+            try_at
+            Returns a pointer to the element at 'pos', or nullptr if 'pos' is not a valid position
 
-            template<bool _is_const = is_const,
-                typename std::enable_if<_is_const, int>::value = 1>
-            list_iterator(const list_iterator<false>& it)
-                : _block_pointer(it._block_pointer)
-                , _elem_index(it._elem_index)
-                , _state(it._state)
-            {
-                // converting copy constructor
-            }
+            */
 
-            template<bool _is_const = is_const,
-                typename std::enable_if<_is_const, int>::value = 1>
-            list_iterator(list_iterator<false>&& it)
-                : _block_pointer(it._block_pointer)
-                , _elem_index(it._elem_index)
-                , _state(it._state)
+            if (pos >= _size)
             {
-                // converting move constructor
-                it._block_pointer = nullptr;
-                it._elem_index = 0;
+                return nullptr;
             }
-        
-        private:
-            friend class segmented_list;    // ensure the parent class is a friend
-            iter_state _state;
 
-            list_block<value_type>* _block_pointer;  // pointer to the block we are in
-            size_t _elem_index; // index within the block
+            size_type offset;
+            auto containing_node = _find_block(pos, offset);
+            containing_node->_dirty = true;
+            return &containing_node->_arr[offset];
+        }
 
-            list_iterator(list_block<value_type>* p, size_t idx, iter_state state)
-                : _block_pointer(p)
-                , _elem_index(idx)
-                , _state(state)
+        [[nodiscard]]
+        const_pointer try_at(size_type pos) const
+        {
+            if (pos >= _size)
             {
-                // private constructor
+                return nullptr;
             }
-        };
 
-        // define our class traits
-        using value_type = T;
-        using reference = T & ;
-        using pointer = T * ;
-        using const_reference = const T & ;
-        using const_pointer = const T * ;
-        using size_type = size_t;
-        using allocator_type = Allocator;
-    
-    private:
-        constexpr reference _at(size_type pos) const
+            size_type offset;
+            auto containing_node = _find_block(pos, offset);
+            return &containing_node->_arr[offset];
+        }
+
+        [[nodiscard]]
+        reference unchecked_at(size_type pos)
         {
             /*
 
-            _at
-            Returns the element at the specified position
+            unchecked_at
+            Returns the element at 'pos' without checking it; 'pos' must be less than the size
 
-            The algorithm is as follows:
-                * Divide the index (pos) by the capacity of the block
-                * This will indicate the block number we need
-                * The remainder of that division will be its index within that block
-                * Iterate through blocks until we find the proper one
-                * Index the array in the block
-            
-            The function will then return a reference. For const objects, this will be a
-            const_reference.
+            The position is only asserted, so a bad position is undefined behavior when NDEBUG is set.
 
             */
 
-            if (pos < _size)
-            {
-                // get the block size and index number
-                auto block_number = pos / list_block<value_type>::block_size();
-                auto index_number = pos % list_block<value_type>::block_size();
-                list_block<T>* containing_node = nullptr;   // the list_block containing the array we want to index
+            assert(pos < _size);
+            size_type offset;
+            auto containing_node = _find_block(pos, offset);
+            containing_node->_dirty = true;
+            return containing_node->_arr[offset];
+        }
 
-                /*
+        [[nodiscard]]
+        const_reference unchecked_at(size_type pos) const
+        {
+            assert(pos < _size);
+            size_type offset;
+            auto containing_node = _find_block(pos, offset);
+            return containing_node->_arr[offset];
+        }
 
-                Get the proper node
+        void gather(const size_type* positions, size_type count, T* out) const
+        {
+            /*
 
-                We can optimize if it's close to the head or tail of the list
-                We will also iterate from the front if it's toward the front, or the back if it's toward the back 
+            gather
+            Copies the elements at 'count' arbitrary positions into 'out', in the order of 'positions'
 
-                */
+            Rather than looking each position up on its own, the batch is sorted by position and
+            each block it touches is visited once, in chain order; the copies then prefetch a few
+            elements ahead. Throws out_of_range if any position is not valid (see
+            SEGMENTED_LIST_ASSERT_BOUNDS), before anything is copied.
 
-                if (block_number == 0)
-                {
-                    containing_node = _head;
-                }
-                else if (block_number == _num_blocks - 1)
-                {
-                    containing_node = _tail;
-                }
-                else if (block_number <= _num_blocks / 2)
-                {
-                    // iterate through the linked list until we get to the proper block            
-                    auto current_node = _head;
-                    for (size_t i = 0; i < block_number; i++)
-                    {
-                        if (current_node)
-                        {
-                            current_node = current_node->_next;
-                        }
-                        else
-                        {
-                            throw std::out_of_range("segmented_list");
-                        }
-                    }
-                    containing_node = current_node;
-                }
-                else
-                {
-                    // iterate backwards
-                    auto current_node = _tail;
-                    size_t num_times = _num_blocks - block_number - 1;
-                    for (size_t i = 0; i < num_times; i++)
-                    {
-                        if (current_node)
-                        {
-                            current_node = current_node->_previous;
-                        }
-                        else
-                        {
-                            throw std::out_of_range("segmented_list");
-                        }
-                    }
-                    containing_node = current_node;
-                }
+            */
 
-                // now, index the block's array to get the element
-                if (index_number < containing_node->_size)
-                {
-                    return containing_node->_arr[index_number];
-                }
-                else
+            std::vector<T*> elements;
+            auto order = _resolve_batch(positions, count, elements, false);
+
+            const size_type ahead = 8;
+            for (size_type i = 0; i < count; i++)
+            {
+                if (i + ahead < count)
                 {
-                    throw std::out_of_range("segmented_list");
+                    SEGMENTED_LIST_PREFETCH(elements[i + ahead], 0);
+                    SEGMENTED_LIST_PREFETCH(out + order[i + ahead], 1);
                 }
+
+                out[order[i]] = *elements[i];
             }
-            else
+        }
+
+        void scatter(const size_type* positions, size_type count, const T* in)
+        {
+            /*
+
+            scatter
+            Assigns 'in[i]' to the element at 'positions[i]', for each of the 'count' positions
+
+            The inverse of 'gather', visiting each block once in the same way and marking it dirty.
+            Where a position repeats, the last of its values is kept, as with a loop of assignments.
+            Throws out_of_range if any position is not valid, before anything is written.
+
+            */
+
+            std::vector<T*> elements;
+            auto order = _resolve_batch(positions, count, elements, true);
+
+            const size_type ahead = 8;
+            for (size_type i = 0; i < count; i++)
             {
-                throw std::out_of_range("segmented_list");
+                if (i + ahead < count)
+                {
+                    SEGMENTED_LIST_PREFETCH(elements[i + ahead], 1);
+                    SEGMENTED_LIST_PREFETCH(in + order[i + ahead], 0);
+                }
+
+                *elements[i] = in[order[i]];
             }
         }
-    
-    public:
-        size_t size() const noexcept
+
+        void push_back(const T& val)
         {
-            return _size;
+            /*
+
+            push_back
+            Adds an element to the back of the list
+
+            */
+
+            // check to see if allocating another block is necessary
+            if (!_tail || _tail->full())
+            {
+                _alloc_block(true);
+            }
+            
+            // insert the new element
+            _tail->push_back(val);
+            _size += 1; // increase the size
+            _visit_index([this](auto& index) { index.resized(_tail, 1); });
         }
 
-        size_t capacity() const noexcept
+        bool try_push_back(const T& val)
         {
-            return _capacity;
+            /*
+
+            try_push_back
+            Adds an element to the back of the list if the memory budget allows it
+
+            Returns false, without adding the element, where push_back would throw budget_exceeded.
+
+            */
+
+            if ((!_tail || _tail->full()) && !_try_alloc_block(true))
+            {
+                return false;
+            }
+
+            _tail->push_back(val);
+            _size += 1;
+            _visit_index([this](auto& index) { index.resized(_tail, 1); });
+            return true;
         }
 
-        size_t max_size() const noexcept
+        void pop_back()
         {
-            return std::allocator_traits<Allocator>::max_size(_allocator);
+            /*
+
+            pop_back
+            Removes an element from the back of the list
+        
+            If the list is empty, throws an exception
+
+            */
+
+            SEGMENTED_LIST_CHECK_BOUNDS(_size != 0, "segmented_list");
+            _pop_back();
         }
 
-        bool empty() const noexcept
+        bool try_pop_back()
         {
-            return _size == 0;
+            /*
+
+            try_pop_back
+            Removes an element from the back of the list, returning false if the list was empty
+
+            */
+
+            if (_size == 0)
+            {
+                return false;
+            }
+
+            _pop_back();
+            return true;
         }
 
-        Allocator get_allocator() const noexcept
+        iterator insert(const_iterator position, const T& val)
         {
-            return _allocator;
-        }
+            /*
 
-        // define our iterators
-        using iterator = list_iterator<false>;
-        using const_iterator = list_iterator<true>;
-        using reverse_iterator = std::reverse_iterator<iterator>;
-        using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+            insert
+            Inserts a single element into the list at 'position', returning an iterator to it
+            
+            This will move all subsequent elements back. Blocks never move, so the block 'position'
+            points into stays valid while the list grows by one. With a counted index (see
+            indexing_policy), only the elements after 'position' in its block move, and a full block
+            is split in two.
+
+            */
+
+            if (position._state != iter_state::iter_valid)
+            {
+                // inserting at the end is an append
+                push_back(val);
+                return iterator(_tail, _tail->size() - 1, iter_state::iter_valid);
+            }
+
+            auto target = position._block_pointer;
+            auto target_index = position._elem_index;
+
+            // 'val' may refer to an element of this list, which the shift would overwrite
+            T value(val);
 
-        reference front()
-        {
-            if (_size == 0)
+            if (_counted())
             {
-                throw std::out_of_range("segmented_list");
+                return _insert_local(target, target_index, std::move(value));
             }
-            else
+
+            // make room at the end; the new last element is overwritten by the shift below
+            // evicting here could drop the block 'position' points into, so a ring list fails instead
+            if (_size == _capacity)
+            {
+                _alloc_block();
+            }
+            _tail->push_back(value);
+            _size += 1;
+
+            // move each element back by one, walking from the end to 'position'
+            auto block = _tail;
+            auto index = _tail->size() - 1;
+            size_t moved = 0;
+            while (block != target || index != target_index)
             {
-                return _head->_arr[0];
+                moved++;
+                auto previous = index == 0 ? block->_previous : block;
+                auto previous_index = index == 0 ? previous->size() - 1 : index - 1;
+
+                block->_arr[index] = std::move(previous->_arr[previous_index]);
+                block->_dirty = true;
+
+                block = previous;
+                index = previous_index;
             }
+
+            target->_arr[target_index] = std::move(value);
+            target->_dirty = true;
+            _instrumentation.on_elements_moved(moved);
+            return iterator(target, target_index, iter_state::iter_valid);
         }
 
-        reference back()
+        iterator erase(const_iterator position)
         {
-            if (_size == 0)
+            /*
+
+            erase
+            Removes a single element (at 'position') from the list, returning an iterator to the element after it
+
+            This will move all subsequent elements up one position. With a counted index (see
+            indexing_policy), only the elements after 'position' in its block move.
+
+            */
+
+            SEGMENTED_LIST_CHECK_BOUNDS(position._state == iter_state::iter_valid, "segmented_list erase");
+
+            auto block = position._block_pointer;
+            auto index = position._elem_index;
+
+            if (_counted())
             {
-                throw std::out_of_range("segmented list");
+                return _erase_local(block, index);
             }
-            else
+
+            // move each following element up by one
+            auto current = block;
+            auto current_index = index;
+            size_t moved = 0;
+            while (current != _tail || current_index + 1 != _tail->size())
+            {
+                moved++;
+                auto next = current_index + 1 == current->size() ? current->_next : current;
+                auto next_index = current_index + 1 == current->size() ? 0 : current_index + 1;
+
+                current->_arr[current_index] = std::move(next->_arr[next_index]);
+                current->_dirty = true;
+
+                current = next;
+                current_index = next_index;
+            }
+
+            // the last element is now a duplicate; removing it also releases the tail block if it empties
+            bool erased_last = block == _tail && index + 1 == _tail->size();
+            _instrumentation.on_elements_moved(moved);
+            pop_back();
+
+            if (erased_last)
             {
-                return _tail->_arr[_tail->size() - 1];
+                return end();
             }
+
+            return iterator(block, index, iter_state::iter_valid);
         }
 
-        iterator begin()
+        void shrink_to_fit()
         {
-            if (_size == 0)
+            /*
+
+            shrink_to_fit
+            Gives back the block kept in reserve, so the list holds no memory beyond its live blocks
+
+            The reserve saves an allocation when a list shrinks and grows again across a block
+            boundary; lists that are done growing can release it. The block directory, if there is
+            one, is trimmed to fit too.
+
+            */
+
+            if (_reserved)
             {
-                // return an iterator to the invalid iterator
-                return iterator(_head, 0, iter_state::before_begin);
+                std::allocator_traits<Allocator>::destroy(_allocator, _reserved);
+                std::allocator_traits<Allocator>::deallocate(_allocator, _reserved, 1);
+                _reserved = nullptr;
+                _instrumentation.on_blocks_released(1, false);
             }
-            else
+
+            // the directory keeps whatever capacity it grew to, less any prefix left by evictions
+            if (_index_mode == index_mode::directory)
             {
-                // return an iterator to the first element
-                return iterator(_head, 0, iter_state::iter_valid);
+                _directory.erase(_directory.begin(), _directory.begin() + _directory_front);
+                _directory_front = 0;
+                _directory.shrink_to_fit();
             }
-            
         }
 
-        const_iterator begin() const
+        void clear()
         {
-            return cbegin();
-        }
+            /*
 
-        const_iterator cbegin() const
-        {
-            if (_size == 0)
+            clear
+            Erase all blocks in the container, leaving it with a size and capacity of 0
+
+            In reclaim_background mode, the blocks are detached and reclaimed on another thread
+            Any blocks still pending from 'clear_incremental' are reclaimed along with the rest
+
+            */
+
+            // whatever is already pending goes along with the live blocks
+            auto released = _num_blocks + _pending_blocks + (_reserved ? 1 : 0);
+            if (released)
             {
-                return const_iterator(_head, 0, iter_state::before_begin);
+                _instrumentation.on_blocks_released(released, false);
+            }
+
+            auto chain = _detach_blocks(_pending);
+            _pending = nullptr;
+            _pending_blocks = 0;
+
+            if (_reclaim_mode == reclaim_mode::reclaim_background && chain)
+            {
+                // the reclaimer now owns the chain
+                auto alloc = _allocator;
+                block_reclaimer::instance().submit([chain, alloc]() mutable {
+                    _destroy_chain(alloc, chain);
+                });
             }
             else
             {
-                return const_iterator(_head, 0, iter_state::iter_valid);
+                _destroy_chain(_allocator, chain);
             }
         }
 
-        reverse_iterator rbegin()
+        void clear_incremental()
         {
-            return std::reverse_iterator<iterator>{ end() };
-        }
+            /*
 
-        const_reverse_iterator crbegin() const
-        {
-            return std::reverse_iterator<const_iterator>{ cend() };
-        }
+            clear_incremental
+            Empties the list in constant time without deallocating anything
 
-        iterator end()
-        {
-            return iterator(_tail, _tail->size(), iter_state::past_end);
-        }
+            The blocks are moved onto a pending chain and are destroyed by later calls to 'step'.
+            Until then, they are still counted by 'capacity'. The list may be used normally in the
+            meantime; new elements go into freshly allocated blocks.
 
-        const_iterator end() const
-        {
-            return cend();
-        }
+            */
 
-        const_iterator cend() const
-        {
-            return const_iterator(_tail, _tail->size(), iter_state::past_end);
+            _pending_blocks += _num_blocks + (_reserved ? 1 : 0);
+            _pending = _detach_blocks(_pending);
         }
 
-        reverse_iterator rend()
+        size_t step(size_t max_blocks)
         {
-            return std::reverse_iterator<iterator>{ begin() };
-        }
+            /*
 
-        const_reverse_iterator crend() const
-        {
-            return std::reverse_iterator<const_iterator>{ cbegin() };
-        }
-        
-        [[nodiscard]]
-        constexpr reference at(size_type pos)
-        {
-            return this->_at(pos);
-        }
+            step
+            Destroys up to 'max_blocks' of the blocks left pending by 'clear_incremental'
 
-        [[nodiscard]]
-        constexpr const_reference at(size_type pos) const
-        {
-            return this->_at(pos);
-        }
+            Returns the number of blocks destroyed; once 'pending_blocks' is 0, there is nothing left to do.
 
-        [[nodiscard]]
-        constexpr reference operator[](size_type pos)
-        {
-            // an alias for 'at'
-            return this->_at(pos);
-        }
+            */
 
-        [[nodiscard]]
-        constexpr const_reference operator[](size_type pos) const
-        {
-            // also an alias for 'at'
-            return this->_at(pos);
+            auto destroyed = _destroy_chain(_allocator, _pending, max_blocks);
+            _pending_blocks -= destroyed;
+            if (destroyed)
+            {
+                _instrumentation.on_blocks_released(destroyed, false);
+            }
+            return destroyed;
         }
 
-        void push_back(const T& val)
+#ifdef SEGMENTED_LIST_POSIX_IO
+        void write_to(int fd) const
         {
             /*
 
-            push_back
-            Adds an element to the back of the list
+            write_to
+            Writes the list to the file descriptor 'fd', starting at its current offset
+
+            The output is an io::stream_header followed by every element in order. Each block's live
+            elements are passed to writev directly, one iovec per block, so nothing is copied into an
+            intermediate buffer. Only available for trivially copyable T.
+
+            Throws std::system_error if a write fails.
 
             */
 
-            // check to see if allocating another block is necessary
-            if (_size == _capacity)
+            static_assert(std::is_trivially_copyable<T>::value, "segmented_list::write_to requires a trivially copyable T");
+
+            auto header = _stream_header();
+
+            iovec iov[io::max_iovecs];
+            int count = 0;
+
+            iov[count].iov_base = &header;
+            iov[count].iov_len = sizeof(header);
+            count++;
+
+            for (auto current = _head; current; current = current->_next)
             {
-                _alloc_block();
+                if (current->_size == 0)
+                {
+                    continue;
+                }
+
+                // flush the batch once every iovec is in use
+                if (count == io::max_iovecs)
+                {
+                    io::writev_fully(fd, iov, count);
+                    count = 0;
+                }
+
+                iov[count].iov_base = const_cast<T*>(current->_arr.data());
+                iov[count].iov_len = current->_size * sizeof(T);
+                count++;
             }
-            
-            // insert the new element
-            _tail->push_back(val);
-            _size += 1; // increase the size
+
+            io::writev_fully(fd, iov, count);
         }
 
-        void pop_back()
+        template <typename BlockIO>
+        void write_to(int fd, BlockIO* block_io) const
         {
             /*
 
-            pop_back
-            Removes an element from the back of the list
-        
-            If the list is empty, throws an exception
+            write_to
+            Like the above, but queues each block on 'block_io' (see block_io.hpp) as a write at its own offset
+
+            Many blocks can then be in flight at once; the file position is left at the end of the
+            stream either way. A null 'block_io' writes with writev. This is a template only so that
+            the core header does not need block_io.hpp; include it to use these overloads.
 
             */
 
-            if (_size == 0)
+            static_assert(std::is_trivially_copyable<T>::value, "segmented_list::write_to requires a trivially copyable T");
+
+            if (!block_io)
             {
-                throw std::out_of_range("segmented_list");
+                write_to(fd);
+                return;
             }
-            else
-            {
-                // decrease the _tail size
-                _tail->_size -= 1;
-                _size--;
 
-                // if the size is zero, decrease the capacity
-                if (_tail->_size == 0)
-                {
-                    auto new_tail = _tail->_previous;
-                    new_tail->_next = nullptr;
+            auto header = _stream_header();
+            auto start = ::lseek(fd, 0, SEEK_CUR);
+            if (start < 0)
+            {
+                SEGMENTED_LIST_THROW(std::system_error(errno, std::generic_category(), "segmented_list write_to"));
+            }
 
-                    // if we have a block reserved already, deallocate this block
-                    // otherwise, use _this_ block as our block in reserve
-                    if (_reserved)
-                    {
-                        // destroy and deallocate
-                        std::allocator_traits<Allocator>::destroy(_allocator, _tail);
-                        std::allocator_traits<Allocator>::deallocate(_allocator, _tail, 1);
-                    }
-                    else
-                    {
-                        // set this node as our reserve node
-                        _reserved = _tail;
-                        _reserved->_previous = nullptr;
-                        _reserved->_next = nullptr;
-                        _reserved->_size = 0;
-                    }
+            auto offset = start;
+            block_io->write(fd, &header, sizeof(header), offset);
+            offset += static_cast<off_t>(sizeof(header));
 
-                    // update the tail node and the capacity
-                    _tail = new_tail;
-                    _capacity -= list_block<T>::block_size();
-                    _num_blocks--;
-                }
+            for (auto current = _head; current; current = current->_next)
+            {
+                block_io->write(fd, current->_arr.data(), current->_size * sizeof(T), offset);
+                offset += static_cast<off_t>(current->_size * sizeof(T));
             }
+
+            block_io->wait_all();
+            ::lseek(fd, offset, SEEK_SET);
         }
 
-        void insert(const_iterator position, const T& val)
+        void read_from(int fd)
         {
             /*
 
-            insert
-            Inserts a single element into the list at 'position'
-            
-            This will move all subsequent elements back
+            read_from
+            Replaces the contents of the list with a list previously written by 'write_to'
+
+            Reading starts at the current offset of 'fd'. Blocks are allocated up front and filled
+            directly by readv, one iovec per block. Only available for trivially copyable T.
+
+            Throws std::system_error if a read fails, or std::runtime_error if the data is not a
+            compatible stream or ends early. The list is left empty on failure.
 
             */
 
-            // increment the size and allocate another block if needed
-            _size++;
-            if (_size >= _capacity)
-            {
-                _alloc_block();
-            }
+            static_assert(std::is_trivially_copyable<T>::value, "segmented_list::read_from requires a trivially copyable T");
 
-            // utilize reverse iterators to move elements back
-            reverse_iterator new_position = rbegin();
-            reverse_iterator old_position = ++new_position;
+            auto element_count = _begin_stream(fd);
 
-            // continue moving back elements until the element after 'old_position'
-            // (i.e., 'new_position') is the position to which we are inserting
-            while (old_position.base() != position)
+#ifdef SEGMENTED_LIST_EXCEPTIONS
+            try
+#endif
             {
-                // move the element back
-                *new_position = *old_position;
+                _alloc_stream_blocks(element_count);
 
-                // update the iterators
-                old_position++;
-                new_position++;
-            }
+                iovec iov[io::max_iovecs];
+                int count = 0;
+                for (auto block = _head; block; block = block->_next)
+                {
+                    if (count == io::max_iovecs)
+                    {
+                        io::readv_fully(fd, iov, count);
+                        count = 0;
+                    }
+
+                    iov[count].iov_base = block->_arr.data();
+                    iov[count].iov_len = block->_size * sizeof(T);
+                    count++;
+                }
 
-            // update the element at 'position'
-            *position = val;
+                io::readv_fully(fd, iov, count);
+            }
+#ifdef SEGMENTED_LIST_EXCEPTIONS
+            catch (...)
+            {
+                clear();
+                throw;
+            }
+#endif
         }
 
-        void erase(const_iterator position)
+        template <typename BlockIO>
+        void read_from(int fd, BlockIO* block_io)
         {
             /*
 
-            erase
-            Removes a single element (at 'position') from the list
+            read_from
+            Like the above, but queues each block on 'block_io' (see block_io.hpp) as a read from its own offset
 
-            This will move all subsequent elements up one position
+            The file position is left at the end of the stream either way. A null 'block_io' reads
+            with readv.
 
             */
 
-            iterator cur = position;
-            iterator next = ++cur;  // set 'next' to point to the element after cur via operator++()
-            while (next != this->end())
+            static_assert(std::is_trivially_copyable<T>::value, "segmented_list::read_from requires a trivially copyable T");
+
+            if (!block_io)
             {
-                *cur = *next;
-                cur++;
-                next++;
+                read_from(fd);
+                return;
             }
 
-            // update the size (and capacity if necessary)
-            _size--;
-            if (_tail->empty())
+            auto element_count = _begin_stream(fd);
+
+#ifdef SEGMENTED_LIST_EXCEPTIONS
+            try
+#endif
             {
-                if (_reserved)
+                auto offset = ::lseek(fd, 0, SEEK_CUR);
+                if (offset < 0)
                 {
-                    // update the tail node
-                    _reserved = _tail;
-                    _tail = _tail->_previous;
-
-                    // clear size and chain data from the reserved block
-                    _reserved->_size = 0;
-                    _reserved->_previous = nullptr;
-                    _reserved->_next = nullptr;
+                    SEGMENTED_LIST_THROW(std::system_error(errno, std::generic_category(), "segmented_list read_from"));
                 }
-                else
+
+                // every block is allocated before any read is queued, so a failed allocation never
+                // frees a block the kernel is still filling; 'wait_all' only throws once nothing is
+                // in flight, so the list can then be cleared
+                _alloc_stream_blocks(element_count);
+                for (auto block = _head; block; block = block->_next)
                 {
-                    // mark the new end of the list
-                    auto to_delete = _tail;
-                    _tail = _tail->_previous;
-                    _tail->_next = nullptr;
-
-                    // destroy and deallocate the old _tail node
-                    std::allocator_traits<Allocator>::destroy(_allocator, to_delete);
-                    std::allocator_traits<Allocator>::deallocate(_allocator, to_delete, 1);
+                    block_io->read(fd, block->_arr.data(), block->_size * sizeof(T), offset);
+                    offset += static_cast<off_t>(block->_size * sizeof(T));
                 }
+
+                block_io->wait_all();
+                ::lseek(fd, offset, SEEK_SET);
+            }
+#ifdef SEGMENTED_LIST_EXCEPTIONS
+            catch (...)
+            {
+                clear();
+                throw;
             }
+#endif
         }
 
-        void clear()
+        void checkpoint_incremental(int fd)
         {
             /*
 
-            clear
-            Erase all blocks in the container, leaving it with a size and capacity of 0
+            checkpoint_incremental
+            Brings the list image in 'fd' up to date, writing only the blocks changed since the last checkpoint
+
+            The file uses the image format (see io::image_header), so it can be opened with
+            mapped_list. Each block is given a slot in the file the first time it is checkpointed
+            and keeps it afterwards; blocks that have not been written to since (see below) are
+            skipped, and the directory and header are rewritten to describe the current list.
+
+            A block is considered changed once push_back, insert or erase has touched it, or once a
+            mutable reference to one of its elements has been handed out (by at, operator[], a
+            mutable iterator or a mutable segment). Writes made through such a reference after the
+            checkpoint are only picked up if the reference is obtained again.
+
+            A full image is written instead if the file does not hold this list's previous
+            checkpoint, or if the directory has outgrown the space reserved for it. Otherwise the
+            checkpoint is copy-on-write: a changed block is written to a slot the committed
+            directory does not use, the new directory goes to the image's other directory area,
+            and both are made durable with fdatasync before the header that switches to them is
+            written. A crash part way through a checkpoint therefore leaves the previous one
+            intact. The slots the previous directory used are free again from the next checkpoint,
+            so the file holds up to one extra slot per changed block. A full rewrite has no
+            previous checkpoint to protect and overwrites the file in place.
+
+            Only available for trivially copyable T. Throws std::system_error if an I/O call fails.
 
             */
 
-            auto current = _head;
-            while (current)
-            {
-                // get the next block (to save the address)
-                auto next = current->_next;
-                
-                // destroy and deallocate the block
-                std::allocator_traits<Allocator>::destroy(_allocator, current);
-                std::allocator_traits<Allocator>::deallocate(_allocator, current, 1);
+            _checkpoint_incremental(fd, [fd](const io::image_layout<T>& layout, const T* const* blocks, size_t count) {
+                io::write_image_blocks(fd, layout, blocks, count);
+            });
+        }
 
-                // update the current block
-                current = next;
-            }
+        template <typename BlockIO>
+        void checkpoint_incremental(int fd, BlockIO* block_io)
+        {
+            /*
 
-            // if there was a block on reserve, destroy and deallocate that too
-            if (_reserved)
-            {
-                std::allocator_traits<Allocator>::destroy(_allocator, _reserved);
-                std::allocator_traits<Allocator>::deallocate(_allocator, _reserved, 1);
+            checkpoint_incremental
+            Like the above, but queues the changed blocks on 'block_io' (see block_io.hpp) rather than writing them with pwritev
 
-                _reserved = nullptr;
-            }
+            A null 'block_io' writes with pwritev.
 
-            // update our members
-            _capacity = 0;
-            _size = 0;
-            _num_blocks = 0;
+            */
 
-            _head = nullptr;
-            _tail = nullptr;
+            if (!block_io)
+            {
+                checkpoint_incremental(fd);
+                return;
+            }
+
+            _checkpoint_incremental(fd, [fd, block_io](const io::image_layout<T>& layout, const T* const* blocks, size_t count) {
+                // found by argument-dependent lookup, in block_io.hpp
+                write_image_blocks(fd, layout, blocks, count, *block_io);
+            });
         }
+#endif
 
         // constructors
         // todo: follow C++20 standards
 
         explicit segmented_list(const Allocator& alloc) noexcept
-            : _allocator(alloc) { }
+            : _head(nullptr)
+            , _tail(nullptr)
+            , _reserved(nullptr)
+            , _allocator(alloc)
+            , _capacity(0)
+            , _size(0)
+            , _num_blocks(0)
+            , _reclaim_mode(reclaim_mode::reclaim_immediate)
+            , _checkpoint_id(0)
+            , _pending(nullptr)
+            , _pending_blocks(0)
+            , _index_mode(index_mode::chain)
+            , _directory_front(0)
+            , _sampled_lookups(0)
+            , _sampled_hops(0)
+            , _finger(nullptr)
+            , _finger_number(0) { }
 
         segmented_list(size_t count, const T& value, const Allocator& alloc = Allocator())
-            : _allocator(alloc)
+            : segmented_list(alloc)
         {
             // initialize with 'count' elements all equal to 'value'
             // fill the space with values; the container will automatically be resized when needed
@@ -1020,55 +3340,75 @@ namespace segmented_list
         }
 
         explicit segmented_list(size_t count, const Allocator& alloc = Allocator())
-            : _allocator(alloc)
+            : segmented_list(count, T(), alloc)
         {
             // initial size of 'count' with default-inserted T
-            // todo: properly construct
         }
 
         segmented_list(const std::initializer_list<T>& il)
-            : segmented_list()
+            : segmented_list(Allocator())
         {
             // initialization with initializer list
-            // todo: properly construct
+            for (const auto& value : il)
+            {
+                this->push_back(value);
+            }
         }
 
         segmented_list(const segmented_list& other)
-            : _allocator(other._allocator)
-            , _num_blocks(other._num_blocks)
-            , _size(other._size)
-            , _capacity(other._capacity)
+            : segmented_list(other._allocator)
         {
-            // copy constructor
-            // todo: properly copy-construct this
+            // copy constructor; the instrumentation is copied first, so it sees the copy's blocks too
+            _reclaim_mode = other._reclaim_mode;
+            _instrumentation = other._instrumentation;
+            for (auto seg : other.segments())
+            {
+                for (const auto& value : seg)
+                {
+                    this->push_back(value);
+                }
+            }
+
+            // set after copying, since 'other' may hold more than its budget allows
+            if (other._budget)
+            {
+                set_budget(*other._budget);
+            }
+
+            set_indexing(other._indexing);
         }
 
         segmented_list(segmented_list&& other) noexcept
-            : _head(other._head)
-            , _tail(other._tail)
-            , _num_blocks(other._num_blocks)
-            , _size(other._size)
-            , _capacity(other._capacity)
-            , _allocator(other._allocator)
+            : segmented_list(std::move(other), other._allocator)
         {
             // move constructor
-            other._head = nullptr;
-            other._tail = nullptr;
-            other._before_beginning = nullptr;
-            other._past_end = nullptr;
-            other._num_blocks = 0;
-            other._size = 0;
-            other._capacity = 0;
-            other._allocator = nullptr;
         }
 
         segmented_list(segmented_list&& other, const Allocator& alloc)
             : _head(other._head)
             , _tail(other._tail)
-            , _num_blocks(other._num_blocks)
-            , _size(other._size)
-            , _capacity(other._capacity)
+            , _reserved(other._reserved)
             , _allocator(alloc)
+            , _capacity(other._capacity)
+            , _size(other._size)
+            , _num_blocks(other._num_blocks)
+            , _reclaim_mode(other._reclaim_mode)
+            , _checkpoint_id(other._checkpoint_id)
+            , _pending(other._pending)
+            , _pending_blocks(other._pending_blocks)
+            , _instrumentation(std::move(other._instrumentation))
+            , _budget(std::move(other._budget))
+            , _indexing(other._indexing)
+            , _index_mode(other._index_mode)
+            , _directory(std::move(other._directory))
+            , _directory_front(other._directory_front)
+            , _sampled_lookups(0)
+            , _sampled_hops(0)
+            , _finger(other._finger)
+            , _finger_number(other._finger_number)
+            , _skip_index(std::move(other._skip_index))
+            , _btree_index(std::move(other._btree_index))
+            , _fenwick_index(std::move(other._fenwick_index))
         {
             // allocator-extended move constructor
 
@@ -1076,12 +3416,17 @@ namespace segmented_list
 
             other._head = nullptr;
             other._tail = nullptr;
-            other._before_beginning = nullptr;
-            other._past_end = nullptr;
+            other._reserved = nullptr;
             other._num_blocks = 0;
             other._size = 0;
             other._capacity = 0;
-            other._allocator = nullptr;
+            other._pending = nullptr;
+            other._pending_blocks = 0;
+            other._indexing = indexing_policy();
+            other._index_mode = index_mode::chain;
+            other._directory.clear();
+            other._directory_front = 0;
+            other._finger = nullptr;
         }
 
         segmented_list() noexcept
@@ -1090,25 +3435,36 @@ namespace segmented_list
             , _reserved(nullptr)
             , _size(0)
             , _capacity(0)
-            , _num_blocks(0) { }
+            , _num_blocks(0)
+            , _reclaim_mode(reclaim_mode::reclaim_immediate)
+            , _checkpoint_id(0)
+            , _pending(nullptr)
+            , _pending_blocks(0)
+            , _index_mode(index_mode::chain)
+            , _directory_front(0)
+            , _sampled_lookups(0)
+            , _sampled_hops(0)
+            , _finger(nullptr)
+            , _finger_number(0) { }
 
         ~segmented_list()
         {
             // deallocate each block by calling 'clear'
+            // in reclaim_background mode, this returns without waiting for the deallocations
             clear();
         }
     };
 
 
-    template<typename T, typename Allocator = std::allocator<list_block<T> > >
-    auto begin(segmented_list<T, Allocator>& sl) -> decltype(sl.begin()) { return sl.begin(); }
+    template<typename T, typename Allocator, typename Instrumentation>
+    auto begin(segmented_list<T, Allocator, Instrumentation>& sl) -> decltype(sl.begin()) { return sl.begin(); }
 
-    template<typename T, typename Allocator = std::allocator<list_block<T> > >
-    auto end(segmented_list<T, Allocator>& sl) -> decltype(sl.end()) { return sl.end(); }
+    template<typename T, typename Allocator, typename Instrumentation>
+    auto end(segmented_list<T, Allocator, Instrumentation>& sl) -> decltype(sl.end()) { return sl.end(); }
 
-    template<typename T, typename Allocator = std::allocator<list_block<T> > >
-    auto begin(const segmented_list<T, Allocator>& sl) -> decltype(sl.cbegin()) { return sl.cbegin(); }
+    template<typename T, typename Allocator, typename Instrumentation>
+    auto begin(const segmented_list<T, Allocator, Instrumentation>& sl) -> decltype(sl.cbegin()) { return sl.cbegin(); }
 
-    template<typename T, typename Allocator = std::allocator<list_block<T> > >
-    auto end(const segmented_list<T, Allocator>& sl) -> decltype(sl.cend()) { return sl.cend(); }
+    template<typename T, typename Allocator, typename Instrumentation>
+    auto end(const segmented_list<T, Allocator, Instrumentation>& sl) -> decltype(sl.cend()) { return sl.cend(); }
 }
@@ -0,0 +1,94 @@
+/*
+
+instrumentation_test.cpp
+Copyright 2020 Riley Lannon
+
+Checks that a list's instrumentation policy travels with it when the list is copied or moved
+
+*/
+
+#include "segmented_list.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <utility>
+
+namespace
+{
+    using segmented_list::block_event;
+    using segmented_list::block_event_hooks;
+    using segmented_list::list_block;
+    using segmented_list::list_statistics;
+
+    int failures = 0;
+
+    void check(bool condition, const char* what)
+    {
+        if (!condition)
+        {
+            std::fprintf(stderr, "FAILED: %s\n", what);
+            failures++;
+        }
+    }
+
+    void moved_hooks_keep_firing()
+    {
+        using list = segmented_list::segmented_list<int, std::allocator<list_block<int> >, block_event_hooks>;
+
+        size_t allocated = 0;
+        list a;
+        a.instrumentation().handler = [&allocated](block_event e, size_t count) {
+            if (e == block_event::allocated)
+            {
+                allocated += count;
+            }
+        };
+
+        a.push_back(1);
+        check(allocated == 1, "the handler sees the first block");
+
+        auto b = std::move(a);
+        check(static_cast<bool>(b.instrumentation().handler), "a moved list keeps its handler");
+        for (int i = 0; i < 100; i++)
+        {
+            b.push_back(i);
+        }
+        check(allocated > 1, "the handler still fires after a move");
+
+        auto before = allocated;
+        list c(b);
+        check(static_cast<bool>(c.instrumentation().handler), "a copied list gets the handler");
+        check(allocated > before, "the handler sees the copy's blocks");
+    }
+
+    void moved_statistics_keep_counting()
+    {
+        using list = segmented_list::segmented_list<int, std::allocator<list_block<int> >, list_statistics>;
+
+        list a;
+        for (int i = 0; i < 100; i++)
+        {
+            a.push_back(i);
+        }
+
+        auto acquired = a.instrumentation().blocks_allocated;
+        check(acquired > 0, "blocks are counted");
+
+        auto b = std::move(a);
+        check(b.instrumentation().blocks_allocated == acquired, "a moved list keeps its counters");
+    }
+}
+
+int main()
+{
+    moved_hooks_keep_firing();
+    moved_statistics_keep_counting();
+
+    if (failures)
+    {
+        return EXIT_FAILURE;
+    }
+
+    std::printf("instrumentation_test: ok\n");
+    return EXIT_SUCCESS;
+}